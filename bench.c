@@ -0,0 +1,785 @@
+/**
+ * Benchmarks for the modules in this repository. Build and run with
+ *
+ *   make bench && ./bench
+ *
+ * Each benchmark prints the time taken by the library function and, where it
+ * makes sense, by the straightforward implementation that it replaced.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "qarena.h"
+#include "qbuilder.h"
+#include "qhash.h"
+#include "qintern.h"
+#include "qio.h"
+#include "qrope.h"
+#include "qshared.h"
+#include "qsmall.h"
+#include "qstring_utf8.h"
+#include "qstring.h"
+
+
+/* The size of the haystack used by the search benchmarks. */
+#define HAYSTACK_SIZE (16 * 1024 * 1024)
+
+/* Keep results alive so the compiler can't optimize the benchmarks away. */
+volatile size_t sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double seconds, size_t nbytes) {
+    printf("  %-32s %8.3f ms  %8.2f MB/s\n", name, seconds * 1e3,
+        nbytes / seconds / 1e6);
+}
+
+/* Fill a buffer of `n` bytes with pseudo-random log lines. The alphabet is
+ * small so that first-byte matches are frequent, which is the hard case for
+ * searches that skip with memchr.
+ */
+static qstring make_haystack(size_t n) {
+    static const char* words[] = {
+        "GET", "POST", "/index.html", "/api/v1/users", "200", "404", "500",
+        "host-a", "host-b", "status=ok", "status=error", "latency=12ms",
+        "user=alice", "user=bob", "request", "response", "-", "cache",
+    };
+    size_t nwords = sizeof words / sizeof words[0];
+
+    char* data = malloc(n + 1);
+    size_t pos = 0;
+    unsigned long state = 12345;
+    while (pos < n) {
+        state = state * 1103515245 + 12345;
+        const char* w = words[(state >> 16) % nwords];
+        size_t wlen = strlen(w);
+        for (size_t i = 0; i < wlen && pos < n; i++) {
+            data[pos++] = w[i];
+        }
+        if (pos < n) {
+            data[pos++] = ((state >> 8) % 8 == 0) ? '\n' : ' ';
+        }
+    }
+    data[n] = '\0';
+    qstring ret = {.len = n, .data = data};
+    return ret;
+}
+
+/* The memcmp-at-every-offset loop that qstring_find_in used to be. */
+static size_t naive_find(qstring qs, qstring datum) {
+    if (datum.len > qs.len) {
+        return qs.len;
+    }
+    for (size_t i = 0; i + datum.len <= qs.len; i++) {
+        if (memcmp(qs.data + i, datum.data, datum.len) == 0) {
+            return i;
+        }
+    }
+    return qs.len;
+}
+
+/* The memcmp-at-every-offset loop that qstring_count used to be. */
+static size_t naive_count(qstring qs, qstring datum) {
+    size_t count = 0;
+    size_t i = 0;
+    while (i + datum.len <= qs.len) {
+        if (memcmp(qs.data + i, datum.data, datum.len) == 0) {
+            count++;
+            i += datum.len;
+        } else {
+            i++;
+        }
+    }
+    return count;
+}
+
+static void bench_find(qstring haystack) {
+    const char* needles[] = {
+        "Q",
+        "status=fatal",
+        "user=carol status=ok",
+        "GET /api/v1/users 200 host-a latency=999ms",
+        "POST /api/v1/users 500 host-b status=error user=mallory request",
+    };
+    size_t nneedles = sizeof needles / sizeof needles[0];
+
+    printf("qstring_find (%d MB haystack, needle not present)\n",
+        HAYSTACK_SIZE / (1024 * 1024));
+    for (size_t i = 0; i < nneedles; i++) {
+        qstring needle = qliteral(needles[i]);
+        printf(" needle length %zu\n", needle.len);
+
+        double start = now();
+        sink = naive_find(haystack, needle);
+        report("naive loop", now() - start, haystack.len);
+
+        start = now();
+        sink = qstring_find(haystack, needle);
+        report("qstring_find", now() - start, haystack.len);
+    }
+}
+
+static void bench_count(qstring haystack) {
+    const char* needles[] = {"\n", "status=ok", "GET /api/v1/users"};
+    size_t nneedles = sizeof needles / sizeof needles[0];
+
+    printf("qstring_count (%d MB haystack)\n", HAYSTACK_SIZE / (1024 * 1024));
+    for (size_t i = 0; i < nneedles; i++) {
+        qstring needle = qliteral(needles[i]);
+        printf(" needle length %zu\n", needle.len);
+
+        double start = now();
+        sink = naive_count(haystack, needle);
+        report("naive loop", now() - start, haystack.len);
+
+        start = now();
+        sink = qstring_count(haystack, needle);
+        report("qstring_count", now() - start, haystack.len);
+    }
+}
+
+static void bench_find_ci(qstring haystack) {
+    qstring needle = qliteral("USER=Carol STATUS=OK");
+    printf("case-insensitive find (needle not present)\n");
+
+    /* Lower-case a copy of the haystack, then search it. */
+    double start = now();
+    char* lowered = malloc(haystack.len + 1);
+    for (size_t i = 0; i <= haystack.len; i++) {
+        lowered[i] = tolower((unsigned char)haystack.data[i]);
+    }
+    qstring lowered_qs = {.len = haystack.len, .data = lowered};
+    sink = qstring_find(lowered_qs, qliteral("user=carol status=ok"));
+    free(lowered);
+    report("tolower copy + qstring_find", now() - start, haystack.len);
+
+    start = now();
+    sink = qstring_find_ci(haystack, needle);
+    report("qstring_find_ci", now() - start, haystack.len);
+}
+
+static void bench_build(void) {
+    const size_t nfields = 20000;
+    qstring field = qliteral("field-value");
+    printf("building a %zu-field line\n", nfields);
+
+    double start = now();
+    qstring line = qstring_new("");
+    for (size_t i = 0; i < nfields; i++) {
+        qstring next = qstring_concat(line, field);
+        qstring_cleanup(line);
+        line = next;
+    }
+    report("qstring_concat", now() - start, line.len);
+    sink = line.len;
+    qstring_cleanup(line);
+
+    start = now();
+    qbuilder b = qbuilder_new();
+    for (size_t i = 0; i < nfields; i++) {
+        qbuilder_append(&b, field);
+    }
+    line = qbuilder_finish(&b);
+    report("qbuilder_append", now() - start, line.len);
+    sink = line.len;
+    qstring_cleanup(line);
+}
+
+/* Simulate parsing many small requests: each one takes a handful of short
+ * substrings and joins them, and everything is thrown away at the end of the
+ * request.
+ */
+static void bench_arena(qstring haystack) {
+    const size_t nrequests = 200000;
+    const size_t nfields = 8;
+    printf("%zu requests of %zu small allocations each\n", nrequests,
+        nfields * 2);
+
+    double start = now();
+    for (size_t r = 0; r < nrequests; r++) {
+        qstring fields[8];
+        for (size_t i = 0; i < nfields; i++) {
+            qstring sub = qstring_substr(haystack, (r * 64 + i * 8) % 4096, 8);
+            fields[i] = qstring_concat(sub, qliteral(";"));
+            qstring_cleanup(sub);
+        }
+        sink = fields[nfields - 1].len;
+        for (size_t i = 0; i < nfields; i++) {
+            qstring_cleanup(fields[i]);
+        }
+    }
+    report("malloc and free", now() - start, nrequests * nfields * 9);
+
+    start = now();
+    qarena arena = qarena_new(0);
+    for (size_t r = 0; r < nrequests; r++) {
+        qstring fields[8];
+        for (size_t i = 0; i < nfields; i++) {
+            qstring sub = qstring_substr_a(&arena, haystack,
+                (r * 64 + i * 8) % 4096, 8);
+            fields[i] = qstring_concat_a(&arena, sub, qliteral(";"));
+        }
+        sink = fields[nfields - 1].len;
+        qarena_reset(&arena);
+    }
+    qarena_cleanup(&arena);
+    report("qarena", now() - start, nrequests * nfields * 9);
+}
+
+/* Copy a million short words out of the haystack and look at each of them
+ * once, which is what a tokenizer or a parser of key-value pairs does.
+ */
+static void bench_small(qstring haystack) {
+    const size_t nwords = 1000000;
+    printf("%zu short strings\n", nwords);
+
+    qstring* words = malloc(nwords * sizeof *words);
+    double start = now();
+    for (size_t i = 0; i < nwords; i++) {
+        words[i] = qstring_new_buffer(haystack.data + i * 7 % 4096,
+            4 + i % 12);
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < nwords; i++) {
+        total += (unsigned char)words[i].data[words[i].len / 2];
+    }
+    for (size_t i = 0; i < nwords; i++) {
+        qstring_cleanup(words[i]);
+    }
+    report("qstring", now() - start, nwords * 10);
+    sink = total;
+    free(words);
+
+    qsmall* smalls = malloc(nwords * sizeof *smalls);
+    start = now();
+    for (size_t i = 0; i < nwords; i++) {
+        smalls[i] = qsmall_new_buffer(haystack.data + i * 7 % 4096,
+            4 + i % 12);
+    }
+    total = 0;
+    for (size_t i = 0; i < nwords; i++) {
+        total += (unsigned char)qsmall_data(&smalls[i])[
+            qsmall_len(&smalls[i]) / 2];
+    }
+    for (size_t i = 0; i < nwords; i++) {
+        qsmall_cleanup(&smalls[i]);
+    }
+    report("qsmall", now() - start, nwords * 10);
+    sink = total;
+    free(smalls);
+}
+
+/* Pass a document through a pipeline of stages, each of which keeps its own
+ * reference to it and applies a replacement that usually doesn't match.
+ */
+static void bench_shared(qstring haystack) {
+    const size_t nstages = 50;
+    qstring before = qliteral("<script>");
+    printf("passing %zu bytes through %zu stages\n", haystack.len, nstages);
+
+    double start = now();
+    qstring doc = qstring_copy(haystack);
+    for (size_t i = 0; i < nstages; i++) {
+        qstring mine = qstring_copy(doc);
+        qstring next = qstring_replace_all(mine, before, qliteral(""));
+        qstring_cleanup(mine);
+        qstring_cleanup(doc);
+        doc = next;
+    }
+    report("qstring_copy", now() - start, haystack.len * nstages);
+    sink = doc.len;
+    qstring_cleanup(doc);
+
+    start = now();
+    qshared sdoc = qshared_new_buffer(haystack.data, haystack.len);
+    for (size_t i = 0; i < nstages; i++) {
+        qshared mine = qshared_copy(sdoc);
+        qshared next = qshared_replace_all(mine, before, qliteral(""));
+        qshared_cleanup(mine);
+        qshared_cleanup(sdoc);
+        sdoc = next;
+    }
+    report("qshared_copy", now() - start, haystack.len * nstages);
+    sink = sdoc.len;
+    qshared_cleanup(sdoc);
+}
+
+/* Keep two million hostnames drawn from a few thousand distinct ones, and
+ * count how many are equal to the first.
+ */
+static void bench_intern(void) {
+    const size_t nstrings = 2000000;
+    const size_t ndistinct = 5000;
+    printf("%zu strings, %zu distinct\n", nstrings, ndistinct);
+
+    qstring* names = malloc(ndistinct * sizeof *names);
+    for (size_t i = 0; i < ndistinct; i++) {
+        names[i] = qstring_format(qliteral("host-%zu.example.com"), i);
+    }
+    qstring* kept = malloc(nstrings * sizeof *kept);
+
+    double start = now();
+    for (size_t i = 0; i < nstrings; i++) {
+        kept[i] = qstring_copy(names[i * 7919 % ndistinct]);
+    }
+    size_t equal = 0;
+    for (size_t i = 0; i < nstrings; i++) {
+        equal += kept[i].len == kept[0].len &&
+            memcmp(kept[i].data, kept[0].data, kept[0].len) == 0;
+    }
+    for (size_t i = 0; i < nstrings; i++) {
+        qstring_cleanup(kept[i]);
+    }
+    report("qstring_copy", now() - start, nstrings * 20);
+    sink = equal;
+
+    start = now();
+    qintern* pool = qintern_new();
+    for (size_t i = 0; i < nstrings; i++) {
+        kept[i] = qintern_add(pool, names[i * 7919 % ndistinct]);
+    }
+    equal = 0;
+    for (size_t i = 0; i < nstrings; i++) {
+        equal += kept[i].data == kept[0].data;
+    }
+    qintern_cleanup(pool);
+    report("qintern_add", now() - start, nstrings * 20);
+    sink = equal;
+
+    for (size_t i = 0; i < ndistinct; i++) {
+        qstring_cleanup(names[i]);
+    }
+    free(names);
+    free(kept);
+}
+
+/* The byte-at-a-time FNV-1a hash and separately chained table that a program
+ * without a hash library would write.
+ */
+static uint64_t naive_hash(qstring qs) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < qs.len; i++) {
+        h = (h ^ (unsigned char)qs.data[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+typedef struct chain_node {
+    qstring key;
+    void* value;
+    struct chain_node* next;
+} chain_node;
+
+typedef struct {
+    chain_node** buckets;
+    size_t nbuckets;
+    size_t len;
+} chain_table;
+
+static void chain_set(chain_table* t, qstring key, void* value) {
+    if (t->len >= t->nbuckets) {
+        size_t nbuckets = (t->nbuckets == 0) ? 16 : t->nbuckets * 2;
+        chain_node** buckets = calloc(nbuckets, sizeof *buckets);
+        for (size_t i = 0; i < t->nbuckets; i++) {
+            chain_node* node = t->buckets[i];
+            while (node != NULL) {
+                chain_node* next = node->next;
+                size_t b = naive_hash(node->key) % nbuckets;
+                node->next = buckets[b];
+                buckets[b] = node;
+                node = next;
+            }
+        }
+        free(t->buckets);
+        t->buckets = buckets;
+        t->nbuckets = nbuckets;
+    }
+    size_t b = naive_hash(key) % t->nbuckets;
+    for (chain_node* node = t->buckets[b]; node != NULL; node = node->next) {
+        if (node->key.len == key.len &&
+                memcmp(node->key.data, key.data, key.len) == 0) {
+            node->value = value;
+            return;
+        }
+    }
+    chain_node* node = malloc(sizeof *node);
+    node->key = key;
+    node->value = value;
+    node->next = t->buckets[b];
+    t->buckets[b] = node;
+    t->len++;
+}
+
+static void* chain_get(const chain_table* t, qstring key) {
+    size_t b = naive_hash(key) % t->nbuckets;
+    for (chain_node* node = t->buckets[b]; node != NULL; node = node->next) {
+        if (node->key.len == key.len &&
+                memcmp(node->key.data, key.data, key.len) == 0) {
+            return node->value;
+        }
+    }
+    return NULL;
+}
+
+static void chain_cleanup(chain_table* t) {
+    for (size_t i = 0; i < t->nbuckets; i++) {
+        chain_node* node = t->buckets[i];
+        while (node != NULL) {
+            chain_node* next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(t->buckets);
+}
+
+static void bench_hash(qstring haystack) {
+    printf("hashing %zu bytes\n", haystack.len);
+    double start = now();
+    sink = naive_hash(haystack);
+    report("FNV-1a", now() - start, haystack.len);
+    start = now();
+    sink = qstring_hash(haystack);
+    report("qstring_hash", now() - start, haystack.len);
+
+    const size_t nkeys = 2000000;
+    printf("inserting and looking up %zu short keys\n", nkeys);
+    qarena arena = qarena_new(0);
+    qstring* keys = malloc(nkeys * sizeof *keys);
+    qstring* misses = malloc(nkeys * sizeof *misses);
+    for (size_t i = 0; i < nkeys; i++) {
+        keys[i] = qstring_format_a(&arena, qliteral("user:%zu"), i * 7919);
+        misses[i] = qstring_format_a(&arena, qliteral("user:%zu!"), i);
+    }
+
+    start = now();
+    chain_table t = {.buckets = NULL, .nbuckets = 0, .len = 0};
+    for (size_t i = 0; i < nkeys; i++) {
+        chain_set(&t, keys[i], &keys[i]);
+    }
+    size_t found = 0;
+    for (size_t i = 0; i < nkeys; i++) {
+        found += chain_get(&t, keys[(i * 31) % nkeys]) != NULL;
+        found += chain_get(&t, misses[i]) != NULL;
+    }
+    chain_cleanup(&t);
+    report("chained table", now() - start, nkeys * 3 * 12);
+    sink = found;
+
+    start = now();
+    qmap m = qmap_new();
+    for (size_t i = 0; i < nkeys; i++) {
+        qmap_set(&m, keys[i], &keys[i]);
+    }
+    found = 0;
+    for (size_t i = 0; i < nkeys; i++) {
+        found += qmap_get(&m, keys[(i * 31) % nkeys], NULL);
+        found += qmap_get(&m, misses[i], NULL);
+    }
+    qmap_cleanup(&m);
+    report("qmap", now() - start, nkeys * 3 * 12);
+    sink = found;
+
+    free(keys);
+    free(misses);
+    qarena_cleanup(&arena);
+}
+
+/* Apply small edits at pseudo-random places in a 4MB buffer. The reported
+ * rate counts the whole buffer once per edit, since that is what the qstring
+ * functions copy.
+ */
+static void bench_rope(qstring haystack) {
+    const size_t nbytes = 4 * 1024 * 1024;
+    const size_t qstring_edits = 200;
+    const size_t rope_edits = 200000;
+    qstring doc = qstring_substr(haystack, 0, nbytes);
+    printf("small edits to a %zu-byte buffer\n", nbytes);
+
+    double start = now();
+    qstring qs = qstring_copy(doc);
+    for (size_t i = 0; i < qstring_edits; i++) {
+        size_t at = (i * 2654435761u) % (qs.len - 8);
+        qstring removed = qstring_remove(qs, at, 5);
+        qstring before = qstring_substr(removed, 0, at);
+        qstring after = qstring_substr(removed, at, removed.len);
+        qstring joined = qstring_concat(before, qliteral("edit!"));
+        qstring_cleanup(qs);
+        qs = qstring_concat(joined, after);
+        qstring_cleanup(removed);
+        qstring_cleanup(before);
+        qstring_cleanup(after);
+        qstring_cleanup(joined);
+    }
+    report("qstring_remove + concat", (now() - start) / qstring_edits,
+        nbytes);
+    sink = qs.len;
+    qstring_cleanup(qs);
+
+    start = now();
+    qrope r = qrope_from_qstring(doc);
+    for (size_t i = 0; i < rope_edits; i++) {
+        size_t at = (i * 2654435761u) % (r.len - 8);
+        qrope_remove(&r, at, 5);
+        qrope_insert(&r, at, qliteral("edit!"));
+    }
+    report("qrope_remove + insert", (now() - start) / rope_edits, nbytes);
+    sink = qrope_find(&r, qliteral("edit!edit!"));
+    qrope_cleanup(&r);
+    qstring_cleanup(doc);
+}
+
+static void bench_split(qstring haystack) {
+    printf("splitting on spaces\n");
+
+    /* The hand-rolled loop that copies each field. */
+    double start = now();
+    size_t nfields = 0;
+    size_t pos = 0;
+    while (pos <= haystack.len) {
+        size_t end = qstring_find_in(haystack, qliteral(" "), pos,
+            haystack.len - pos);
+        qstring field = qstring_substr(haystack, pos, end - pos);
+        nfields++;
+        qstring_cleanup(field);
+        pos = end + 1;
+    }
+    report("qstring_find_in + substr", now() - start, haystack.len);
+    sink = nfields;
+
+    start = now();
+    nfields = 0;
+    qsplit it = qsplit_char(qrange_new(haystack), ' ', 0);
+    qrange field;
+    while (qsplit_next(&it, &field)) {
+        nfields++;
+    }
+    report("qsplit_char", now() - start, haystack.len);
+    sink = nfields;
+}
+
+static void bench_readline(qstring haystack) {
+    printf("reading the haystack line by line\n");
+    FILE* fp = tmpfile();
+    fwrite(haystack.data, 1, haystack.len, fp);
+    fflush(fp);
+
+    rewind(fp);
+    double start = now();
+    size_t nlines = 0;
+    while (!feof(fp)) {
+        size_t n;
+        char* line = qio_readline(fp, &n);
+        nlines++;
+        free(line);
+    }
+    report("qio_readline", now() - start, haystack.len);
+    sink = nlines;
+
+    rewind(fp);
+    start = now();
+    nlines = 0;
+    char* buffer = NULL;
+    size_t cap = 0;
+    size_t n;
+    while (qio_getline(fp, &buffer, &cap, &n)) {
+        nlines++;
+    }
+    free(buffer);
+    report("qio_getline", now() - start, haystack.len);
+    sink = nlines;
+
+    rewind(fp);
+    start = now();
+    nlines = 0;
+    qio_reader r = qio_reader_new(fp, 0);
+    qrange line;
+    while (qio_reader_readline(&r, &line)) {
+        nlines++;
+    }
+    qio_reader_cleanup(&r);
+    report("qio_reader_readline", now() - start, haystack.len);
+    sink = nlines;
+
+    lseek(fileno(fp), 0, SEEK_SET);
+    start = now();
+    nlines = 0;
+    qio_stream* s = qio_stream_new(fileno(fp), 0);
+    while (qio_stream_readline(s, &line)) {
+        nlines++;
+    }
+    qio_stream_close(s);
+    report("qio_stream_readline", now() - start, haystack.len);
+    sink = nlines;
+
+    fclose(fp);
+}
+
+static void count_newlines(qrange chunk, void* result, void* ctx) {
+    *(size_t*)result += qrange_count(chunk, qliteral("\n"));
+}
+
+static void add_counts(void* into, const void* from, void* ctx) {
+    *(size_t*)into += *(const size_t*)from;
+}
+
+static void bench_parallel(qstring haystack) {
+    printf("counting lines on every CPU\n");
+
+    double start = now();
+    sink = qstring_count(haystack, qliteral("\n"));
+    report("qstring_count", now() - start, haystack.len);
+
+    qio_parallel job = {.nthreads = 0, .chunk = count_newlines, .line = NULL,
+        .result_size = sizeof(size_t), .merge = add_counts, .ctx = NULL};
+    size_t count = 0;
+    start = now();
+    qio_parallel_range(qrange_new(haystack), &job, &count);
+    report("qio_parallel_range", now() - start, haystack.len);
+    sink = count;
+}
+
+static void bench_write(void) {
+    const size_t nrows = 500000;
+    qstring fields[] = {qliteral("host-a"), qliteral("200"),
+        qliteral("latency=12ms"), qliteral("user=alice")};
+    size_t nfields = sizeof fields / sizeof fields[0];
+    size_t nbytes = nrows * (6 + 3 + 12 + 10 + nfields);
+    printf("writing %zu rows of %zu fields\n", nrows, nfields);
+
+    FILE* fp = fopen("/dev/null", "w");
+    double start = now();
+    for (size_t r = 0; r < nrows; r++) {
+        for (size_t i = 0; i < nfields; i++) {
+            fwrite(fields[i].data, 1, fields[i].len, fp);
+            fputc((i == nfields - 1) ? '\n' : '\t', fp);
+        }
+    }
+    fflush(fp);
+    report("fwrite and fputc", now() - start, nbytes);
+
+    start = now();
+    qio_writer w = qio_writer_new(fileno(fp), 0);
+    qrange row[8];
+    for (size_t r = 0; r < nrows; r++) {
+        for (size_t i = 0; i < nfields; i++) {
+            row[2 * i] = qrange_new(fields[i]);
+            row[2 * i + 1] = qrange_new((i == nfields - 1) ? qliteral("\n") :
+                qliteral("\t"));
+        }
+        qio_writer_writev(&w, row, 2 * nfields);
+    }
+    qio_writer_close(&w);
+    report("qio_writer_writev", now() - start, nbytes);
+    fclose(fp);
+}
+
+/* Repeat the Cyrillic test file until it is `n` bytes long, cutting it at a
+ * line boundary so that it stays valid UTF-8.
+ */
+static qstring make_cyrillic(size_t n) {
+    qstring poem = qio_readpath_qs("assets/kern_utf8.txt");
+    qbuilder b = qbuilder_new();
+    while (b.len + poem.len <= n) {
+        qbuilder_append(&b, poem);
+    }
+    qstring_cleanup(poem);
+    return qbuilder_finish(&b);
+}
+
+static void bench_utf8(qstring ascii, qstring cyrillic) {
+    qstring inputs[] = {ascii, cyrillic};
+    const char* names[] = {"ASCII", "Cyrillic"};
+    for (size_t i = 0; i < 2; i++) {
+        printf("UTF-8 (%s, %zu MB)\n", names[i], inputs[i].len >> 20);
+
+        double start = now();
+        qstring_utf8 u = qstring_utf8_decode(inputs[i]);
+        report("qstring_utf8_decode", now() - start, inputs[i].len);
+
+        start = now();
+        qstring qs = qstring_utf8_encode(u);
+        report("qstring_utf8_encode", now() - start, inputs[i].len);
+        sink = qs.len;
+
+        qstring_cleanup(qs);
+        qstring_utf8_cleanup(u);
+
+        start = now();
+        sink = qstring_utf8_validate(inputs[i]);
+        report("qstring_utf8_validate", now() - start, inputs[i].len);
+
+        start = now();
+        sink = qstring_utf8_count(inputs[i]);
+        report("qstring_utf8_count", now() - start, inputs[i].len);
+    }
+}
+
+static void bench_qutf8(qstring cyrillic) {
+    const size_t nlookups = 1000000;
+    printf("%zu random code point lookups (Cyrillic, %zu MB)\n", nlookups,
+        cyrillic.len >> 20);
+
+    double start = now();
+    qstring_utf8 wide = qstring_utf8_decode(cyrillic);
+    size_t total = 0;
+    unsigned long state = 1;
+    for (size_t i = 0; i < nlookups; i++) {
+        state = state * 1103515245 + 12345;
+        total += wide.data[(state >> 8) % wide.len];
+    }
+    printf("  %-32s %8.3f ms  %8zu MB\n", "qstring_utf8", (now() - start) * 1e3,
+        (wide.len * sizeof(utf8_char)) >> 20);
+    sink = total;
+
+    start = now();
+    qutf8 u = qutf8_new(qrange_new(cyrillic));
+    total = 0;
+    state = 1;
+    for (size_t i = 0; i < nlookups; i++) {
+        state = state * 1103515245 + 12345;
+        total += qutf8_at(&u, (state >> 8) % u.len);
+    }
+    printf("  %-32s %8.3f ms  %8zu MB\n", "qutf8", (now() - start) * 1e3,
+        (cyrillic.len + u.len / QUTF8_STRIDE * sizeof(size_t)) >> 20);
+    sink = total;
+
+    qutf8_cleanup(&u);
+    qstring_utf8_cleanup(wide);
+}
+
+int main() {
+    qstring haystack = make_haystack(HAYSTACK_SIZE);
+    bench_find(haystack);
+    bench_count(haystack);
+    bench_find_ci(haystack);
+    bench_build();
+    bench_arena(haystack);
+    bench_small(haystack);
+    bench_shared(haystack);
+    bench_intern();
+    bench_hash(haystack);
+    bench_rope(haystack);
+    bench_split(haystack);
+    bench_readline(haystack);
+    bench_parallel(haystack);
+    bench_write();
+
+    qstring cyrillic = make_cyrillic(HAYSTACK_SIZE);
+    bench_utf8(haystack, cyrillic);
+    bench_qutf8(cyrillic);
+    qstring_cleanup(cyrillic);
+    qstring_cleanup(haystack);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* Implementation of the qarena library. See qarena.h for API documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qarena.h"
+
+/* The block size used when none is given to qarena_new. */
+#define QARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+/* Every allocation is aligned to this, like the memory returned by malloc. */
+#define QARENA_ALIGN alignof(max_align_t)
+
+struct qarena_block {
+    qarena_block* next;
+    /* The number of bytes in the data field. */
+    size_t size;
+    /* The number of bytes of the data field that have been handed out. */
+    size_t used;
+    /* The offset of the most recent allocation, for qarena_realloc. */
+    size_t last;
+    alignas(max_align_t) char data[];
+};
+
+static size_t align_up(size_t n) {
+    return (n + (QARENA_ALIGN - 1)) & ~(QARENA_ALIGN - 1);
+}
+
+static qarena_block* new_block(size_t size) {
+    qarena_block* block = malloc(sizeof *block + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    block->last = 0;
+    return block;
+}
+
+qarena qarena_new(size_t block_size) {
+    qarena ret = {.head = NULL, .block_size = block_size};
+    if (ret.block_size == 0) {
+        ret.block_size = QARENA_DEFAULT_BLOCK_SIZE;
+    }
+    return ret;
+}
+
+void* qarena_alloc(qarena* a, size_t n) {
+    if (n > SIZE_MAX - QARENA_ALIGN) {
+        return NULL;
+    }
+    n = align_up(n);
+    qarena_block* head = a->head;
+    if (head != NULL && n <= head->size - head->used) {
+        head->last = head->used;
+        head->used += n;
+        return head->data + head->last;
+    }
+
+    /* Allocations bigger than a quarter of a block get a block of their own,
+     * which goes behind the current block so that the space left in the
+     * current block isn't wasted.
+     */
+    if (head != NULL && n > a->block_size / 4) {
+        qarena_block* block = new_block(n);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->used = n;
+        block->next = head->next;
+        head->next = block;
+        return block->data;
+    }
+
+    qarena_block* block = new_block((n > a->block_size) ? n : a->block_size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->used = n;
+    block->next = head;
+    a->head = block;
+    return block->data;
+}
+
+void* qarena_realloc(qarena* a, void* p, size_t oldn, size_t newn) {
+    if (p == NULL) {
+        return qarena_alloc(a, newn);
+    }
+    qarena_block* head = a->head;
+    if (head != NULL && (char*)p == head->data + head->last &&
+            newn <= head->size - head->last) {
+        head->used = head->last + align_up(newn);
+        return p;
+    }
+    if (newn <= oldn) {
+        return p;
+    }
+    void* q = qarena_alloc(a, newn);
+    if (q == NULL) {
+        return NULL;
+    }
+    memcpy(q, p, oldn);
+    return q;
+}
+
+void qarena_reset(qarena* a) {
+    if (a->head == NULL) {
+        return;
+    }
+    /* Keep the most recent block of the normal size, which is where the next
+     * allocation would have gone anyway.
+     */
+    qarena_block* keep = NULL;
+    qarena_block* block = a->head;
+    while (block != NULL) {
+        qarena_block* next = block->next;
+        if (keep == NULL && block->size == a->block_size) {
+            keep = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    if (keep != NULL) {
+        keep->next = NULL;
+        keep->used = 0;
+        keep->last = 0;
+    }
+    a->head = keep;
+}
+
+void qarena_cleanup(qarena* a) {
+    qarena_block* block = a->head;
+    while (block != NULL) {
+        qarena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    a->head = NULL;
+}
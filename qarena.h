@@ -0,0 +1,69 @@
+/* Region-based memory allocation.
+ *
+ * A qarena hands out memory from large blocks by bumping a pointer, and frees
+ * everything it has handed out at once when it is reset or cleaned up. This is
+ * much cheaper than a malloc and free for each object when many small,
+ * short-lived objects are allocated together, e.g. while handling a single
+ * request.
+ *
+ * The qstring and qio functions whose names end in _a allocate their results
+ * from an arena. Qstrings allocated from an arena must NOT be passed to
+ * qstring_cleanup; they are freed when the arena is.
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#ifndef QARENA_H
+#define QARENA_H
+
+#include <stddef.h>
+
+typedef struct qarena_block qarena_block;
+
+typedef struct {
+    /* All fields are private. */
+
+    /* The block currently being allocated from. Earlier blocks are linked
+       from it. */
+    qarena_block* head;
+    /* The size of each new block. */
+    size_t block_size;
+} qarena;
+
+/**
+ * Return a new arena that allocates blocks of `block_size` bytes, or of a
+ * sensible default size if `block_size` is 0. No memory is allocated until the
+ * first call to qarena_alloc.
+ */
+qarena qarena_new(size_t block_size);
+
+/**
+ * Return a pointer to `n` bytes of memory, suitably aligned for any type, or
+ * NULL if allocation fails. Requests that are large compared to the block size
+ * get a block of their own.
+ */
+void* qarena_alloc(qarena*, size_t n);
+
+/**
+ * Resize the allocation `p`, which is `oldn` bytes long, to `newn` bytes and
+ * return a pointer to it, or return NULL if allocation fails. If `p` was the
+ * arena's most recent allocation and there is room after it, it is extended in
+ * place; otherwise its contents are copied to a new allocation. If `p` is NULL
+ * then this is the same as qarena_alloc.
+ */
+void* qarena_realloc(qarena*, void* p, size_t oldn, size_t newn);
+
+/**
+ * Free everything allocated from the arena, but keep one block so that the
+ * arena can be reused without going back to malloc.
+ */
+void qarena_reset(qarena*);
+
+/**
+ * Free everything allocated from the arena, and all of its blocks.
+ */
+void qarena_cleanup(qarena*);
+
+#endif
@@ -0,0 +1,149 @@
+/* Implementation of the qbuilder library. See qbuilder.h for API
+ * documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qbuilder.h"
+
+/* The capacity of a builder's first allocation. */
+#define QBUILDER_MIN_CAP 16
+
+qbuilder qbuilder_new(void) {
+    qbuilder ret = {.len = 0, .cap = 0, .data = NULL};
+    return ret;
+}
+
+void qbuilder_cleanup(qbuilder* b) {
+    free(b->data);
+    b->len = 0;
+    b->cap = 0;
+    b->data = NULL;
+}
+
+/* Resize the buffer to hold exactly `cap` bytes plus the null terminator. */
+static bool resize(qbuilder* b, size_t cap) {
+    char* data = realloc(b->data, cap + 1);
+    if (data == NULL) {
+        return false;
+    }
+    if (b->data == NULL) {
+        data[0] = '\0';
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+bool qbuilder_reserve(qbuilder* b, size_t cap) {
+    if (cap <= b->cap && b->data != NULL) {
+        return true;
+    }
+    return resize(b, cap);
+}
+
+bool qbuilder_shrink(qbuilder* b) {
+    if (b->data == NULL || b->len == b->cap) {
+        return true;
+    }
+    return resize(b, b->len);
+}
+
+void qbuilder_clear(qbuilder* b) {
+    b->len = 0;
+    if (b->data != NULL) {
+        b->data[0] = '\0';
+    }
+}
+
+/* Make room for `n` more bytes, doubling the capacity as many times as needed
+ * so that a sequence of appends takes amortized constant time each.
+ */
+static bool grow(qbuilder* b, size_t n) {
+    if (n <= b->cap - b->len && b->data != NULL) {
+        return true;
+    }
+    if (n > (size_t)-2 - b->len) {
+        return false;
+    }
+    size_t needed = b->len + n;
+    size_t cap = (b->cap < QBUILDER_MIN_CAP) ? QBUILDER_MIN_CAP : b->cap;
+    while (cap < needed) {
+        cap = (cap > ((size_t)-2) / 2) ? needed : cap * 2;
+    }
+    return resize(b, cap);
+}
+
+bool qbuilder_append(qbuilder* b, qstring qs) {
+    return qbuilder_append_buffer(b, qs.data, qs.len);
+}
+
+bool qbuilder_append_buffer(qbuilder* b, const char* buffer, size_t n) {
+    if (!grow(b, n)) {
+        return false;
+    }
+    memcpy(b->data + b->len, buffer, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+    return true;
+}
+
+bool qbuilder_append_char(qbuilder* b, char c) {
+    if (!grow(b, 1)) {
+        return false;
+    }
+    b->data[b->len++] = c;
+    b->data[b->len] = '\0';
+    return true;
+}
+
+bool qbuilder_append_format(qbuilder* b, qstring fmtstr, ...) {
+    /* Try formatting into the spare capacity first, and only grow the buffer
+     * and format again if it doesn't fit.
+     */
+    va_list args;
+    va_start(args, fmtstr);
+    va_list args2;
+    va_copy(args2, args);
+
+    size_t room = (b->data == NULL) ? 0 : b->cap - b->len + 1;
+    char* dst = (b->data == NULL) ? NULL : b->data + b->len;
+    int sz = vsnprintf(dst, room, fmtstr.data, args);
+    va_end(args);
+    if (sz < 0) {
+        va_end(args2);
+        if (b->data != NULL) {
+            b->data[b->len] = '\0';
+        }
+        return false;
+    }
+    if ((size_t)sz >= room) {
+        if (!grow(b, sz)) {
+            va_end(args2);
+            if (b->data != NULL) {
+                b->data[b->len] = '\0';
+            }
+            return false;
+        }
+        vsnprintf(b->data + b->len, sz + 1, fmtstr.data, args2);
+    }
+    va_end(args2);
+    b->len += sz;
+    return true;
+}
+
+qstring qbuilder_finish(qbuilder* b) {
+    if (b->data == NULL) {
+        return qstring_new("");
+    }
+    qstring ret = {.len = b->len, .data = b->data};
+    b->len = 0;
+    b->cap = 0;
+    b->data = NULL;
+    return ret;
+}
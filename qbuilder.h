@@ -0,0 +1,99 @@
+/* A growable buffer for building up qstrings piece by piece.
+ *
+ * Because qstrings are immutable, building a string by repeatedly calling
+ * qstring_concat copies the whole string on every call. A qbuilder instead
+ * keeps spare capacity at the end of its buffer and doubles it when it runs
+ * out, so appending is amortized O(1). When the string is complete,
+ * qbuilder_finish hands the buffer over as a qstring without copying it.
+ *
+ *   qbuilder b = qbuilder_new();
+ *   for (size_t i = 0; i < nfields; i++) {
+ *       qbuilder_append(&b, fields[i]);
+ *       qbuilder_append_char(&b, ',');
+ *   }
+ *   qstring line = qbuilder_finish(&b);
+ *
+ * Like a qstring, the data field of a qbuilder is always null-terminated once
+ * anything has been appended to it.
+ *
+ * The functions that append to a qbuilder return false if they fail to
+ * allocate memory, in which case the builder is left unchanged.
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#ifndef QBUILDER_H
+#define QBUILDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "qstring.h"
+
+typedef struct {
+    /* All fields are considered public and read-only. */
+
+    /* The number of bytes appended so far, excluding the null terminator. */
+    size_t len;
+    /* The number of bytes that can be held without reallocating, excluding
+       the null terminator. */
+    size_t cap;
+    /* The contents of the builder, or NULL if nothing has been allocated. */
+    char* data;
+} qbuilder;
+
+/**
+ * Return an empty qbuilder. No memory is allocated until something is
+ * appended.
+ */
+qbuilder qbuilder_new(void);
+
+/**
+ * Free the builder's buffer. Not needed if qbuilder_finish has been called and
+ * nothing has been appended since.
+ */
+void qbuilder_cleanup(qbuilder*);
+
+/**
+ * Make sure that the builder can hold at least `cap` bytes without
+ * reallocating.
+ */
+bool qbuilder_reserve(qbuilder*, size_t cap);
+
+/**
+ * Release any capacity beyond what the builder currently holds.
+ */
+bool qbuilder_shrink(qbuilder*);
+
+/**
+ * Empty the builder but keep its buffer, so that it can be reused without
+ * allocating again.
+ */
+void qbuilder_clear(qbuilder*);
+
+/**
+ * Append the contents of the qstring, the first `n` bytes of the buffer, or a
+ * single character to the builder.
+ */
+bool qbuilder_append(qbuilder*, qstring);
+bool qbuilder_append_buffer(qbuilder*, const char*, size_t n);
+bool qbuilder_append_char(qbuilder*, char);
+
+/**
+ * Append the arguments formatted according to `fmtstr`, a format string as in
+ * printf. The same restrictions as for qstring_format apply.
+ */
+bool qbuilder_append_format(qbuilder*, qstring fmtstr, ...);
+
+/**
+ * Return the contents of the builder as a qstring. The builder's buffer is
+ * handed over to the qstring without being copied, and the builder is left
+ * empty and may be reused.
+ *
+ * The returned qstring must eventually be passed to qstring_cleanup to avoid a
+ * memory leak.
+ */
+qstring qbuilder_finish(qbuilder*);
+
+#endif
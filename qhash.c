@@ -0,0 +1,517 @@
+/* Implementation of the qhash library. See qhash.h for API documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qhash.h"
+
+/* Odd constants for multiplying, from xxHash. */
+#define PRIME32_1 0x9E3779B1u
+#define PRIME32_2 0x85EBCA77u
+#define PRIME32_3 0xC2B2AE3Du
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define PRIME64_3 0x165667B19E3779F9ull
+#define PRIME64_4 0x85EBCA77C2B2AE63ull
+#define PRIME64_5 0x27D4EB2F165667C5ull
+
+/* Long strings are hashed in stripes of 64 bytes, eight stripes to a block. */
+#define STRIPE_SIZE 64
+#define BLOCK_STRIPES 8
+#define BLOCK_SIZE (STRIPE_SIZE * BLOCK_STRIPES)
+
+/* Random bits that are mixed into the data, from splitmix64. */
+static const uint64_t secret[16] = {
+    0xe220a8397b1dcdafull, 0x6e789e6aa1b965f4ull,
+    0x06c45d188009454full, 0xf88bb8a8724c81ecull,
+    0x1b39896a51a8749bull, 0x53cb9f0c747ea2eaull,
+    0x2c829abe1f4532e1ull, 0xc584133ac916ab3cull,
+    0x3ee5789041c98ac3ull, 0xf3b8488c368cb0a6ull,
+    0x657eecdd3cb13d09ull, 0xc2d326e0055bdef6ull,
+    0x8621a03fe0bbdb7bull, 0x8e1f7555983aa92full,
+    0xb54e0f1600cc4d19ull, 0x84bb3f97971d80abull,
+};
+
+static uint64_t read64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/* Multiply to 128 bits and fold the halves together. */
+static uint64_t mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    /* Without a 128-bit type, such as on 32-bit targets, build the product
+     * from four 32x32->64 multiplications. The middle sum can't overflow,
+     * since each term is less than 2^32 except `lohi`, which is at most
+     * (2^32 - 1)^2.
+     */
+    uint64_t alo = a & 0xFFFFFFFFu, ahi = a >> 32;
+    uint64_t blo = b & 0xFFFFFFFFu, bhi = b >> 32;
+    uint64_t lolo = alo * blo;
+    uint64_t hilo = ahi * blo;
+    uint64_t lohi = alo * bhi;
+    uint64_t hihi = ahi * bhi;
+    uint64_t cross = (lolo >> 32) + (hilo & 0xFFFFFFFFu) + lohi;
+    uint64_t hi = hihi + (hilo >> 32) + (cross >> 32);
+    uint64_t lo = (cross << 32) | (lolo & 0xFFFFFFFFu);
+    return lo ^ hi;
+#endif
+}
+
+static uint64_t mix16(const char* p, const uint64_t* key) {
+    return mix(read64(p) ^ key[0], read64(p + 8) ^ key[1]);
+}
+
+/* Spread the entropy of `h` across all of its bits. */
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ull;
+    return h ^ (h >> 32);
+}
+
+static uint64_t hash_short(const char* p, size_t n) {
+    if (n > 8) {
+        uint64_t lo = read64(p) ^ secret[0];
+        uint64_t hi = read64(p + n - 8) ^ secret[1];
+        return avalanche(n * PRIME64_1 + lo + hi + mix(lo, hi));
+    }
+    if (n >= 4) {
+        /* The two reads overlap unless n is 8. */
+        uint64_t v = read32(p) | ((uint64_t)read32(p + n - 4) << 32);
+        return avalanche(mix(v ^ secret[2], secret[3] ^ n));
+    }
+    if (n > 0) {
+        uint64_t v = ((uint64_t)n << 24) |
+            ((uint64_t)(unsigned char)p[0] << 16) |
+            ((uint64_t)(unsigned char)p[n / 2] << 8) |
+            (unsigned char)p[n - 1];
+        return avalanche(mix(v ^ secret[4], secret[5]));
+    }
+    return avalanche(secret[6] ^ secret[7]);
+}
+
+/* Hash 17 to 128 bytes in pairs of 16-byte chunks from each end. */
+static uint64_t hash_medium(const char* p, size_t n) {
+    uint64_t h = n * PRIME64_1;
+    if (n > 32) {
+        if (n > 64) {
+            if (n > 96) {
+                h += mix16(p + 48, secret + 12);
+                h += mix16(p + n - 64, secret + 14);
+            }
+            h += mix16(p + 32, secret + 8);
+            h += mix16(p + n - 48, secret + 10);
+        }
+        h += mix16(p + 16, secret + 4);
+        h += mix16(p + n - 32, secret + 6);
+    }
+    h += mix16(p, secret);
+    h += mix16(p + n - 16, secret + 2);
+    return avalanche(h);
+}
+
+/* Long strings are hashed into eight 64-bit accumulators, one for each word of
+ * a stripe. Each word is keyed by XORing it with the secret, and the product
+ * of the two halves of the keyed word is added to its accumulator, while the
+ * word itself is added to its neighbour's so that no input is lost when a
+ * product is zero. After each block the accumulators are scrambled so that
+ * the blocks don't commute.
+ *
+ * Each of these steps is independent across the accumulators, so they map
+ * directly onto SIMD lanes, and every implementation below computes exactly
+ * the same result.
+ */
+typedef void (*accumulate_fn)(uint64_t* acc, const char* p, size_t nstripes,
+    const uint64_t* key);
+typedef void (*scramble_fn)(uint64_t* acc, const uint64_t* key);
+
+/* SSE2 is part of the x86-64 baseline, so it needs no check. AVX2 is detected
+ * at runtime. Other architectures use the scalar code in the #else branch
+ * below, as does any build with QSTRING_NO_SIMD defined.
+ */
+#if !defined(QSTRING_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define QSTRING_SIMD 1
+#include <immintrin.h>
+
+static bool have_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static __m128i accumulate_lane_sse2(__m128i acc, const char* p,
+    const uint64_t* key) {
+    __m128i d = _mm_loadu_si128((const __m128i*)p);
+    __m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)key));
+    /* _mm_mul_epu32 multiplies the low halves of each 64-bit lane. */
+    acc = _mm_add_epi64(acc, _mm_mul_epu32(k, _mm_srli_epi64(k, 32)));
+    return _mm_add_epi64(acc, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+static void accumulate_sse2(uint64_t* acc, const char* p, size_t nstripes,
+    const uint64_t* key) {
+    __m128i a[4];
+    for (size_t j = 0; j < 4; j++) {
+        a[j] = _mm_loadu_si128((const __m128i*)(acc + 2 * j));
+    }
+    for (size_t s = 0; s < nstripes; s++) {
+        for (size_t j = 0; j < 4; j++) {
+            a[j] = accumulate_lane_sse2(a[j], p + s * STRIPE_SIZE + j * 16,
+                key + s + 2 * j);
+        }
+    }
+    for (size_t j = 0; j < 4; j++) {
+        _mm_storeu_si128((__m128i*)(acc + 2 * j), a[j]);
+    }
+}
+
+static void scramble_sse2(uint64_t* acc, const uint64_t* key) {
+    const __m128i prime = _mm_set1_epi32(PRIME32_1);
+    for (size_t j = 0; j < 4; j++) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(acc + 2 * j));
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(key + 2 * j)));
+        /* Multiply each 64-bit lane by a 32-bit constant in two halves. */
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        a = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        _mm_storeu_si128((__m128i*)(acc + 2 * j), a);
+    }
+}
+
+__attribute__((target("avx2")))
+static __m256i accumulate_lane_avx2(__m256i acc, const char* p,
+    const uint64_t* key) {
+    __m256i d = _mm256_loadu_si256((const __m256i*)p);
+    __m256i k = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)key));
+    acc = _mm256_add_epi64(acc, _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32)));
+    return _mm256_add_epi64(acc,
+        _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t* acc, const char* p, size_t nstripes,
+    const uint64_t* key) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)acc);
+    __m256i a1 = _mm256_loadu_si256((const __m256i*)(acc + 4));
+    for (size_t s = 0; s < nstripes; s++) {
+        const char* stripe = p + s * STRIPE_SIZE;
+        a0 = accumulate_lane_avx2(a0, stripe, key + s);
+        a1 = accumulate_lane_avx2(a1, stripe + 32, key + s + 4);
+    }
+    _mm256_storeu_si256((__m256i*)acc, a0);
+    _mm256_storeu_si256((__m256i*)(acc + 4), a1);
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t* acc, const uint64_t* key) {
+    const __m256i prime = _mm256_set1_epi32(PRIME32_1);
+    for (size_t j = 0; j < 2; j++) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(acc + 4 * j));
+        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+        a = _mm256_xor_si256(a,
+            _mm256_loadu_si256((const __m256i*)(key + 4 * j)));
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+        a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+        _mm256_storeu_si256((__m256i*)(acc + 4 * j), a);
+    }
+}
+#else
+static void accumulate_scalar(uint64_t* acc, const char* p, size_t nstripes,
+    const uint64_t* key) {
+    for (size_t s = 0; s < nstripes; s++) {
+        for (size_t i = 0; i < 8; i++) {
+            uint64_t v = read64(p + s * STRIPE_SIZE + i * 8);
+            uint64_t k = v ^ key[s + i];
+            acc[i ^ 1] += v;
+            acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+        }
+    }
+}
+
+static void scramble_scalar(uint64_t* acc, const uint64_t* key) {
+    for (size_t i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= key[i];
+        acc[i] = a * PRIME32_1;
+    }
+}
+#endif
+
+/* Hash more than 128 bytes. The last stripe is always the last 64 bytes of
+ * the string, which may overlap the stripe before it.
+ */
+static uint64_t hash_long(const char* p, size_t n, accumulate_fn accumulate,
+    scramble_fn scramble) {
+    uint64_t acc[8] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+    };
+    size_t nblocks = (n - 1) / BLOCK_SIZE;
+    for (size_t b = 0; b < nblocks; b++) {
+        accumulate(acc, p + b * BLOCK_SIZE, BLOCK_STRIPES, secret);
+        scramble(acc, secret + 8);
+    }
+    size_t nstripes = (n - 1 - nblocks * BLOCK_SIZE) / STRIPE_SIZE;
+    accumulate(acc, p + nblocks * BLOCK_SIZE, nstripes, secret);
+    accumulate(acc, p + n - STRIPE_SIZE, 1, secret + 8);
+
+    uint64_t h = n * PRIME64_1;
+    for (size_t i = 0; i < 4; i++) {
+        h += mix(acc[2 * i] ^ secret[2 * i + 1],
+            acc[2 * i + 1] ^ secret[2 * i + 2]);
+    }
+    return avalanche(h);
+}
+
+uint64_t qhash(const char* data, size_t n) {
+    if (n <= 16) {
+        return hash_short(data, n);
+    }
+    if (n <= 128) {
+        return hash_medium(data, n);
+    }
+#ifdef QSTRING_SIMD
+    if (have_avx2()) {
+        return hash_long(data, n, accumulate_avx2, scramble_avx2);
+    }
+    return hash_long(data, n, accumulate_sse2, scramble_sse2);
+#else
+    return hash_long(data, n, accumulate_scalar, scramble_scalar);
+#endif
+}
+
+uint64_t qstring_hash(qstring qs) {
+    return qhash(qs.data, qs.len);
+}
+
+uint64_t qrange_hash(qrange r) {
+    return qhash(r.data, r.len);
+}
+
+/* The metadata byte of each slot is either one of these, or the low seven bits
+ * of the hash of the slot's key if the slot is full. Slots are probed in
+ * groups of sixteen, starting from the group chosen by the rest of the hash.
+ */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+#define GROUP_SIZE 16
+
+struct qmap_slot {
+    qstring key;
+    uint64_t hash;
+    void* value;
+};
+
+/* Return a mask with bit i set if the metadata byte of slot i of the group is
+ * `b`, or for match_free, if the slot is empty or deleted.
+ */
+#ifdef QSTRING_SIMD
+static unsigned int match_byte(const unsigned char* ctrl, unsigned char b) {
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b)));
+}
+
+static unsigned int match_free(const unsigned char* ctrl) {
+    /* Only the empty and deleted bytes have their high bit set. */
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+#else
+static unsigned int match_byte(const unsigned char* ctrl, unsigned char b) {
+    unsigned int mask = 0;
+    for (unsigned int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (unsigned int)(ctrl[i] == b) << i;
+    }
+    return mask;
+}
+
+static unsigned int match_free(const unsigned char* ctrl) {
+    unsigned int mask = 0;
+    for (unsigned int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (unsigned int)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+}
+#endif
+
+qmap qmap_new(void) {
+    qmap ret = {
+        .len = 0, .ctrl = NULL, .slots = NULL, .cap = 0, .growth_left = 0
+    };
+    return ret;
+}
+
+void qmap_cleanup(qmap* m) {
+    free(m->ctrl);
+    free(m->slots);
+    *m = qmap_new();
+}
+
+/* Return the slot that holds `key`, or NULL if it is not in the map. The probe
+ * sequence visits groups at triangular offsets from the first, which covers
+ * every group when their number is a power of two, and it ends at the first
+ * group with an empty slot, of which there is always at least one.
+ */
+static qmap_slot* find(const qmap* m, qstring key, uint64_t hash) {
+    if (m->cap == 0) {
+        return NULL;
+    }
+    size_t mask = m->cap / GROUP_SIZE - 1;
+    size_t g = (hash >> 7) & mask;
+    for (size_t step = 1;; step++) {
+        const unsigned char* ctrl = m->ctrl + g * GROUP_SIZE;
+        unsigned int bits = match_byte(ctrl, hash & 0x7F);
+        while (bits != 0) {
+            qmap_slot* s = &m->slots[g * GROUP_SIZE + __builtin_ctz(bits)];
+            if (s->hash == hash && s->key.len == key.len &&
+                    memcmp(s->key.data, key.data, key.len) == 0) {
+                return s;
+            }
+            bits &= bits - 1;
+        }
+        if (match_byte(ctrl, CTRL_EMPTY) != 0) {
+            return NULL;
+        }
+        g = (g + step) & mask;
+    }
+}
+
+/* Return the index of the first empty or deleted slot in the probe sequence
+ * of `hash`.
+ */
+static size_t find_free(const qmap* m, uint64_t hash) {
+    size_t mask = m->cap / GROUP_SIZE - 1;
+    size_t g = (hash >> 7) & mask;
+    for (size_t step = 1;; step++) {
+        unsigned int bits = match_free(m->ctrl + g * GROUP_SIZE);
+        if (bits != 0) {
+            return g * GROUP_SIZE + __builtin_ctz(bits);
+        }
+        g = (g + step) & mask;
+    }
+}
+
+/* Move every key into a new table of `newcap` slots, which also clears out the
+ * deleted slots. The cached hashes mean that no key is hashed again.
+ */
+static bool resize(qmap* m, size_t newcap) {
+    qmap bigger = qmap_new();
+    bigger.ctrl = malloc(newcap);
+    bigger.slots = malloc(newcap * sizeof *bigger.slots);
+    if (bigger.ctrl == NULL || bigger.slots == NULL) {
+        qmap_cleanup(&bigger);
+        return false;
+    }
+    memset(bigger.ctrl, CTRL_EMPTY, newcap);
+    bigger.cap = newcap;
+    for (size_t i = 0; i < m->cap; i++) {
+        if ((m->ctrl[i] & 0x80) == 0) {
+            size_t j = find_free(&bigger, m->slots[i].hash);
+            bigger.ctrl[j] = m->ctrl[i];
+            bigger.slots[j] = m->slots[i];
+        }
+    }
+    bigger.len = m->len;
+    /* Keep the table at most seven-eighths full, counting deleted slots. */
+    bigger.growth_left = newcap / 8 * 7 - m->len;
+    qmap_cleanup(m);
+    *m = bigger;
+    return true;
+}
+
+bool qmap_set(qmap* m, qstring key, void* value) {
+    return qmap_set_h(m, key, qstring_hash(key), value);
+}
+
+bool qmap_set_h(qmap* m, qstring key, uint64_t hash, void* value) {
+    qmap_slot* s = find(m, key, hash);
+    if (s != NULL) {
+        s->value = value;
+        return true;
+    }
+    if (m->growth_left == 0) {
+        /* If deleted slots take up much of the table, clear them out instead
+           of growing. */
+        size_t newcap = m->cap;
+        if (newcap == 0) {
+            newcap = GROUP_SIZE;
+        } else if (m->len >= m->cap / 16 * 7) {
+            newcap *= 2;
+        }
+        if (!resize(m, newcap)) {
+            return false;
+        }
+    }
+    size_t i = find_free(m, hash);
+    if (m->ctrl[i] == CTRL_EMPTY) {
+        m->growth_left--;
+    }
+    m->ctrl[i] = hash & 0x7F;
+    m->slots[i].key = key;
+    m->slots[i].hash = hash;
+    m->slots[i].value = value;
+    m->len++;
+    return true;
+}
+
+bool qmap_get(const qmap* m, qstring key, void** value) {
+    return qmap_get_h(m, key, qstring_hash(key), value);
+}
+
+bool qmap_get_h(const qmap* m, qstring key, uint64_t hash, void** value) {
+    qmap_slot* s = find(m, key, hash);
+    if (s == NULL) {
+        return false;
+    }
+    if (value != NULL) {
+        *value = s->value;
+    }
+    return true;
+}
+
+bool qmap_remove(qmap* m, qstring key) {
+    return qmap_remove_h(m, key, qstring_hash(key));
+}
+
+bool qmap_remove_h(qmap* m, qstring key, uint64_t hash) {
+    qmap_slot* s = find(m, key, hash);
+    if (s == NULL) {
+        return false;
+    }
+    /* The slot can't simply be emptied, since that would end the probe
+       sequences of keys that were pushed past it. */
+    m->ctrl[s - m->slots] = CTRL_DELETED;
+    m->len--;
+    return true;
+}
+
+bool qmap_next(const qmap* m, size_t* i, qstring* key, void** value) {
+    for (; *i < m->cap; (*i)++) {
+        if ((m->ctrl[*i] & 0x80) == 0) {
+            if (key != NULL) {
+                *key = m->slots[*i].key;
+            }
+            if (value != NULL) {
+                *value = m->slots[*i].value;
+            }
+            (*i)++;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,107 @@
+/* Hashing of qstrings, and a hash map keyed by qstrings.
+ *
+ * qstring_hash is a fast non-cryptographic 64-bit hash in the style of
+ * wyhash and XXH3. Short strings are mixed with 128-bit multiplies, and
+ * strings longer than 128 bytes are hashed 64 bytes at a time with SSE2 or,
+ * where the CPU supports it, AVX2. Every build of the library computes the
+ * same hash for the same bytes on the same platform, but hashes are not
+ * meant to be stored or sent to other programs, and the hash is not
+ * resistant to inputs chosen to collide.
+ *
+ * A qmap is an open-addressing hash map from qstrings to pointers, in the
+ * style of SwissTable: a byte of metadata per slot, holding seven bits of the
+ * key's hash, lets a lookup check sixteen slots with a couple of SSE2
+ * instructions and compare keys only where those bits match. Each slot also
+ * keeps the full hash of its key, so the map never rehashes a key after it
+ * is inserted. The _h variants of the qmap functions take a hash that the
+ * caller has already computed with qstring_hash, so that a key that is
+ * looked up many times only needs to be hashed once.
+ *
+ * A qmap does not copy its keys. The data of a key must stay valid and
+ * unchanged for as long as it is in the map, which is easily arranged by
+ * allocating keys from a qarena or a qintern pool.
+ *
+ *   qmap counts = qmap_new();
+ *   qmap_set(&counts, qliteral("GET"), &get_count);
+ *   void* p;
+ *   if (qmap_get(&counts, qliteral("GET"), &p)) { ... }
+ *   qmap_cleanup(&counts);
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#ifndef QHASH_H
+#define QHASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "qstring.h"
+
+typedef struct qmap_slot qmap_slot;
+
+typedef struct {
+    /* The number of keys in the map. Public and read-only. */
+    size_t len;
+
+    /* The remaining fields are private. */
+    /* The metadata bytes and the slots, `cap` of each, where `cap` is 0 or a
+       power of two that is at least 16. */
+    unsigned char* ctrl;
+    qmap_slot* slots;
+    size_t cap;
+    /* The number of keys that can be inserted before the table must grow. */
+    size_t growth_left;
+} qmap;
+
+/**
+ * Return the 64-bit hash of the first `n` bytes of `data`, of the qstring, or
+ * of the qrange.
+ */
+uint64_t qhash(const char* data, size_t n);
+uint64_t qstring_hash(qstring);
+uint64_t qrange_hash(qrange);
+
+/**
+ * Return a new, empty map. No memory is allocated until the first key is
+ * inserted. The map must eventually be passed to qmap_cleanup.
+ */
+qmap qmap_new(void);
+
+/**
+ * Free the map's table. The keys and values are not freed.
+ */
+void qmap_cleanup(qmap*);
+
+/**
+ * Map `key` to `value`, replacing the key's previous value if it has one (the
+ * equal key that is already in the map is kept). Return false if allocation
+ * fails, in which case the map is unchanged.
+ */
+bool qmap_set(qmap*, qstring key, void* value);
+bool qmap_set_h(qmap*, qstring key, uint64_t hash, void* value);
+
+/**
+ * If `key` is in the map, set `*value` to its value (unless `value` is NULL)
+ * and return true. Otherwise return false.
+ */
+bool qmap_get(const qmap*, qstring key, void** value);
+bool qmap_get_h(const qmap*, qstring key, uint64_t hash, void** value);
+
+/**
+ * Remove `key` from the map, and return true if it was there.
+ */
+bool qmap_remove(qmap*, qstring key);
+bool qmap_remove_h(qmap*, qstring key, uint64_t hash);
+
+/**
+ * Iterate over the map's entries, in no particular order. `*i` should be
+ * initialized to 0; each call sets `*key` and `*value` (unless they are NULL)
+ * to the next entry and returns true, or returns false when there are no more
+ * entries. The map must not be changed during iteration.
+ */
+bool qmap_next(const qmap*, size_t* i, qstring* key, void** value);
+
+#endif
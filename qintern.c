@@ -0,0 +1,179 @@
+/* Implementation of the qintern library. See qintern.h for API documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qarena.h"
+#include "qhash.h"
+#include "qintern.h"
+
+/* The number of shards. The shard of a string is chosen by the top bits of its
+ * hash, and its slot in the shard's table by the bottom bits.
+ */
+#define QINTERN_SHARD_BITS 6
+#define QINTERN_SHARDS (1 << QINTERN_SHARD_BITS)
+
+/* The number of slots in a shard's table when the first string is added. */
+#define QINTERN_MIN_CAP 64
+
+typedef struct {
+    uint64_t hash;
+    size_t len;
+    /* The canonical data, or NULL if the slot is empty. */
+    const char* data;
+} entry;
+
+typedef struct {
+    /* Each shard gets its own cache lines so that threads working on
+       different shards don't contend for them. */
+    alignas(64) pthread_mutex_t lock;
+    /* A table of `cap` slots, where `cap` is 0 or a power of two. */
+    entry* table;
+    size_t cap;
+    size_t n;
+    /* Where copies of the strings are allocated. */
+    qarena arena;
+} shard;
+
+struct qintern {
+    shard shards[QINTERN_SHARDS];
+};
+
+qintern* qintern_new(void) {
+    qintern* pool = aligned_alloc(alignof(qintern), sizeof *pool);
+    if (pool == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < QINTERN_SHARDS; i++) {
+        shard* s = &pool->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->table = NULL;
+        s->cap = 0;
+        s->n = 0;
+        s->arena = qarena_new(16 * 1024);
+    }
+    return pool;
+}
+
+void qintern_cleanup(qintern* pool) {
+    for (size_t i = 0; i < QINTERN_SHARDS; i++) {
+        shard* s = &pool->shards[i];
+        pthread_mutex_destroy(&s->lock);
+        free(s->table);
+        qarena_cleanup(&s->arena);
+    }
+    free(pool);
+}
+
+/* Return the slot that holds the string, or the empty slot where it belongs.
+ * The table must have at least one empty slot.
+ */
+static entry* probe(const shard* s, uint64_t hash, const char* data,
+    size_t len) {
+    size_t mask = s->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        entry* e = &s->table[i];
+        if (e->data == NULL || (e->hash == hash && e->len == len &&
+                memcmp(e->data, data, len) == 0)) {
+            return e;
+        }
+    }
+}
+
+/* Double the size of the shard's table. The strings themselves don't move. */
+static bool grow(shard* s) {
+    size_t newcap = (s->cap == 0) ? QINTERN_MIN_CAP : s->cap * 2;
+    entry* table = calloc(newcap, sizeof *table);
+    if (table == NULL) {
+        return false;
+    }
+    entry* old = s->table;
+    size_t oldcap = s->cap;
+    s->table = table;
+    s->cap = newcap;
+    for (size_t i = 0; i < oldcap; i++) {
+        if (old[i].data != NULL) {
+            size_t j = old[i].hash & (newcap - 1);
+            while (table[j].data != NULL) {
+                j = (j + 1) & (newcap - 1);
+            }
+            table[j] = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+static shard* shard_of(qintern* pool, uint64_t hash) {
+    return &pool->shards[hash >> (64 - QINTERN_SHARD_BITS)];
+}
+
+static qstring add(qintern* pool, qstring qs, bool copy) {
+    qstring ret = {.len = 0, .data = NULL};
+    uint64_t hash = qstring_hash(qs);
+    shard* s = shard_of(pool, hash);
+    pthread_mutex_lock(&s->lock);
+
+    /* Keep the table at most three-quarters full. */
+    if ((s->n + 1) * 4 > s->cap * 3 && !grow(s)) {
+        pthread_mutex_unlock(&s->lock);
+        return ret;
+    }
+    entry* e = probe(s, hash, qs.data, qs.len);
+    if (e->data == NULL) {
+        const char* data = qs.data;
+        if (copy) {
+            data = qstring_new_buffer_a(&s->arena, qs.data, qs.len).data;
+        }
+        if (data != NULL) {
+            e->hash = hash;
+            e->len = qs.len;
+            e->data = data;
+            s->n++;
+        }
+    }
+    ret.len = e->len;
+    ret.data = (char*)e->data;
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+qstring qintern_add(qintern* pool, qstring qs) {
+    return add(pool, qs, true);
+}
+
+qstring qintern_add_literal(qintern* pool, qstring qs) {
+    return add(pool, qs, false);
+}
+
+qstring qintern_find(qintern* pool, qstring qs) {
+    qstring ret = {.len = 0, .data = NULL};
+    uint64_t hash = qstring_hash(qs);
+    shard* s = shard_of(pool, hash);
+    pthread_mutex_lock(&s->lock);
+    if (s->cap > 0) {
+        entry* e = probe(s, hash, qs.data, qs.len);
+        ret.len = e->len;
+        ret.data = (char*)e->data;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+size_t qintern_size(qintern* pool) {
+    size_t n = 0;
+    for (size_t i = 0; i < QINTERN_SHARDS; i++) {
+        shard* s = &pool->shards[i];
+        pthread_mutex_lock(&s->lock);
+        n += s->n;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return n;
+}
@@ -0,0 +1,71 @@
+/* String interning. A qintern pool keeps one canonical copy of each distinct
+ * string that is added to it, so that a program that holds many copies of the
+ * same few strings (hostnames, field names, status codes) stores each of them
+ * once, and two interned strings are equal exactly when their data pointers
+ * are.
+ *
+ * A pool may be used from many threads at once. It is divided into shards by
+ * hash, each with its own lock and its own open-addressing table, so that
+ * threads that add different strings rarely wait for each other.
+ *
+ * The canonical strings belong to the pool. They must NOT be passed to
+ * qstring_cleanup, and they are freed by qintern_cleanup.
+ *
+ *   qintern* pool = qintern_new();
+ *   qstring a = qintern_add(pool, host);
+ *   qstring b = qintern_add(pool, qliteral("example.com"));
+ *   if (a.data == b.data) { ... }
+ *   qintern_cleanup(pool);
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#ifndef QINTERN_H
+#define QINTERN_H
+
+#include <stddef.h>
+#include "qstring.h"
+
+typedef struct qintern qintern;
+
+/**
+ * Return a new, empty pool, or NULL if allocation fails. The pool must
+ * eventually be passed to qintern_cleanup.
+ */
+qintern* qintern_new(void);
+
+/**
+ * Free the pool and all of the canonical strings that it has allocated.
+ */
+void qintern_cleanup(qintern*);
+
+/**
+ * Return the canonical qstring with the same contents as `qs`, adding a copy
+ * of `qs` to the pool if there isn't one yet. `qs` may be a qliteral, a heap
+ * qstring or a qstring from an arena, and it still belongs to the caller. If
+ * allocation fails, a qstring with a NULL data field is returned.
+ */
+qstring qintern_add(qintern*, qstring qs);
+
+/**
+ * The same as qintern_add, except that if `qs` is added, its own data becomes
+ * the canonical copy instead of a copy of it. This avoids copying string
+ * literals, but `qs.data` must be null-terminated and must stay valid and
+ * unchanged for as long as the pool is used.
+ */
+qstring qintern_add_literal(qintern*, qstring qs);
+
+/**
+ * Return the canonical qstring with the same contents as `qs`, or a qstring
+ * with a NULL data field if none has been added.
+ */
+qstring qintern_find(qintern*, qstring qs);
+
+/**
+ * Return the number of distinct strings in the pool.
+ */
+size_t qintern_size(qintern*);
+
+#endif
@@ -1,65 +1,997 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include "qstring.h"
+#include <sys/uio.h>
+#include <unistd.h>
+#include "qio.h"
 
-char* qio_readpath(const char* pathname, size_t* nptr) {
-    struct stat sbuf;
-    int errcode = stat(pathname, &sbuf);
-    if (errcode != 0) {
-        return NULL;
+/* The default buffer size of a qio_reader. */
+#define QIO_READER_DEFAULT_SIZE (64 * 1024)
+
+/* The default block size of a qio_stream. Larger than a qio_reader's buffer
+ * because each block should take long enough to process that the next read
+ * has time to finish.
+ */
+#define QIO_STREAM_DEFAULT_SIZE (1024 * 1024)
+
+/* The default buffer size of a qio_writer. */
+#define QIO_WRITER_DEFAULT_SIZE (64 * 1024)
+
+/* Pieces passed to qio_writer_writev that are shorter than this are copied
+ * into the writer's buffer even when the pieces as a whole don't fit, since
+ * for small pieces a copy is cheaper than an iovec of their own.
+ */
+#define QIO_COALESCE_MAX 512
+
+/* The most pieces passed to a single writev call. POSIX guarantees at least
+ * 16; Linux allows 1024.
+ */
+#ifdef IOV_MAX
+#define QIO_IOV_MAX IOV_MAX
+#else
+#define QIO_IOV_MAX 16
+#endif
+
+/* The size of the first buffer used to read a file whose size isn't known in
+ * advance, such as a pipe.
+ */
+#define QIO_READ_CHUNK (64 * 1024)
+
+/* The size of a cache line. qio_parallel_range places each thread's result
+ * slot on cache lines of its own, so that threads updating neighbouring slots
+ * don't contend for the same line.
+ */
+#define QIO_CACHE_LINE 64
+
+/* As in qstring.c, the readers take an optional arena and allocate from the
+ * heap if it is NULL.
+ */
+static char* alloc_data(qarena* arena, size_t n) {
+    return (arena == NULL) ? malloc(n) : qarena_alloc(arena, n);
+}
+
+static char* realloc_data(qarena* arena, char* data, size_t oldn, size_t newn) {
+    return (arena == NULL) ? realloc(data, newn) :
+        qarena_realloc(arena, data, oldn, newn);
+}
+
+static void free_data(qarena* arena, char* data) {
+    if (arena == NULL) {
+        free(data);
     }
-    char* data = malloc(sbuf.st_size + 1);
+}
+
+/* Read everything from `fd` until end-of-file into a null-terminated buffer
+ * allocated from `arena`, and place the number of bytes read in `nptr`. The
+ * buffer starts out big enough for `hint` bytes and doubles whenever it fills
+ * up, so it works for files whose size isn't known or is wrong. Returns NULL
+ * on error.
+ */
+static char* read_all(qarena* arena, int fd, size_t hint, size_t* nptr) {
+    size_t cap = (hint > 0) ? hint + 1 : QIO_READ_CHUNK;
+    char* data = alloc_data(arena, cap);
     if (data == NULL) {
         return NULL;
     }
-    FILE* fp = fopen(pathname, "r");
-    *nptr = fread(data, sizeof(char), sbuf.st_size, fp);
-    data[*nptr] = '\0';
-    fclose(fp);
+    size_t len = 0;
+    while (true) {
+        ssize_t nread;
+        if (len < cap - 1) {
+            nread = read(fd, data + len, cap - 1 - len);
+        } else {
+            /* The buffer is full, which is the usual case when the size was
+             * known in advance. Check for end-of-file with a small read
+             * before paying for a bigger buffer.
+             */
+            char probe[4096];
+            nread = read(fd, probe, sizeof probe);
+            if (nread > 0) {
+                size_t newcap = cap * 2;
+                while (newcap - 1 - len < (size_t)nread) {
+                    newcap *= 2;
+                }
+                char* new_data = realloc_data(arena, data, cap, newcap);
+                if (new_data == NULL) {
+                    free_data(arena, data);
+                    return NULL;
+                }
+                data = new_data;
+                cap = newcap;
+                memcpy(data + len, probe, nread);
+            }
+        }
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free_data(arena, data);
+            return NULL;
+        }
+        if (nread == 0) {
+            break;
+        }
+        len += nread;
+    }
+    data[len] = '\0';
+    *nptr = len;
     return data;
 }
 
-char* qio_readline(FILE* fp, size_t* nptr) {
+static char* readpath(qarena* arena, const char* pathname, size_t* nptr) {
+    int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    /* The size is only trusted as a first guess, and only for regular files:
+     * /proc files report a size of zero, and a file can grow while it is
+     * being read. Pipes and devices are read in chunks into a buffer that
+     * grows with what actually arrives.
+     */
+    size_t hint = 0;
+    if (S_ISREG(sbuf.st_mode)) {
+        hint = sbuf.st_size;
+        /* Only a hint, so failure doesn't matter. Small files aren't worth
+         * the extra syscall.
+         */
+        if (hint > QIO_READ_CHUNK) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+    char* data = read_all(arena, fd, hint, nptr);
+    close(fd);
+    return data;
+}
+
+static char* readline(qarena* arena, FILE* fp, size_t* nptr) {
     size_t readsz = 100;
-    char* data = malloc(readsz + 1);
+    char* data = alloc_data(arena, readsz + 1);
     if (data == NULL) {
         return NULL;
     }
     size_t pos = 0;
     int ch;
-    while ((ch = fgetc(fp)) != EOF) {
+    /* Lock the file once for the whole line instead of once per character. */
+    flockfile(fp);
+    while ((ch = getc_unlocked(fp)) != EOF) {
         if (ch == '\n') {
             break;
         }
 
         data[pos++] = ch;
         if (pos == readsz) {
-            readsz += 100;
-            char* new_data = realloc(data, readsz + 1);
+            readsz *= 2;
+            char* new_data = realloc_data(arena, data, pos + 1, readsz + 1);
             if (new_data != NULL) {
                 data = new_data;
             } else {
-                free(data);
+                funlockfile(fp);
+                free_data(arena, data);
                 return NULL;
             }
         }
     }
+    funlockfile(fp);
     data[pos] = '\0';
     *nptr = pos;
     return data;
 }
 
+bool qio_getline(FILE* fp, char** bufptr, size_t* capptr, size_t* nptr) {
+    char* data = *bufptr;
+    size_t cap = (data == NULL) ? 0 : *capptr;
+    size_t pos = 0;
+    int ch = EOF;
+    flockfile(fp);
+    while ((ch = getc_unlocked(fp)) != EOF && ch != '\n') {
+        /* Leave room for the null terminator. */
+        if (pos + 1 >= cap) {
+            size_t newcap = (cap < 128) ? 128 : cap * 2;
+            char* new_data = realloc(data, newcap);
+            if (new_data == NULL) {
+                /* Hand back what was read of the line, so that it isn't lost.
+                 * There is room for the terminator since pos < cap.
+                 */
+                funlockfile(fp);
+                if (data != NULL) {
+                    data[pos] = '\0';
+                }
+                *nptr = pos;
+                errno = ENOMEM;
+                return false;
+            }
+            *bufptr = data = new_data;
+            *capptr = cap = newcap;
+        }
+        data[pos++] = ch;
+    }
+    funlockfile(fp);
+    if (ch == EOF && pos == 0) {
+        return false;
+    }
+    if (data == NULL) {
+        /* An empty line at the start of an unallocated buffer. */
+        if ((data = malloc(128)) == NULL) {
+            *nptr = 0;
+            errno = ENOMEM;
+            return false;
+        }
+        *bufptr = data;
+        *capptr = 128;
+    }
+    data[pos] = '\0';
+    *nptr = pos;
+    return true;
+}
+
+/* Make sure that `b` has room for `n` more bytes, growing it geometrically as
+ * qbuilder's appends do.
+ */
+static bool reserve_more(qbuilder* b, size_t n) {
+    if (b->data != NULL && b->cap - b->len >= n) {
+        return true;
+    }
+    size_t cap = 2 * b->cap;
+    if (cap < b->len + n) {
+        cap = b->len + n;
+    }
+    return qbuilder_reserve(b, cap);
+}
+
+bool qio_getline_qs(FILE* fp, qbuilder* b, qstring* line) {
+    /* Characters are collected in a small local buffer and appended to the
+     * builder in chunks, to keep the per-character work to a minimum. Room for
+     * each chunk is made before it is filled, so that the appends can't fail
+     * and every byte taken from the file ends up in the builder.
+     */
+    char chunk[256];
+    size_t n = 0;
+    bool any = false;
+    int ch = EOF;
+    qbuilder_clear(b);
+    flockfile(fp);
+    while ((ch = getc_unlocked(fp)) != EOF) {
+        any = true;
+        if (ch == '\n') {
+            break;
+        }
+        if (n == 0 && !reserve_more(b, sizeof chunk)) {
+            /* Put the byte back so that the rest of the line is left unread,
+             * and hand back what was read before it.
+             */
+            ungetc(ch, fp);
+            funlockfile(fp);
+            line->len = b->len;
+            line->data = b->data;
+            errno = ENOMEM;
+            return false;
+        }
+        chunk[n++] = ch;
+        if (n == sizeof chunk) {
+            qbuilder_append_buffer(b, chunk, n);
+            n = 0;
+        }
+    }
+    funlockfile(fp);
+    if (!any) {
+        return false;
+    }
+    /* This allocates the builder's buffer even if the line is empty, which
+     * is the only way that it can fail.
+     */
+    if (!qbuilder_append_buffer(b, chunk, n)) {
+        line->len = 0;
+        line->data = NULL;
+        errno = ENOMEM;
+        return false;
+    }
+    line->len = b->len;
+    line->data = b->data;
+    return true;
+}
+
+char* qio_readpath(const char* pathname, size_t* nptr) {
+    return readpath(NULL, pathname, nptr);
+}
+
+char* qio_readline(FILE* fp, size_t* nptr) {
+    return readline(NULL, fp, nptr);
+}
+
 qstring qio_readpath_qs(const char* pathname) {
-    size_t n;
-    char* data = qio_readpath(pathname, &n);
+    return qio_readpath_qs_a(NULL, pathname);
+}
+
+qstring qio_readline_qs(FILE* fp) {
+    return qio_readline_qs_a(NULL, fp);
+}
+
+qstring qio_readpath_qs_a(qarena* arena, const char* pathname) {
+    size_t n = 0;
+    char* data = readpath(arena, pathname, &n);
     qstring ret = {.len = n, .data = data};
     return ret;
 }
 
-qstring qio_readline_qs(FILE* fp) {
-    size_t n;
-    char* data = qio_readline(fp, &n);
+qstring qio_readline_qs_a(qarena* arena, FILE* fp) {
+    size_t n = 0;
+    char* data = readline(arena, fp, &n);
     qstring ret = {.len = n, .data = data};
     return ret;
 }
+
+qio_mapping qio_mappath(const char* pathname) {
+    qio_mapping ret = {.data = {.len = 0, .data = NULL}, .map = NULL,
+        .maplen = 0, .buffer = NULL};
+    int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return ret;
+    }
+
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+        close(fd);
+        return ret;
+    }
+    if (S_ISREG(sbuf.st_mode) && sbuf.st_size == 0) {
+        /* mmap refuses to map zero bytes, but the file might be a /proc file
+         * that reports a size of zero and has contents anyway, so fall through
+         * to reading it.
+         */
+    } else if (S_ISREG(sbuf.st_mode)) {
+        size_t size = sbuf.st_size;
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            /* These are only hints, so failure doesn't matter. */
+            madvise(map, size, MADV_SEQUENTIAL);
+            madvise(map, size, MADV_WILLNEED);
+            close(fd);
+            ret.map = map;
+            ret.maplen = size;
+            ret.data = qrange_new_buffer(map, size);
+            return ret;
+        }
+    }
+
+    /* Pipes, character devices and files that can't be mapped are read into
+     * the heap instead.
+     */
+    size_t n = 0;
+    size_t hint = S_ISREG(sbuf.st_mode) ? sbuf.st_size : 0;
+    ret.buffer = read_all(NULL, fd, hint, &n);
+    close(fd);
+    if (ret.buffer != NULL) {
+        ret.data = qrange_new_buffer(ret.buffer, n);
+    }
+    return ret;
+}
+
+void qio_unmap(qio_mapping* m) {
+    if (m->map != NULL) {
+        munmap(m->map, m->maplen);
+    }
+    free(m->buffer);
+    m->data.len = 0;
+    m->data.data = NULL;
+    m->map = NULL;
+    m->maplen = 0;
+    m->buffer = NULL;
+}
+
+qio_reader qio_reader_new(FILE* fp, size_t bufsize) {
+    qio_reader ret = {.fp = fp, .buffer = NULL, .cap = 0, .start = 0,
+        .end = 0, .scan = 0, .eof = false, .error = false};
+    ret.cap = (bufsize == 0) ? QIO_READER_DEFAULT_SIZE : bufsize;
+    ret.buffer = malloc(ret.cap);
+    if (ret.buffer == NULL) {
+        ret.cap = 0;
+        ret.error = true;
+    }
+    return ret;
+}
+
+void qio_reader_cleanup(qio_reader* r) {
+    free(r->buffer);
+    r->buffer = NULL;
+    r->cap = 0;
+    r->start = r->end = r->scan = 0;
+}
+
+/* Read more data into the buffer. The unconsumed data is first moved to the
+ * front of the buffer, and if that doesn't make any room, the buffer is
+ * doubled. Returns false at end-of-file or on error.
+ */
+static bool reader_fill(qio_reader* r) {
+    if (r->start > 0) {
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->scan -= r->start;
+        r->start = 0;
+    }
+    if (r->end == r->cap) {
+        char* buffer = realloc(r->buffer, r->cap * 2);
+        if (buffer == NULL) {
+            r->error = true;
+            return false;
+        }
+        r->buffer = buffer;
+        r->cap *= 2;
+    }
+    size_t n = fread(r->buffer + r->end, 1, r->cap - r->end, r->fp);
+    r->end += n;
+    if (n == 0) {
+        r->eof = true;
+        r->error = ferror(r->fp) != 0;
+        return false;
+    }
+    return true;
+}
+
+bool qio_reader_readline(qio_reader* r, qrange* line) {
+    if (r->buffer == NULL) {
+        return false;
+    }
+    while (true) {
+        /* Only the bytes that arrived since the last search are searched. */
+        char* nl = memchr(r->buffer + r->scan, '\n', r->end - r->scan);
+        if (nl != NULL) {
+            size_t end = nl - r->buffer;
+            *line = qrange_new_buffer(r->buffer + r->start, end - r->start);
+            r->start = r->scan = end + 1;
+            return true;
+        }
+        r->scan = r->end;
+        if (r->eof || r->error || !reader_fill(r)) {
+            break;
+        }
+    }
+
+    /* The last line of the file might not end with a newline. */
+    if (r->start < r->end) {
+        *line = qrange_new_buffer(r->buffer + r->start, r->end - r->start);
+        r->start = r->scan = r->end;
+        return true;
+    }
+    return false;
+}
+
+qio_writer qio_writer_new(int fd, size_t bufsize) {
+    qio_writer ret = {.fd = fd, .buffer = NULL, .cap = 0, .len = 0,
+        .error = false};
+    ret.cap = (bufsize == 0) ? QIO_WRITER_DEFAULT_SIZE : bufsize;
+    ret.buffer = malloc(ret.cap);
+    if (ret.buffer == NULL) {
+        ret.cap = 0;
+        ret.error = true;
+    }
+    return ret;
+}
+
+/* Write all of `iov`, retrying after partial writes and interruptions. The
+ * array is modified as the pieces are written.
+ */
+static bool write_iov(int fd, struct iovec* iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            /* None of the pieces are empty, so writing nothing means no
+             * progress will be made, and retrying would loop forever.
+             */
+            return false;
+        }
+        size_t left = n;
+        while (cnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+bool qio_writer_writev(qio_writer* w, const qrange* pieces, size_t n) {
+    if (w->error) {
+        return false;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += pieces[i].len;
+    }
+    if (total <= w->cap - w->len) {
+        for (size_t i = 0; i < n; i++) {
+            if (pieces[i].len == 0) {
+                continue;
+            }
+            memcpy(w->buffer + w->len, pieces[i].data, pieces[i].len);
+            w->len += pieces[i].len;
+        }
+        return true;
+    }
+
+    /* The pieces don't fit, so write the buffer and the pieces themselves
+     * with as few writev calls as possible. Small pieces are still copied into
+     * the buffer, where consecutive ones share a single iovec.
+     */
+    struct iovec iov[QIO_IOV_MAX];
+    int cnt = 0;
+    /* Whether iov[cnt - 1] is the part of the buffer that ends at w->len. */
+    bool in_buffer = false;
+    /* Whether any iovec points outside the buffer. */
+    bool direct = false;
+    if (w->len > 0) {
+        iov[cnt].iov_base = w->buffer;
+        iov[cnt].iov_len = w->len;
+        cnt++;
+        in_buffer = true;
+    }
+    for (size_t i = 0; i < n; i++) {
+        size_t len = pieces[i].len;
+        if (len == 0) {
+            continue;
+        }
+        bool small = len < QIO_COALESCE_MAX && len <= w->cap;
+        bool needs_iov = !(small && in_buffer);
+        if ((small && len > w->cap - w->len) ||
+                (needs_iov && cnt == QIO_IOV_MAX)) {
+            if (!write_iov(w->fd, iov, cnt)) {
+                w->len = 0;
+                w->error = true;
+                return false;
+            }
+            w->len = 0;
+            cnt = 0;
+            in_buffer = direct = false;
+        }
+        if (small) {
+            memcpy(w->buffer + w->len, pieces[i].data, len);
+            if (in_buffer) {
+                iov[cnt - 1].iov_len += len;
+            } else {
+                iov[cnt].iov_base = w->buffer + w->len;
+                iov[cnt].iov_len = len;
+                cnt++;
+                in_buffer = true;
+            }
+            w->len += len;
+        } else {
+            iov[cnt].iov_base = (void*)pieces[i].data;
+            iov[cnt].iov_len = len;
+            cnt++;
+            in_buffer = false;
+            direct = true;
+        }
+    }
+
+    /* If every iovec is in the buffer, then they cover it from the start, and
+     * the bytes can stay there until the buffer fills up.
+     */
+    if (direct) {
+        w->len = 0;
+        if (!write_iov(w->fd, iov, cnt)) {
+            w->error = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool qio_writer_write_buffer(qio_writer* w, const char* data, size_t n) {
+    qrange piece = qrange_new_buffer(data, n);
+    return qio_writer_writev(w, &piece, 1);
+}
+
+bool qio_writer_write(qio_writer* w, qstring qs) {
+    return qio_writer_write_buffer(w, qs.data, qs.len);
+}
+
+bool qio_writer_write_range(qio_writer* w, qrange r) {
+    return qio_writer_writev(w, &r, 1);
+}
+
+bool qio_writer_flush(qio_writer* w) {
+    if (w->error) {
+        return false;
+    }
+    if (w->len > 0) {
+        struct iovec iov = {.iov_base = w->buffer, .iov_len = w->len};
+        w->len = 0;
+        if (!write_iov(w->fd, &iov, 1)) {
+            w->error = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool qio_writer_close(qio_writer* w) {
+    bool ok = qio_writer_flush(w);
+    free(w->buffer);
+    w->buffer = NULL;
+    w->cap = w->len = 0;
+    return ok;
+}
+
+struct qio_stream {
+    int fd;
+    size_t blocksize;
+    /* The two blocks, and whether each one has been filled by the background
+     * thread and not yet released by the caller. The thread fills them in
+     * turn and the caller takes them in the same order.
+     */
+    char* buffers[2];
+    size_t lens[2];
+    bool full[2];
+    /* Set by the thread when it reaches end-of-file or an error, after which
+     * no more blocks are filled.
+     */
+    bool done;
+    bool error;
+    /* Set by qio_stream_close to tell the thread to exit. */
+    bool stop;
+    /* A pipe that qio_stream_close writes to, to wake the thread if it is
+     * waiting for `fd` to become readable, as it may be for a pipe or a
+     * terminal.
+     */
+    int wake[2];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+
+    /* The rest is only touched by the caller's thread. */
+
+    /* The block the caller holds, if any. */
+    size_t current;
+    bool holding;
+    /* The current block and position of qio_stream_readline. */
+    qrange block;
+    size_t pos;
+    /* The buffer for lines that span blocks. */
+    char* carry;
+    size_t carrycap;
+};
+
+static void* stream_worker(void* arg) {
+    qio_stream* s = arg;
+    size_t i = 0;
+    while (true) {
+        pthread_mutex_lock(&s->lock);
+        while (s->full[i] && !s->stop) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        bool stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) {
+            break;
+        }
+
+        /* The read happens without the lock held, so that the caller can
+         * take and release the other block in the meantime. Wait for `fd` to
+         * be readable first rather than blocking in read(), so that
+         * qio_stream_close can interrupt the wait.
+         */
+        struct pollfd fds[2] = {
+            {.fd = s->fd, .events = POLLIN},
+            {.fd = s->wake[0], .events = POLLIN},
+        };
+        int ready;
+        do {
+            ready = poll(fds, 2, -1);
+        } while (ready < 0 && errno == EINTR);
+        if (ready > 0 && fds[1].revents != 0) {
+            break;
+        }
+
+        ssize_t n = -1;
+        if (ready > 0) {
+            do {
+                n = read(s->fd, s->buffers[i], s->blocksize);
+            } while (n < 0 && errno == EINTR);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (n > 0) {
+            s->lens[i] = n;
+            s->full[i] = true;
+        } else {
+            s->done = true;
+            s->error = n < 0;
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (n <= 0) {
+            break;
+        }
+        i ^= 1;
+    }
+    return NULL;
+}
+
+qio_stream* qio_stream_new(int fd, size_t blocksize) {
+    qio_stream* s = calloc(1, sizeof *s);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->fd = fd;
+    s->blocksize = (blocksize == 0) ? QIO_STREAM_DEFAULT_SIZE : blocksize;
+    s->buffers[0] = malloc(s->blocksize);
+    s->buffers[1] = malloc(s->blocksize);
+    if (s->buffers[0] == NULL || s->buffers[1] == NULL) {
+        free(s->buffers[0]);
+        free(s->buffers[1]);
+        free(s);
+        return NULL;
+    }
+    /* Only a hint, so failure doesn't matter. */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (pipe(s->wake) != 0) {
+        free(s->buffers[0]);
+        free(s->buffers[1]);
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, stream_worker, s) != 0) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->cond);
+        close(s->wake[0]);
+        close(s->wake[1]);
+        free(s->buffers[0]);
+        free(s->buffers[1]);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void qio_stream_close(qio_stream* s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    /* The pipe is empty, so this single byte can't block. */
+    ssize_t n;
+    do {
+        n = write(s->wake[1], "", 1);
+    } while (n < 0 && errno == EINTR);
+    pthread_join(s->thread, NULL);
+
+    close(s->wake[0]);
+    close(s->wake[1]);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->buffers[0]);
+    free(s->buffers[1]);
+    free(s->carry);
+    free(s);
+}
+
+bool qio_stream_next_block(qio_stream* s, qrange* block) {
+    pthread_mutex_lock(&s->lock);
+    if (s->holding) {
+        /* Hand the previous block back to the thread to be filled again. */
+        s->full[s->current] = false;
+        s->current ^= 1;
+        s->holding = false;
+        pthread_cond_broadcast(&s->cond);
+    }
+    while (!s->full[s->current] && !s->done) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    bool ok = s->full[s->current];
+    if (ok) {
+        s->holding = true;
+        *block = qrange_new_buffer(s->buffers[s->current],
+            s->lens[s->current]);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ok;
+}
+
+/* Append `n` bytes to the stream's carry buffer, which holds `*lenptr` bytes
+ * so far.
+ */
+static bool stream_carry(qio_stream* s, size_t* lenptr, const char* data,
+        size_t n) {
+    if (*lenptr + n > s->carrycap) {
+        size_t cap = (s->carrycap == 0) ? 128 : s->carrycap;
+        while (cap < *lenptr + n) {
+            cap *= 2;
+        }
+        char* carry = realloc(s->carry, cap);
+        if (carry == NULL) {
+            return false;
+        }
+        s->carry = carry;
+        s->carrycap = cap;
+    }
+    memcpy(s->carry + *lenptr, data, n);
+    *lenptr += n;
+    return true;
+}
+
+bool qio_stream_readline(qio_stream* s, qrange* line) {
+    size_t carrylen = 0;
+    bool carrying = false;
+    while (true) {
+        if (s->pos < s->block.len) {
+            const char* start = s->block.data + s->pos;
+            size_t avail = s->block.len - s->pos;
+            const char* nl = memchr(start, '\n', avail);
+            size_t n = (nl != NULL) ? (size_t)(nl - start) : avail;
+            if (nl != NULL && !carrying) {
+                /* The common case: the whole line is in the current block. */
+                s->pos += n + 1;
+                *line = qrange_new_buffer(start, n);
+                return true;
+            }
+            if (!stream_carry(s, &carrylen, start, n)) {
+                pthread_mutex_lock(&s->lock);
+                s->error = true;
+                pthread_mutex_unlock(&s->lock);
+                return false;
+            }
+            carrying = true;
+            if (nl != NULL) {
+                s->pos += n + 1;
+                *line = qrange_new_buffer(s->carry, carrylen);
+                return true;
+            }
+            s->pos = s->block.len;
+        }
+        if (!qio_stream_next_block(s, &s->block)) {
+            break;
+        }
+        s->pos = 0;
+    }
+
+    /* The last line of the file might not end with a newline. */
+    if (carrying) {
+        *line = qrange_new_buffer(s->carry, carrylen);
+        return true;
+    }
+    return false;
+}
+
+bool qio_stream_error(qio_stream* s) {
+    pthread_mutex_lock(&s->lock);
+    bool error = s->error;
+    pthread_mutex_unlock(&s->lock);
+    return error;
+}
+
+/* The work done by one thread of qio_parallel_range. */
+typedef struct {
+    const qio_parallel* job;
+    qrange chunk;
+    void* result;
+    pthread_t thread;
+    bool started;
+} parallel_task;
+
+static void* parallel_worker(void* arg) {
+    parallel_task* task = arg;
+    const qio_parallel* job = task->job;
+    if (job->chunk != NULL) {
+        job->chunk(task->chunk, task->result, job->ctx);
+        return NULL;
+    }
+
+    const char* p = task->chunk.data;
+    const char* end = p + task->chunk.len;
+    while (p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        const char* stop = (nl != NULL) ? nl : end;
+        job->line(qrange_new_buffer(p, stop - p), task->result, job->ctx);
+        p = (nl != NULL) ? nl + 1 : end;
+    }
+    return NULL;
+}
+
+bool qio_parallel_range(qrange data, const qio_parallel* job, void* result) {
+    size_t nthreads = job->nthreads;
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncpus > 0) ? ncpus : 1;
+    }
+    /* Don't bother with threads that would only get a few bytes each. */
+    if (nthreads > data.len / 4096 + 1) {
+        nthreads = data.len / 4096 + 1;
+    }
+
+    /* Round each slot up to whole cache lines. Even an empty slot gets one,
+     * which also keeps the total size a nonzero multiple of the alignment, as
+     * aligned_alloc requires.
+     */
+    size_t stride = (job->result_size + QIO_CACHE_LINE - 1) /
+        QIO_CACHE_LINE * QIO_CACHE_LINE;
+    if (stride == 0) {
+        stride = QIO_CACHE_LINE;
+    }
+    parallel_task* tasks = calloc(nthreads, sizeof *tasks);
+    char* slots = aligned_alloc(QIO_CACHE_LINE, nthreads * stride);
+    if (tasks == NULL || slots == NULL) {
+        free(tasks);
+        free(slots);
+        return false;
+    }
+    memset(slots, 0, nthreads * stride);
+
+    /* Split the data evenly, then move each boundary forward to just after the
+     * next newline so that no line is split between two chunks.
+     */
+    size_t start = 0;
+    for (size_t i = 0; i < nthreads; i++) {
+        size_t end = (i == nthreads - 1) ? data.len :
+            data.len / nthreads * (i + 1);
+        if (end < start) {
+            /* The previous chunk had a long last line that ran past here. */
+            end = start;
+        } else if (end > start && end < data.len) {
+            const char* nl = memchr(data.data + end - 1, '\n',
+                data.len - end + 1);
+            end = (nl != NULL) ? (size_t)(nl - data.data) + 1 : data.len;
+        }
+        tasks[i].job = job;
+        tasks[i].chunk = qrange_new_buffer(data.data + start, end - start);
+        tasks[i].result = slots + i * stride;
+        start = end;
+    }
+
+    /* The calling thread takes the first chunk itself. */
+    for (size_t i = 1; i < nthreads; i++) {
+        tasks[i].started = pthread_create(&tasks[i].thread, NULL,
+            parallel_worker, &tasks[i]) == 0;
+    }
+    parallel_worker(&tasks[0]);
+    for (size_t i = 1; i < nthreads; i++) {
+        if (tasks[i].started) {
+            pthread_join(tasks[i].thread, NULL);
+        } else {
+            parallel_worker(&tasks[i]);
+        }
+    }
+
+    if (job->merge != NULL) {
+        for (size_t i = 0; i < nthreads; i++) {
+            job->merge(result, tasks[i].result, job->ctx);
+        }
+    }
+    free(tasks);
+    free(slots);
+    return true;
+}
+
+bool qio_parallel_path(const char* pathname, const qio_parallel* job,
+        void* result) {
+    qio_mapping m = qio_mappath(pathname);
+    if (m.data.data == NULL) {
+        return false;
+    }
+    bool ok = qio_parallel_range(m.data, job, result);
+    qio_unmap(&m);
+    return ok;
+}
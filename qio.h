@@ -2,14 +2,104 @@
 #define QIO_H
 
 #include <stdio.h>
+#include "qbuilder.h"
 #include "qstring.h"
 
+/**
+ * The contents of a file opened with qio_mappath. Only the data field is
+ * public, and it is read-only.
+ */
+typedef struct {
+    /* The contents of the file. This is NOT null-terminated. */
+    qrange data;
+    /* The memory mapping, if the file was mapped. */
+    void* map;
+    size_t maplen;
+    /* The heap buffer, if the file was read instead of mapped. */
+    char* buffer;
+} qio_mapping;
+
+/**
+ * A buffered line reader. It reads the file in large blocks, finds the line
+ * breaks in each block with memchr, and hands out lines as views into its
+ * buffer, so reading a line costs no allocation and almost no copying. Only
+ * the fields documented as public may be used.
+ */
+typedef struct {
+    FILE* fp;
+    char* buffer;
+    size_t cap;
+    /* The unconsumed data is buffer[start:end]. */
+    size_t start;
+    size_t end;
+    /* The position up to which the unconsumed data has no newlines. */
+    size_t scan;
+    /* Public and read-only: whether end-of-file or an error has been reached
+       on the underlying file. */
+    bool eof;
+    bool error;
+} qio_reader;
+
+/**
+ * A buffered writer for a file descriptor. Small writes are copied into the
+ * writer's buffer, and the buffer is written out together with any large
+ * pieces in a single writev call, so that fields and separators can be
+ * written without concatenating them first. Only the error field is public,
+ * and it is read-only.
+ */
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t cap;
+    size_t len;
+    /* Whether a write or allocation has failed. Once set, all further writes
+       fail. */
+    bool error;
+} qio_writer;
+
+/**
+ * A streaming reader that reads ahead on a background thread, so that the
+ * next block of the file is read from disk while the caller is still
+ * processing the current one. The fields are private.
+ */
+typedef struct qio_stream qio_stream;
+
+/**
+ * A job for qio_parallel_range and qio_parallel_path, which split their input
+ * into chunks that end on line boundaries and process the chunks on separate
+ * threads.
+ *
+ * Each thread gets its own result slot of `result_size` bytes, zeroed to
+ * begin with and aligned to a cache line, so that threads never share mutable
+ * state, not even by way of the same cache line. When every thread has
+ * finished, the slots are merged into the caller's result one by one, in the
+ * order that the chunks appear in the input.
+ */
+typedef struct {
+    /* The number of threads to use, or 0 to use one per online CPU. */
+    size_t nthreads;
+    /* Called on each chunk, or if NULL, `line` is called on each line of each
+       chunk instead. A chunk ends just after a newline, or at the end of the
+       input. A line does not include its newline, and, as with qio_reader, a
+       final newline does not begin an extra empty line. */
+    void (*chunk)(qrange chunk, void* result, void* ctx);
+    void (*line)(qrange line, void* result, void* ctx);
+    /* The size of a result slot, and the function that merges the slot `from`
+       into `into`. `merge` may be NULL if `result_size` is 0. */
+    size_t result_size;
+    void (*merge)(void* into, const void* from, void* ctx);
+    /* Passed unchanged to every callback. */
+    void* ctx;
+} qio_parallel;
+
 /**
  * Read the entire file located at `pathname`. A heap-allocated character buffer
  * containing the contents of the file is returned, and the number of characters
- * read is placed in `nptr`.
+ * read is placed in `nptr`. The buffer is null-terminated. If the file can't be
+ * opened or read, NULL is returned.
  *
- * This function uses the stat syscall and so will only work with Linux.
+ * The file's reported size is only used as a first guess, so files that grow
+ * while they are being read, /proc files, pipes and devices are read in full.
  */
 char* qio_readpath(const char* pathname, size_t* nptr);
 
@@ -26,4 +116,197 @@ char* qio_readline(FILE*, size_t* nptr);
 qstring qio_readpath_qs(const char* pathname);
 qstring qio_readline_qs(FILE*);
 
+/**
+ * Read a line from the file into a caller-owned buffer, in the style of POSIX
+ * getline. `*bufptr` is a heap buffer of `*capptr` bytes, or NULL; it is grown
+ * with realloc when the line does not fit, and `*bufptr` and `*capptr` are
+ * updated. Since the buffer is reused from call to call, a loop that reads a
+ * file line by line only allocates until the buffer is as large as the
+ * longest line.
+ *
+ * The line is null-terminated and does not include the newline, and its
+ * length is placed in `nptr`. Return false, with nothing placed in `nptr`, if
+ * the end of the file has been reached.
+ *
+ * Also return false if memory could not be allocated, but set errno to ENOMEM
+ * and leave the part of the line read so far, null-terminated, in `*bufptr`
+ * with its length in `nptr`. The rest of the line is left unread. Since
+ * feof(fp) is only true in the first case, a loop can tell the two apart:
+ *
+ *   while (qio_getline(fp, &buf, &cap, &n)) { ... }
+ *   if (!feof(fp)) { ... }
+ *
+ * The caller must eventually free `*bufptr`.
+ */
+bool qio_getline(FILE*, char** bufptr, size_t* capptr, size_t* nptr);
+
+/**
+ * Like qio_getline, but read the line into `b`, which is cleared first and
+ * keeps its capacity from call to call, and place a qstring view of the line
+ * in `line`. The view is only valid until `b` is next modified, and it must
+ * NOT be passed to qstring_cleanup; call qbuilder_cleanup on `b` when done.
+ *
+ * As with qio_getline, if memory could not be allocated, false is returned
+ * with errno set to ENOMEM, the part of the line read so far is left in `b`
+ * with `line` viewing it, and the rest of the line is left unread.
+ */
+bool qio_getline_qs(FILE*, qbuilder* b, qstring* line);
+
+/**
+ * Return a line reader for `fp` whose buffer is `bufsize` bytes to begin with,
+ * or a sensible default if `bufsize` is 0. The buffer grows if a line is too
+ * long to fit in it. The reader takes over reading from `fp`, which should not
+ * be read from directly until the reader has been cleaned up.
+ *
+ * If the buffer can't be allocated, the reader's error field is set and it
+ * produces no lines.
+ *
+ * The returned reader must eventually be passed to qio_reader_cleanup. This
+ * does not close `fp`.
+ */
+qio_reader qio_reader_new(FILE* fp, size_t bufsize);
+
+/**
+ * Free the reader's buffer.
+ */
+void qio_reader_cleanup(qio_reader*);
+
+/**
+ * Place a view of the next line, without its newline, in `line`, and return
+ * true. If there are no more lines, return false; check the reader's error
+ * field to tell an error from end-of-file. An empty line is returned as an
+ * empty range, and a final line without a newline is still returned.
+ *
+ * The view is only valid until the next call to any qio_reader function.
+ */
+bool qio_reader_readline(qio_reader*, qrange* line);
+
+/**
+ * Return a writer for the file descriptor `fd` whose buffer holds `bufsize`
+ * bytes, or a sensible default if `bufsize` is 0. If the buffer can't be
+ * allocated, the writer's error field is set.
+ *
+ * The returned writer must eventually be passed to qio_writer_close. Nothing
+ * is guaranteed to have been written to `fd` until then or until
+ * qio_writer_flush is called.
+ */
+qio_writer qio_writer_new(int fd, size_t bufsize);
+
+/**
+ * Write a qstring, a view, or the first `n` bytes of a buffer. Return false
+ * if the write fails or the writer has already failed.
+ */
+bool qio_writer_write(qio_writer*, qstring);
+bool qio_writer_write_range(qio_writer*, qrange);
+bool qio_writer_write_buffer(qio_writer*, const char*, size_t n);
+
+/**
+ * Write the `n` pieces in order. If they don't all fit in the buffer, then
+ * small pieces are still gathered in the buffer, but larger ones are handed to
+ * the kernel directly, without being copied.
+ */
+bool qio_writer_writev(qio_writer*, const qrange* pieces, size_t n);
+
+/**
+ * Write out everything in the buffer.
+ */
+bool qio_writer_flush(qio_writer*);
+
+/**
+ * Flush the writer and free its buffer. Return false if the flush or any
+ * earlier write failed. This does not close `fd`.
+ */
+bool qio_writer_close(qio_writer*);
+
+/**
+ * Return a read-ahead stream over the file descriptor `fd`, which reads it in
+ * blocks of `blocksize` bytes, or a sensible default if `blocksize` is 0. Two
+ * blocks are used in turn: while the caller holds one, the background thread
+ * fills the other. The stream reads `fd` with read(), so it should not be
+ * read from in any other way until the stream is closed.
+ *
+ * Return NULL if memory could not be allocated or the thread or the pipe it
+ * is woken with could not be created.
+ *
+ * The returned stream must eventually be passed to qio_stream_close. This
+ * does not close `fd`.
+ */
+qio_stream* qio_stream_new(int fd, size_t blocksize);
+
+/**
+ * Stop the background thread and free the stream. This returns promptly even
+ * if the thread is waiting for input on a pipe or a terminal.
+ */
+void qio_stream_close(qio_stream*);
+
+/**
+ * Place a view of the next block of the file in `block` and return true, or
+ * return false if there are no more blocks. A block may be shorter than the
+ * stream's block size, and lines may span blocks. The view is only valid
+ * until the next call to any qio_stream function.
+ */
+bool qio_stream_next_block(qio_stream*, qrange* block);
+
+/**
+ * Place a view of the next line in `line`, as qio_reader_readline does, and
+ * return true, or return false if there are no more lines. A line that spans
+ * two blocks is copied into a buffer owned by the stream; any other line is a
+ * view into the current block. The view is only valid until the next call to
+ * any qio_stream function.
+ *
+ * Calls to this function should not be mixed with qio_stream_next_block on
+ * the same stream.
+ */
+bool qio_stream_readline(qio_stream*, qrange* line);
+
+/**
+ * Return true if reading the file failed. Check this once the stream has run
+ * out of blocks or lines to tell an error from end-of-file.
+ */
+bool qio_stream_error(qio_stream*);
+
+/**
+ * Map the file located at `pathname` into memory, read-only, and return a
+ * view of its contents. This avoids copying the file into the heap, and
+ * processes that map the same file share the same physical memory. The kernel
+ * is advised that the file will be read sequentially and soon.
+ *
+ * Pipes and other files that can't be mapped are read into a heap buffer
+ * instead, which is transparent to the caller. If the file can't be opened or
+ * read, the data field of the returned object is NULL.
+ *
+ * The returned object must eventually be passed to qio_unmap, after which its
+ * data may no longer be used.
+ */
+qio_mapping qio_mappath(const char* pathname);
+
+/**
+ * Release a file opened with qio_mappath.
+ */
+void qio_unmap(qio_mapping*);
+
+/**
+ * Run `job` on `data`, merging the per-thread results into `result`. Return
+ * false if memory for the result slots could not be allocated, in which case
+ * nothing is run. If a thread can't be started, its chunk is processed on the
+ * calling thread instead.
+ */
+bool qio_parallel_range(qrange data, const qio_parallel* job, void* result);
+
+/**
+ * Map the file located at `pathname` with qio_mappath and run `job` on its
+ * contents. Return false if the file could not be read or if
+ * qio_parallel_range fails.
+ */
+bool qio_parallel_path(const char* pathname, const qio_parallel* job,
+    void* result);
+
+/**
+ * Variants of the qstring functions that allocate from `arena` instead of the
+ * heap (see qarena.h). The returned qstrings must NOT be passed to
+ * qstring_cleanup.
+ */
+qstring qio_readpath_qs_a(qarena* arena, const char* pathname);
+qstring qio_readline_qs_a(qarena* arena, FILE*);
+
 #endif
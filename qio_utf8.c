@@ -0,0 +1,62 @@
+/* Implementation of the qio_utf8 library. See qio_utf8.h for API
+ * documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdlib.h>
+#include "qio.h"
+#include "qio_utf8.h"
+
+/* The size of the first buffer used by qio_utf8_read. */
+#define QIO_UTF8_CHUNK (64 * 1024)
+
+qstring_utf8 qio_utf8_read(FILE* fp) {
+    qstring_utf8 ret = {.len = 0, .data = NULL};
+    size_t cap = QIO_UTF8_CHUNK;
+    size_t len = 0;
+    char* data = malloc(cap);
+    if (data == NULL) {
+        return ret;
+    }
+    while (true) {
+        len += fread(data + len, 1, cap - len, fp);
+        if (len < cap) {
+            break;
+        }
+        char* new_data = realloc(data, cap * 2);
+        if (new_data == NULL) {
+            free(data);
+            return ret;
+        }
+        data = new_data;
+        cap *= 2;
+    }
+    if (!ferror(fp)) {
+        qstring qs = {.len = len, .data = data};
+        ret = qstring_utf8_decode(qs);
+    }
+    free(data);
+    return ret;
+}
+
+qstring_utf8 qio_utf8_readline(FILE* fp) {
+    qstring line = qio_readline_qs(fp);
+    qstring_utf8 ret = {.len = 0, .data = NULL};
+    if (line.data != NULL) {
+        ret = qstring_utf8_decode(line);
+        qstring_cleanup(line);
+    }
+    return ret;
+}
+
+size_t qio_utf8_write(FILE* fp, qstring_utf8 qs) {
+    qstring encoded = qstring_utf8_encode(qs);
+    if (encoded.data == NULL) {
+        return 0;
+    }
+    size_t n = fwrite(encoded.data, 1, encoded.len, fp);
+    qstring_cleanup(encoded);
+    return n;
+}
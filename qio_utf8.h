@@ -1,11 +1,37 @@
+/* File I/O for qstring_utf8. The files are read and written as UTF-8.
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
 #ifndef QIO_UTF8_H
 #define QIO_UTF8_H
 
+#include <stdio.h>
 #include "qstring_utf8.h"
 
-qstring qio_utf8_read(FILE*);
-qstring qio_utf8_readline(FILE*);
+/**
+ * Read the rest of the file and decode it. If the file can't be read or is
+ * not valid UTF-8, a qstring_utf8 with a NULL data field is returned.
+ *
+ * The returned qstring_utf8 must eventually be passed to qstring_utf8_cleanup.
+ */
+qstring_utf8 qio_utf8_read(FILE*);
+
+/**
+ * Read a line from the file, as qio_readline does, and decode it. If the line
+ * is not valid UTF-8, a qstring_utf8 with a NULL data field is returned.
+ *
+ * The returned qstring_utf8 must eventually be passed to qstring_utf8_cleanup.
+ */
+qstring_utf8 qio_utf8_readline(FILE*);
 
+/**
+ * Encode the code points as UTF-8 and write them to the file. Return the
+ * number of bytes written, which is 0 if the qstring_utf8 contains a code
+ * point that can't be encoded.
+ */
 size_t qio_utf8_write(FILE*, qstring_utf8);
 
 #endif
@@ -0,0 +1,489 @@
+/* Implementation of the qrope library. See qrope.h for API documentation.
+ *
+ * The tree is an implicit treap: a node's position comes from the sizes of
+ * the subtrees to its left rather than from a key, and every node has a
+ * random priority that is no smaller than its children's, which keeps the
+ * expected depth logarithmic however the rope is edited. Every operation that
+ * changes the shape of the tree is built from split, which divides a tree at a
+ * byte offset, and merge, which joins two trees end to end.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qrope.h"
+
+/* How full qrope_from_qstring and qrope_insert make new chunks, leaving room
+ * for later insertions to be made in place.
+ */
+#define QROPE_FILL (QROPE_CHUNK * 3 / 4)
+
+struct qrope_node {
+    qrope_node* left;
+    qrope_node* right;
+    uint64_t priority;
+    /* The number of bytes in the whole subtree. */
+    size_t size;
+    /* The number of bytes in this node's chunk. */
+    size_t len;
+    char data[QROPE_CHUNK];
+};
+
+/* Nodes that are allocated before an edit starts, so that the edit can't fail
+ * halfway through.
+ */
+typedef struct {
+    qrope_node** nodes;
+    size_t n;
+} spares;
+
+/* The number of ropes created so far, from which each rope's seed is derived.
+ * If every rope started from the same seed, then the ropes would draw the same
+ * priorities, and concatenating many small ropes would pile them up into a
+ * tree as deep as the number of ropes.
+ */
+static atomic_uint_fast64_t nropes;
+
+qrope qrope_new(void) {
+    /* splitmix64, which turns consecutive counts into unrelated seeds. */
+    uint64_t z = atomic_fetch_add_explicit(&nropes, 1, memory_order_relaxed);
+    z = (z + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    /* xorshift64 gets stuck at zero. */
+    qrope ret = {.len = 0, .root = NULL, .seed = (z != 0) ? z : 1};
+    return ret;
+}
+
+static uint64_t next_priority(qrope* r) {
+    /* xorshift64 */
+    r->seed ^= r->seed << 13;
+    r->seed ^= r->seed >> 7;
+    r->seed ^= r->seed << 17;
+    return r->seed;
+}
+
+static size_t size_of(const qrope_node* node) {
+    return (node == NULL) ? 0 : node->size;
+}
+
+static void update(qrope_node* node) {
+    node->size = size_of(node->left) + node->len + size_of(node->right);
+}
+
+static void free_tree(qrope_node* node) {
+    if (node != NULL) {
+        free_tree(node->left);
+        free_tree(node->right);
+        free(node);
+    }
+}
+
+static size_t depth_of(const qrope_node* node) {
+    if (node == NULL) {
+        return 0;
+    }
+    size_t left = depth_of(node->left);
+    size_t right = depth_of(node->right);
+    return 1 + ((left > right) ? left : right);
+}
+
+size_t qrope_depth(const qrope* r) {
+    return depth_of(r->root);
+}
+
+void qrope_cleanup(qrope* r) {
+    free_tree(r->root);
+    r->root = NULL;
+    r->len = 0;
+}
+
+/* Join two trees, with every byte of `a` before every byte of `b`. */
+static qrope_node* merge(qrope_node* a, qrope_node* b) {
+    if (a == NULL) {
+        return b;
+    }
+    if (b == NULL) {
+        return a;
+    }
+    if (a->priority >= b->priority) {
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    } else {
+        b->left = merge(a, b->left);
+        update(b);
+        return b;
+    }
+}
+
+/* Divide the tree into its first `pos` bytes and the rest. If `pos` falls
+ * inside a chunk, the end of the chunk is moved to a node from `sp`, which
+ * must have one left.
+ */
+static void split(qrope_node* node, size_t pos, qrope_node** left,
+    qrope_node** right, spares* sp) {
+    if (node == NULL) {
+        *left = *right = NULL;
+        return;
+    }
+    size_t lsize = size_of(node->left);
+    if (pos <= lsize) {
+        split(node->left, pos, left, &node->left, sp);
+        update(node);
+        *right = node;
+    } else if (pos >= lsize + node->len) {
+        split(node->right, pos - lsize - node->len, &node->right, right, sp);
+        update(node);
+        *left = node;
+    } else {
+        /* The tail of the chunk takes over the node's right subtree, and its
+           priority, which is no smaller than anything in that subtree. */
+        size_t k = pos - lsize;
+        qrope_node* tail = sp->nodes[--sp->n];
+        tail->priority = node->priority;
+        tail->len = node->len - k;
+        memcpy(tail->data, node->data + k, tail->len);
+        tail->left = NULL;
+        tail->right = node->right;
+        update(tail);
+        node->len = k;
+        node->right = NULL;
+        update(node);
+        *left = node;
+        *right = tail;
+    }
+}
+
+/* Allocate `n` nodes into `sp`, or return false if allocation fails. */
+static bool alloc_spares(spares* sp, qrope_node** nodes, size_t n) {
+    sp->nodes = nodes;
+    for (sp->n = 0; sp->n < n; sp->n++) {
+        nodes[sp->n] = malloc(sizeof (qrope_node));
+        if (nodes[sp->n] == NULL) {
+            while (sp->n > 0) {
+                free(nodes[--sp->n]);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_spares(spares* sp) {
+    while (sp->n > 0) {
+        free(sp->nodes[--sp->n]);
+    }
+}
+
+/* Return a tree of the bytes of `text`, in chunks of QROPE_FILL bytes, built
+ * from the nodes in `sp`.
+ */
+static qrope_node* build(qrope* r, qstring text, spares* sp) {
+    qrope_node* tree = NULL;
+    for (size_t i = 0; i < text.len; i += QROPE_FILL) {
+        qrope_node* node = sp->nodes[--sp->n];
+        node->left = node->right = NULL;
+        node->priority = next_priority(r);
+        node->len = (text.len - i < QROPE_FILL) ? text.len - i : QROPE_FILL;
+        memcpy(node->data, text.data + i, node->len);
+        update(node);
+        tree = merge(tree, node);
+    }
+    return tree;
+}
+
+static size_t chunks_for(size_t n) {
+    return (n + QROPE_FILL - 1) / QROPE_FILL;
+}
+
+qrope qrope_from_qstring(qstring qs) {
+    qrope ret = qrope_new();
+    if (qs.len == 0) {
+        return ret;
+    }
+    size_t n = chunks_for(qs.len);
+    qrope_node** nodes = malloc(n * sizeof *nodes);
+    spares sp;
+    if (nodes == NULL || !alloc_spares(&sp, nodes, n)) {
+        free(nodes);
+        return ret;
+    }
+    ret.root = build(&ret, qs, &sp);
+    ret.len = qs.len;
+    free(nodes);
+    return ret;
+}
+
+/* Return the node whose chunk contains byte `pos`, or whose chunk ends at
+ * `pos` if `at_end` is true and no chunk contains it, and set `*offset` to the
+ * position of `pos` in the chunk.
+ */
+static qrope_node* locate(qrope_node* node, size_t pos, bool at_end,
+    size_t* offset) {
+    while (node != NULL) {
+        size_t lsize = size_of(node->left);
+        if (pos < lsize) {
+            node = node->left;
+        } else if (pos < lsize + node->len ||
+                (at_end && pos == lsize + node->len)) {
+            *offset = pos - lsize;
+            return node;
+        } else {
+            pos -= lsize + node->len;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+/* Add `delta` to the size of every node on the path from `node` down to
+ * `target`, the node that holds byte `pos`, after the length of its chunk has
+ * changed in place. A negative change wraps around, which adds correctly.
+ */
+static void adjust_sizes(qrope_node* node, const qrope_node* target,
+    size_t pos, size_t delta) {
+    while (node != NULL) {
+        node->size += delta;
+        if (node == target) {
+            return;
+        }
+        size_t lsize = size_of(node->left);
+        if (pos < lsize) {
+            node = node->left;
+        } else {
+            pos -= lsize + node->len;
+            node = node->right;
+        }
+    }
+}
+
+bool qrope_insert(qrope* r, size_t index, qstring text) {
+    if (index > r->len) {
+        index = r->len;
+    }
+    if (text.len == 0) {
+        return true;
+    }
+
+    /* Insert in place if the text fits in the chunk at `index`. */
+    size_t offset;
+    qrope_node* node = locate(r->root, index, true, &offset);
+    if (node != NULL && node->len + text.len <= QROPE_CHUNK) {
+        memmove(node->data + offset + text.len, node->data + offset,
+            node->len - offset);
+        memcpy(node->data + offset, text.data, text.len);
+        node->len += text.len;
+        adjust_sizes(r->root, node, index, text.len);
+        r->len += text.len;
+        return true;
+    }
+
+    /* Otherwise split the rope at `index` and put a tree of new chunks in
+       between. One more node may be needed for the split. */
+    size_t n = chunks_for(text.len) + 1;
+    qrope_node* stack_nodes[8];
+    qrope_node** nodes = (n <= 8) ? stack_nodes : malloc(n * sizeof *nodes);
+    spares sp;
+    if (nodes == NULL || !alloc_spares(&sp, nodes, n)) {
+        if (nodes != stack_nodes) {
+            free(nodes);
+        }
+        return false;
+    }
+    qrope_node* left;
+    qrope_node* right;
+    split(r->root, index, &left, &right, &sp);
+    qrope_node* middle = build(r, text, &sp);
+    r->root = merge(merge(left, middle), right);
+    r->len += text.len;
+    free_spares(&sp);
+    if (nodes != stack_nodes) {
+        free(nodes);
+    }
+    return true;
+}
+
+bool qrope_remove(qrope* r, size_t start, size_t n) {
+    if (start >= r->len || n == 0) {
+        return true;
+    }
+    if (n > r->len - start) {
+        n = r->len - start;
+    }
+
+    /* Remove in place if the bytes are all in one chunk, and some of the
+       chunk is left. */
+    size_t offset;
+    qrope_node* node = locate(r->root, start, false, &offset);
+    if (node != NULL && offset + n <= node->len && n < node->len) {
+        memmove(node->data + offset, node->data + offset + n,
+            node->len - offset - n);
+        node->len -= n;
+        adjust_sizes(r->root, node, start, -n);
+        r->len -= n;
+        return true;
+    }
+
+    /* Otherwise cut out the bytes with two splits, each of which may need a
+       node. */
+    qrope_node* nodes[2];
+    spares sp;
+    if (!alloc_spares(&sp, nodes, 2)) {
+        return false;
+    }
+    qrope_node* left;
+    qrope_node* middle;
+    qrope_node* right;
+    split(r->root, start, &left, &right, &sp);
+    split(right, n, &middle, &right, &sp);
+    free_tree(middle);
+    r->root = merge(left, right);
+    r->len -= n;
+    free_spares(&sp);
+    return true;
+}
+
+void qrope_concat(qrope* r, qrope* other) {
+    r->root = merge(r->root, other->root);
+    r->len += other->len;
+    other->root = NULL;
+    other->len = 0;
+}
+
+/* The state of a search. Matches that span chunks are found by searching a
+ * window of the last few bytes before each chunk followed by the first few
+ * bytes of the chunk.
+ */
+typedef struct {
+    /* The datum, compiled once for all of the chunks. */
+    const qpattern* p;
+    /* The last datum.len - 1 bytes before the current chunk, with room for as
+       many from the chunk. */
+    char* window;
+    size_t nwindow;
+    /* The index of the start of the current chunk. */
+    size_t offset;
+    size_t found;
+} finder;
+
+/* Search the chunk, and return true if a match was found. */
+static bool find_in_chunk(finder* f, const char* data, size_t n) {
+    size_t keep = f->p->needle.len - 1;
+    if (f->nwindow > 0) {
+        size_t extra = (n < keep) ? n : keep;
+        memcpy(f->window + f->nwindow, data, extra);
+        size_t i = qrange_find_p(
+            qrange_new_buffer(f->window, f->nwindow + extra), f->p);
+        /* A match that starts in the chunk is found below. */
+        if (i < f->nwindow) {
+            f->found = f->offset - f->nwindow + i;
+            return true;
+        }
+    }
+    size_t i = qrange_find_p(qrange_new_buffer(data, n), f->p);
+    if (i < n) {
+        f->found = f->offset + i;
+        return true;
+    }
+
+    if (n >= keep) {
+        memcpy(f->window, data + n - keep, keep);
+        f->nwindow = keep;
+    } else {
+        size_t old = (f->nwindow < keep - n) ? f->nwindow : keep - n;
+        memmove(f->window, f->window + f->nwindow - old, old);
+        memcpy(f->window + old, data, n);
+        f->nwindow = old + n;
+    }
+    f->offset += n;
+    return false;
+}
+
+static bool find_in_tree(finder* f, const qrope_node* node) {
+    return node != NULL && (find_in_tree(f, node->left) ||
+        find_in_chunk(f, node->data, node->len) ||
+        find_in_tree(f, node->right));
+}
+
+size_t qrope_find(const qrope* r, qstring datum) {
+    if (datum.len == 0) {
+        return 0;
+    }
+    qpattern p = qpattern_compile(datum);
+    if (p.needle.data == NULL) {
+        errno = ENOMEM;
+        return r->len;
+    }
+    char small[256];
+    finder f = {
+        .p = &p, .window = small, .nwindow = 0, .offset = 0,
+        .found = r->len
+    };
+    if (2 * datum.len > sizeof small) {
+        f.window = malloc(2 * datum.len);
+        if (f.window == NULL) {
+            qpattern_cleanup(&p);
+            errno = ENOMEM;
+            return r->len;
+        }
+    }
+    find_in_tree(&f, r->root);
+    if (f.window != small) {
+        free(f.window);
+    }
+    qpattern_cleanup(&p);
+    return f.found;
+}
+
+/* Copy the `n` bytes of the tree starting at `start` to `out`. */
+static void copy_range(const qrope_node* node, size_t start, size_t n,
+    char* out) {
+    while (node != NULL && n > 0) {
+        size_t lsize = size_of(node->left);
+        if (start < lsize) {
+            size_t k = (n < lsize - start) ? n : lsize - start;
+            copy_range(node->left, start, k, out);
+            out += k;
+            n -= k;
+            start = lsize;
+        }
+        if (n > 0 && start < lsize + node->len) {
+            size_t offset = start - lsize;
+            size_t k = (n < node->len - offset) ? n : node->len - offset;
+            memcpy(out, node->data + offset, k);
+            out += k;
+            n -= k;
+            start = lsize + node->len;
+        }
+        start -= lsize + node->len;
+        node = node->right;
+    }
+}
+
+qstring qrope_substr(const qrope* r, size_t start, size_t n) {
+    qstring ret = {.len = 0, .data = NULL};
+    if (start > r->len) {
+        start = r->len;
+    }
+    if (n > r->len - start) {
+        n = r->len - start;
+    }
+    ret.data = malloc(n + 1);
+    if (ret.data == NULL) {
+        return ret;
+    }
+    copy_range(r->root, start, n, ret.data);
+    ret.data[n] = '\0';
+    ret.len = n;
+    return ret;
+}
+
+qstring qrope_to_qstring(const qrope* r) {
+    return qrope_substr(r, 0, r->len);
+}
@@ -0,0 +1,106 @@
+/* Ropes, for large strings that are edited in many small places. A qrope
+ * keeps its contents in chunks of up to QROPE_CHUNK bytes at the nodes of a
+ * balanced tree (a treap, whose shape is kept balanced by random priorities),
+ * so inserting, removing and concatenating take time proportional to the
+ * logarithm of the length, where the equivalent qstring functions copy the
+ * whole string. An edit that fits inside a single chunk is made in place.
+ *
+ * Unlike a qstring, a qrope is mutable, and it is passed by pointer. It can be
+ * searched without being flattened, and qrope_to_qstring makes an ordinary
+ * qstring of it when one is needed.
+ *
+ *   qrope r = qrope_from_qstring(template);
+ *   qrope_insert(&r, qrope_find(&r, qliteral("</body>")), footer);
+ *   qstring page = qrope_to_qstring(&r);
+ *   qrope_cleanup(&r);
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#ifndef QROPE_H
+#define QROPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "qstring.h"
+
+/* The most bytes that a single chunk holds. */
+#define QROPE_CHUNK 1024
+
+typedef struct qrope_node qrope_node;
+
+typedef struct {
+    /* The number of bytes in the rope. Public and read-only. */
+    size_t len;
+
+    /* The remaining fields are private. */
+    qrope_node* root;
+    /* The state of the generator for node priorities. */
+    uint64_t seed;
+} qrope;
+
+/**
+ * Return an empty rope, or a rope with a copy of the qstring's contents. If
+ * allocation fails, the rope is empty.
+ *
+ * The returned rope must eventually be passed to qrope_cleanup to avoid a
+ * memory leak.
+ */
+qrope qrope_new(void);
+qrope qrope_from_qstring(qstring);
+
+/**
+ * Free all of the rope's chunks, leaving it empty.
+ */
+void qrope_cleanup(qrope*);
+
+/**
+ * Insert a copy of `text` before the byte at `index`, or at the end of the
+ * rope if `index` is out of bounds. Return false if allocation fails, in which
+ * case the rope is unchanged.
+ */
+bool qrope_insert(qrope*, size_t index, qstring text);
+
+/**
+ * Remove `n` bytes starting at `start`, with the same handling of
+ * out-of-bounds indices as qstring_remove. Return false if allocation fails,
+ * in which case the rope is unchanged.
+ */
+bool qrope_remove(qrope*, size_t start, size_t n);
+
+/**
+ * Move the contents of `other` to the end of the rope, leaving `other` empty.
+ * This never allocates.
+ */
+void qrope_concat(qrope*, qrope* other);
+
+/**
+ * Return the index of the first instance of `datum` in the rope, including
+ * instances that span chunks, or `r->len` if there is none.
+ *
+ * The datum is compiled once for the whole search, which allocates. If
+ * allocation fails, `r->len` is also returned, and errno is set to ENOMEM.
+ * Callers that need to tell this apart from a failed search can clear errno
+ * beforehand.
+ */
+size_t qrope_find(const qrope* r, qstring datum);
+
+/**
+ * Return the number of chunks on the longest path from the root of the rope's
+ * tree to a leaf, which is expected to grow with the logarithm of the number
+ * of chunks. This is mainly useful for testing.
+ */
+size_t qrope_depth(const qrope*);
+
+/**
+ * Return a qstring with a copy of the `n` bytes starting at `start`, with the
+ * same handling of out-of-bounds indices as qstring_substr, or of the whole
+ * rope. The returned qstring must eventually be passed to qstring_cleanup.
+ */
+qstring qrope_substr(const qrope* r, size_t start, size_t n);
+qstring qrope_to_qstring(const qrope*);
+
+#endif
@@ -0,0 +1,154 @@
+/* Implementation of the qshared library. See qshared.h for API documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qshared.h"
+
+struct qshared_buffer {
+    atomic_size_t refs;
+    /* The data, which directly follows the struct unless it was adopted from
+       a qstring. */
+    char* data;
+};
+
+static const qshared failed = {.len = 0, .data = NULL, .buffer = NULL};
+
+qshared qshared_new(const char* cs) {
+    return qshared_new_buffer(cs, strlen(cs));
+}
+
+qshared qshared_new_buffer(const char* buffer, size_t n) {
+    /* Allocate the reference count and the data together. */
+    qshared_buffer* b = malloc(sizeof *b + n + 1);
+    if (b == NULL) {
+        return failed;
+    }
+    atomic_init(&b->refs, 1);
+    b->data = (char*)(b + 1);
+    memcpy(b->data, buffer, n);
+    b->data[n] = '\0';
+
+    qshared ret = {.len = n, .data = b->data, .buffer = b};
+    return ret;
+}
+
+qshared qshared_adopt(qstring qs) {
+    if (qs.data == NULL) {
+        return failed;
+    }
+    qshared_buffer* b = malloc(sizeof *b);
+    if (b == NULL) {
+        qstring_cleanup(qs);
+        return failed;
+    }
+    atomic_init(&b->refs, 1);
+    b->data = qs.data;
+
+    qshared ret = {.len = qs.len, .data = b->data, .buffer = b};
+    return ret;
+}
+
+qshared qshared_copy(qshared qs) {
+    if (qs.buffer != NULL) {
+        /* A new reference can only be made from an existing one, which keeps
+           the buffer alive, so no ordering is needed. */
+        atomic_fetch_add_explicit(&qs.buffer->refs, 1, memory_order_relaxed);
+    }
+    return qs;
+}
+
+qshared qshared_substr(qshared qs, size_t start, size_t n) {
+    if (start > qs.len) {
+        start = qs.len;
+    }
+    if (n > qs.len - start) {
+        n = qs.len - start;
+    }
+    qshared ret = qshared_copy(qs);
+    ret.data += start;
+    ret.len = n;
+    return ret;
+}
+
+/* Return a qstring that borrows the qshared's data. It is not null-terminated
+ * if the qshared is a substring that stops short of the end of its buffer, so
+ * it must only be passed to qstring functions that read their arguments by
+ * length, as the searching, removing and replacing functions do.
+ */
+static qstring view(qshared qs) {
+    qstring ret = {.len = qs.len, .data = (char*)qs.data};
+    return ret;
+}
+
+qshared qshared_remove(qshared qs, size_t start, size_t n) {
+    if (start >= qs.len || n == 0) {
+        return qshared_copy(qs);
+    }
+    if (n > qs.len - start) {
+        n = qs.len - start;
+    }
+    if (start == 0) {
+        return qshared_substr(qs, n, qs.len - n);
+    }
+    if (start + n == qs.len) {
+        return qshared_substr(qs, 0, start);
+    }
+    return qshared_adopt(qstring_remove(view(qs), start, n));
+}
+
+qshared qshared_replace_all(qshared qs, qstring before, qstring after) {
+    if (before.len > 0 && qstring_find(view(qs), before) == qs.len) {
+        return qshared_copy(qs);
+    }
+    return qshared_adopt(qstring_replace_all(view(qs), before, after));
+}
+
+qshared qshared_replace_first(qshared qs, qstring before, qstring after) {
+    if (before.len > 0 && qstring_find(view(qs), before) == qs.len) {
+        return qshared_copy(qs);
+    }
+    return qshared_adopt(qstring_replace_first(view(qs), before, after));
+}
+
+qshared qshared_replace_last(qshared qs, qstring before, qstring after) {
+    if (before.len > 0 && qstring_rfind(view(qs), before) == qs.len) {
+        return qshared_copy(qs);
+    }
+    return qshared_adopt(qstring_replace_last(view(qs), before, after));
+}
+
+qrange qshared_range(qshared qs) {
+    return qrange_new_buffer(qs.data, qs.len);
+}
+
+qstring qshared_to_qstring(qshared qs) {
+    return qstring_new_buffer(qs.data, qs.len);
+}
+
+size_t qshared_refcount(qshared qs) {
+    if (qs.buffer == NULL) {
+        return 0;
+    }
+    return atomic_load_explicit(&qs.buffer->refs, memory_order_relaxed);
+}
+
+void qshared_cleanup(qshared qs) {
+    qshared_buffer* b = qs.buffer;
+    if (b == NULL) {
+        return;
+    }
+    /* The release and acquire make every thread's reads of the data happen
+       before the buffer is freed. */
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_release) == 1) {
+        atomic_thread_fence(memory_order_acquire);
+        if (b->data != (char*)(b + 1)) {
+            free(b->data);
+        }
+        free(b);
+    }
+}
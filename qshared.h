@@ -0,0 +1,112 @@
+/* Reference-counted strings. A qshared refers to an immutable buffer that may
+ * be shared by many qshareds, so that copying one, or taking a substring of
+ * one, only increments a reference count instead of copying the data. The
+ * buffer is freed when the last qshared that refers to it is cleaned up.
+ * Reference counts are updated atomically, so qshareds that share a buffer may
+ * be copied and cleaned up from different threads.
+ *
+ * This is meant for large documents that are handed from one part of a
+ * program to another. It is a separate type from qstring because a qstring's
+ * data field is its whole allocation, so qstring_cleanup has no way to find a
+ * reference count, and a substring could never share its parent's buffer.
+ *
+ * Since a substring points into the middle of its parent's buffer, the data
+ * field of a qshared is only null-terminated if it extends to the end of the
+ * buffer. Always use the len field. If allocation fails, the returned qshared
+ * has a NULL data field and a length of 0.
+ *
+ *   qshared doc = qshared_adopt(qio_readpath_qs("report.txt"));
+ *   qshared head = qshared_substr(doc, 0, 1024);
+ *   qshared_cleanup(doc);
+ *   ...
+ *   qshared_cleanup(head);
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#ifndef QSHARED_H
+#define QSHARED_H
+
+#include <stddef.h>
+#include "qstring.h"
+
+typedef struct qshared_buffer qshared_buffer;
+
+typedef struct {
+    /* The len and data fields are public and read-only. */
+    size_t len;
+    const char* data;
+    /* The shared buffer that `data` points into. */
+    qshared_buffer* buffer;
+} qshared;
+
+/**
+ * Return a qshared with a copy of the null-terminated string, or of the first
+ * `n` bytes of the buffer.
+ *
+ * The returned qshared must eventually be passed to qshared_cleanup to avoid a
+ * memory leak, as must every qshared returned by the functions below.
+ */
+qshared qshared_new(const char*);
+qshared qshared_new_buffer(const char*, size_t n);
+
+/**
+ * Return a qshared that takes ownership of the qstring's data without copying
+ * it. The qstring must have been allocated on the heap (not by qliteral or in
+ * an arena), and must not be passed to qstring_cleanup afterwards.
+ */
+qshared qshared_adopt(qstring);
+
+/**
+ * Return a new reference to the same data.
+ */
+qshared qshared_copy(qshared);
+
+/**
+ * Return the substring of `n` bytes starting at `start`, with the same
+ * handling of out-of-bounds indices as qstring_substr. The substring shares
+ * the buffer of `qs`.
+ */
+qshared qshared_substr(qshared qs, size_t start, size_t n);
+
+/**
+ * The same as qstring_remove, except that nothing is copied if no bytes are
+ * removed or if the removed bytes are at the beginning or end of the string.
+ */
+qshared qshared_remove(qshared qs, size_t start, size_t n);
+
+/**
+ * The same as the qstring_replace_* functions, except that if `before` does not
+ * occur in `qs`, a new reference to `qs` is returned instead of a copy.
+ */
+qshared qshared_replace_all(qshared qs, qstring before, qstring after);
+qshared qshared_replace_first(qshared qs, qstring before, qstring after);
+qshared qshared_replace_last(qshared qs, qstring before, qstring after);
+
+/**
+ * Return a qrange of the qshared's data, for use with the qrange functions in
+ * qstring.h. It is valid for as long as the qshared is.
+ */
+qrange qshared_range(qshared);
+
+/**
+ * Return a null-terminated copy of the data as a qstring, which must eventually
+ * be passed to qstring_cleanup.
+ */
+qstring qshared_to_qstring(qshared);
+
+/**
+ * Return the number of qshareds that currently refer to the buffer. This is
+ * only exact when no other thread is copying or cleaning up those qshareds.
+ */
+size_t qshared_refcount(qshared);
+
+/**
+ * Release the qshared's reference to its buffer, and free the buffer if this
+ * was the last reference.
+ */
+void qshared_cleanup(qshared);
+
+#endif
@@ -0,0 +1,80 @@
+/* Implementation of the qsmall library. See qsmall.h for API documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "qsmall.h"
+
+/* The position of the tag byte, and its value for heap strings. Since an
+ * inline string is at most QSMALL_INLINE_MAX bytes long and its null
+ * terminator comes before the tag, the tag of an inline string is always
+ * smaller than this.
+ */
+#define QSMALL_TAG (sizeof(qsmall) - 1)
+#define QSMALL_HEAP_TAG 0xFF
+
+static unsigned char tag(const qsmall* s) {
+    return s->u.bytes[QSMALL_TAG];
+}
+
+qsmall qsmall_new(const char* cs) {
+    return qsmall_new_buffer(cs, strlen(cs));
+}
+
+qsmall qsmall_from_qstring(qstring qs) {
+    return qsmall_new_buffer(qs.data, qs.len);
+}
+
+qsmall qsmall_new_buffer(const char* buffer, size_t n) {
+    qsmall ret;
+    if (n <= QSMALL_INLINE_MAX) {
+        memcpy(ret.u.bytes, buffer, n);
+        ret.u.bytes[n] = '\0';
+        ret.u.bytes[QSMALL_TAG] = n;
+        return ret;
+    }
+
+    ret.u.bytes[QSMALL_TAG] = QSMALL_HEAP_TAG;
+    ret.u.heap.len = 0;
+    ret.u.heap.data = malloc(n + 1);
+    if (ret.u.heap.data != NULL) {
+        memcpy(ret.u.heap.data, buffer, n);
+        ret.u.heap.data[n] = '\0';
+        ret.u.heap.len = n;
+    }
+    return ret;
+}
+
+void qsmall_cleanup(qsmall* s) {
+    if (tag(s) == QSMALL_HEAP_TAG) {
+        free(s->u.heap.data);
+        s->u.heap.data = NULL;
+        s->u.heap.len = 0;
+    }
+}
+
+bool qsmall_is_inline(const qsmall* s) {
+    return tag(s) != QSMALL_HEAP_TAG;
+}
+
+size_t qsmall_len(const qsmall* s) {
+    return qsmall_is_inline(s) ? tag(s) : s->u.heap.len;
+}
+
+const char* qsmall_data(const qsmall* s) {
+    return qsmall_is_inline(s) ? s->u.bytes : s->u.heap.data;
+}
+
+qstring qsmall_view(const qsmall* s) {
+    qstring ret = {.len = qsmall_len(s), .data = (char*)qsmall_data(s)};
+    return ret;
+}
+
+bool qsmall_equals(const qsmall* a, const qsmall* b) {
+    size_t len = qsmall_len(a);
+    return len == qsmall_len(b) &&
+        memcmp(qsmall_data(a), qsmall_data(b), len) == 0;
+}
@@ -0,0 +1,87 @@
+/* Strings with the small-string optimization. A qsmall holds strings of up to
+ * QSMALL_INLINE_MAX bytes inside the struct itself, and only longer strings in
+ * a heap buffer, so that short strings such as field values cost no
+ * allocation and no pointer chase, and an array of them is contiguous.
+ *
+ * A qsmall is the same size as three pointers. Because an inline string lives
+ * inside the struct, its data must always be reached through a pointer to the
+ * qsmall with qsmall_data, and it moves when the qsmall is copied. This is why
+ * the optimization can't be applied to qstring itself, whose data field is
+ * public and which is passed around by value.
+ *
+ * Like a qstring, a qsmall is immutable and its data is always
+ * null-terminated. If allocation fails, the returned qsmall has a NULL data
+ * pointer and a length of 0.
+ *
+ *   qsmall status = qsmall_new("404");
+ *   size_t i = qstring_find(qsmall_view(&status), qliteral("0"));
+ *   qsmall_cleanup(&status);
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#ifndef QSMALL_H
+#define QSMALL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "qstring.h"
+
+/* The longest string that is stored inline. */
+#define QSMALL_INLINE_MAX (3 * sizeof(char*) - 2)
+
+typedef struct {
+    /* All fields are private. The last byte of `bytes` is the length of an
+       inline string, or a marker that the string is on the heap. */
+    union {
+        char bytes[3 * sizeof(char*)];
+        struct {
+            char* data;
+            size_t len;
+        } heap;
+    } u;
+} qsmall;
+
+/**
+ * Return a qsmall with a copy of the null-terminated string, the first `n`
+ * bytes of the buffer, or the contents of the qstring.
+ *
+ * The returned qsmall must eventually be passed to qsmall_cleanup, which only
+ * does anything if the string was too long to be stored inline.
+ */
+qsmall qsmall_new(const char*);
+qsmall qsmall_new_buffer(const char*, size_t n);
+qsmall qsmall_from_qstring(qstring);
+
+/**
+ * Free the qsmall's heap buffer, if it has one.
+ */
+void qsmall_cleanup(qsmall*);
+
+/**
+ * Return the length of the string, or its null-terminated data. The data
+ * pointer is only valid until the qsmall is moved, copied over or cleaned up.
+ */
+size_t qsmall_len(const qsmall*);
+const char* qsmall_data(const qsmall*);
+
+/**
+ * Return true if the string is stored inline.
+ */
+bool qsmall_is_inline(const qsmall*);
+
+/**
+ * Return a qstring that borrows the qsmall's data, so that it can be passed to
+ * the functions in qstring.h. It is valid for as long as qsmall_data's result
+ * would be, and must NOT be passed to qstring_cleanup.
+ */
+qstring qsmall_view(const qsmall*);
+
+/**
+ * Return true if the two strings have the same contents.
+ */
+bool qsmall_equals(const qsmall*, const qsmall*);
+
+#endif
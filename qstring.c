@@ -4,19 +4,43 @@
  * Version: July 2018
  */
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "qstring.h"
 
+/* Every function that allocates a qstring takes an optional arena, and
+ * allocates from the heap if it is NULL. The plain functions pass NULL and the
+ * _a variants pass their arena argument along.
+ */
+static char* alloc_data(qarena* arena, size_t n) {
+    return (arena == NULL) ? malloc(n) : qarena_alloc(arena, n);
+}
+
+static void free_data(qarena* arena, char* data) {
+    /* Memory from an arena is freed along with the arena. */
+    if (arena == NULL) {
+        free(data);
+    }
+}
+
 qstring qstring_new(const char* cs) {
-    return qstring_new_buffer(cs, strlen(cs));
+    return qstring_new_buffer_a(NULL, cs, strlen(cs));
+}
+
+qstring qstring_new_a(qarena* arena, const char* cs) {
+    return qstring_new_buffer_a(arena, cs, strlen(cs));
 }
 
 qstring qstring_new_buffer(const char* buffer, size_t n) {
+    return qstring_new_buffer_a(NULL, buffer, n);
+}
+
+qstring qstring_new_buffer_a(qarena* arena, const char* buffer, size_t n) {
     qstring ret = {.len = 0, .data = NULL};
-    ret.data = malloc(n + 1);
+    ret.data = alloc_data(arena, n + 1);
     if (ret.data == NULL) {
         return ret;
     }
@@ -54,100 +78,974 @@ void qstring_cleanup(qstring qs) {
 }
 
 qstring qstring_copy(qstring qs) {
-    return qstring_new_buffer(qs.data, qs.len);
+    return qstring_new_buffer_a(NULL, qs.data, qs.len);
+}
+
+qstring qstring_copy_a(qarena* arena, qstring qs) {
+    return qstring_new_buffer_a(arena, qs.data, qs.len);
 }
 
 qstring qstring_substr(qstring qs, size_t start, size_t n) {
+    return qstring_substr_a(NULL, qs, start, n);
+}
+
+qstring qstring_substr_a(qarena* arena, qstring qs, size_t start, size_t n) {
     if (start >= qs.len) {
-        return qstring_new("");
+        return qstring_new_buffer_a(arena, "", 0);
     }
     if (start + n >= qs.len) {
         n = qs.len - start;
     }
-    return qstring_new_buffer(qs.data + start, n);
+    return qstring_new_buffer_a(arena, qs.data + start, n);
 }
 
 qstring qstring_remove(qstring qs, size_t start, size_t n) {
+    return qstring_remove_a(NULL, qs, start, n);
+}
+
+qstring qstring_remove_a(qarena* arena, qstring qs, size_t start, size_t n) {
     if (start >= qs.len) {
-        return qstring_copy(qs);
+        return qstring_copy_a(arena, qs);
     }
     if (start + n >= qs.len) {
         n = qs.len - start;
     }
     qstring ret = {.len = 0, .data = NULL};
-    ret.data = malloc(qs.len - n + 1);
+    ret.data = alloc_data(arena, qs.len - n + 1);
     if (ret.data == NULL) {
         return ret;
     }
     /* Copy the data before the removed substring. */
     memcpy(ret.data, qs.data, start);
-    /* Copy the data after the removed substring, including the null terminator.
+    /* Copy the data after the removed substring. The terminator is written
+     * separately, since `qs` may be a view that isn't null-terminated.
      */
-    memcpy(ret.data + start, qs.data + start + n, qs.len - n - start + 1);
+    memcpy(ret.data + start, qs.data + start + n, qs.len - n - start);
     ret.len = qs.len - n;
+    ret.data[ret.len] = '\0';
     return ret;
 }
 
 qstring qstring_concat(qstring qs1, qstring qs2) {
+    return qstring_concat_a(NULL, qs1, qs2);
+}
+
+qstring qstring_concat_a(qarena* arena, qstring qs1, qstring qs2) {
     qstring ret = {.len = 0, .data = NULL};
-    ret.data = malloc(qs1.len + qs2.len + 1);
+    ret.data = alloc_data(arena, qs1.len + qs2.len + 1);
     if (ret.data == NULL) {
         return ret;
     }
     memcpy(ret.data, qs1.data, qs1.len);
-    memcpy(ret.data + qs1.len, qs2.data, qs2.len + 1);
+    memcpy(ret.data + qs1.len, qs2.data, qs2.len);
     ret.len = qs1.len + qs2.len;
+    ret.data[ret.len] = '\0';
     return ret;
 }
 
-qstring qstring_format(qstring fmtstr, ...) {
-    va_list args;
-    va_start(args, fmtstr);
+static qstring vformat(qarena* arena, qstring fmtstr, va_list args) {
     va_list args2;
     va_copy(args2, args);
 
     qstring ret = {.len = 0, .data = NULL};
     int sz = vsnprintf(NULL, 0, fmtstr.data, args);
-    va_end(args);
     if (sz == -1) {
+        va_end(args2);
         return ret;
     }
-    ret.data = malloc(sz + 1);
+    ret.data = alloc_data(arena, sz + 1);
     if (ret.data == NULL) {
+        va_end(args2);
         return ret;
     }
 
     sz = vsnprintf(ret.data, sz+1, fmtstr.data, args2);
     va_end(args2);
     if (sz == -1) {
-        free(ret.data);
+        free_data(arena, ret.data);
+        ret.data = NULL;
         return ret;
     }
     ret.len = sz;
     return ret;
 }
 
-qstring qstring_replace_all(qstring qs, qstring before, qstring after) {
-    size_t count = qstring_count(qs, before);
-    if (count == 0) {
-        return qstring_copy(qs);
+qstring qstring_format(qstring fmtstr, ...) {
+    va_list args;
+    va_start(args, fmtstr);
+    qstring ret = vformat(NULL, fmtstr, args);
+    va_end(args);
+    return ret;
+}
+
+qstring qstring_format_a(qarena* arena, qstring fmtstr, ...) {
+    va_list args;
+    va_start(args, fmtstr);
+    qstring ret = vformat(arena, fmtstr, args);
+    va_end(args);
+    return ret;
+}
+
+/* The substring search engine. The search functions return the offset of the
+ * first (or last) occurrence of the needle in the haystack, or NOT_FOUND. Both
+ * buffers are given with explicit lengths and need not be null-terminated.
+ *
+ * Short needles are found by using memchr to skip to each occurrence of the
+ * needle's first byte and then verifying the rest with memcmp. memchr is
+ * heavily optimized by the C library, so this is fast as long as the first
+ * byte is not too common. Longer needles use Boyer-Moore-Horspool, which
+ * skips up to the length of the needle on every mismatch and so runs in
+ * sublinear time on typical inputs.
+ */
+#define NOT_FOUND ((size_t)-1)
+
+/* Needles at least this long are searched for with Horspool instead of memchr.
+ * Below this the shift table can't skip far enough to pay for building it.
+ */
+#define HORSPOOL_THRESHOLD 8
+
+/* Fill in the Horspool shift table for the needle. shift[c] is how far the
+ * window can safely advance when the byte under the last position of the
+ * needle is `c`. Shifts are capped at UCHAR_MAX so that the table fits in 256
+ * bytes; a smaller shift than the maximum possible is always safe.
+ */
+static void horspool_table(unsigned char shift[256], const char* needle,
+    size_t m) {
+    size_t cap = (m < UCHAR_MAX) ? m : UCHAR_MAX;
+    memset(shift, (int)cap, 256);
+    for (size_t i = m - cap; i < m - 1; i++) {
+        shift[(unsigned char)needle[i]] = (unsigned char)(m - 1 - i);
+    }
+}
+
+/* The mirror image of horspool_table, for searching from the end of the
+ * haystack. rshift[c] is how far the window can move back when the byte under
+ * the first position of the needle is `c`.
+ */
+static void horspool_rtable(unsigned char rshift[256], const char* needle,
+    size_t m) {
+    size_t cap = (m < UCHAR_MAX) ? m : UCHAR_MAX;
+    memset(rshift, (int)cap, 256);
+    for (size_t i = cap - 1; i >= 1; i--) {
+        rshift[(unsigned char)needle[i]] = (unsigned char)i;
+    }
+}
+
+static size_t search_horspool(const char* hay, size_t n, const char* needle,
+    size_t m, const unsigned char shift[256]) {
+    size_t last = m - 1;
+    unsigned char lastc = needle[last];
+    size_t i = 0;
+    while (i <= n - m) {
+        unsigned char c = hay[i + last];
+        if (c == lastc && memcmp(hay + i, needle, last) == 0) {
+            return i;
+        }
+        i += shift[c];
+    }
+    return NOT_FOUND;
+}
+
+static size_t rsearch_horspool(const char* hay, size_t n, const char* needle,
+    size_t m, const unsigned char rshift[256]) {
+    unsigned char firstc = needle[0];
+    size_t i = n - m;
+    while (true) {
+        unsigned char c = hay[i];
+        if (c == firstc && memcmp(hay + i + 1, needle + 1, m - 1) == 0) {
+            return i;
+        }
+        if (i < rshift[c]) {
+            return NOT_FOUND;
+        }
+        i -= rshift[c];
+    }
+}
+
+static size_t search_memchr(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    const char* p = hay;
+    /* The last position at which a match could start. */
+    const char* end = hay + (n - m);
+    while (p <= end) {
+        p = memchr(p, needle[0], (end - p) + 1);
+        if (p == NULL) {
+            return NOT_FOUND;
+        }
+        if (memcmp(p + 1, needle + 1, m - 1) == 0) {
+            return p - hay;
+        }
+        p++;
+    }
+    return NOT_FOUND;
+}
+
+/* memrchr is a GNU extension, so short needles are searched for backwards with
+ * a plain loop.
+ */
+static size_t rsearch_naive(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    for (size_t i = n - m + 1; i-- > 0;) {
+        if (hay[i] == needle[0] &&
+                memcmp(hay + i + 1, needle + 1, m - 1) == 0) {
+            return i;
+        }
+    }
+    return NOT_FOUND;
+}
+
+/* Vectorized kernels. On x86 the search compares a block of 16 (SSE2) or 32
+ * (AVX2) haystack positions against the first and last bytes of the needle at
+ * once, and only verifies the middle of the needle with memcmp at positions
+ * where both ends match. This filters out almost all candidates that the
+ * memchr search would have to check one by one when the needle's first byte
+ * is common.
+ *
+ * SSE2 is part of the x86-64 baseline, so it needs no check. AVX2 is detected
+ * at runtime, so the library still runs on older CPUs. Other architectures use
+ * the scalar code above, as does any build with QSTRING_NO_SIMD defined.
+ */
+#if !defined(QSTRING_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define QSTRING_SIMD 1
+#include <immintrin.h>
+
+static bool have_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+/* Return the offset of the first match in `hay` that starts at or after `i`,
+ * where the caller has already checked every start position before `i`. The
+ * kernels can stop with fewer than `m` bytes left, which search_memchr
+ * doesn't allow for.
+ */
+static size_t search_tail(const char* hay, size_t n, const char* needle,
+    size_t m, size_t i) {
+    if (n - i < m) {
+        return NOT_FOUND;
+    }
+    size_t found = search_memchr(hay + i, n - i, needle, m);
+    return (found == NOT_FOUND) ? NOT_FOUND : i + found;
+}
+
+/* Check the candidate positions in `mask`, relative to `hay + i`, and return
+ * the first one at which the whole needle matches.
+ */
+static size_t verify_mask(const char* hay, size_t i, unsigned int mask,
+    const char* needle, size_t m) {
+    while (mask != 0) {
+        unsigned int bit = __builtin_ctz(mask);
+        if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) {
+            return i + bit;
+        }
+        mask &= mask - 1;
+    }
+    return NOT_FOUND;
+}
+
+/* Both kernels require 2 <= m <= n. */
+static size_t search_sse2(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(bf, first),
+            _mm_cmpeq_epi8(bl, last));
+        unsigned int mask = _mm_movemask_epi8(eq);
+        if (mask != 0) {
+            size_t found = verify_mask(hay, i, mask, needle, m);
+            if (found != NOT_FOUND) {
+                return found;
+            }
+        }
+    }
+    return search_tail(hay, n, needle, m, i);
+}
+
+__attribute__((target("avx2")))
+static size_t search_avx2(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+            _mm256_cmpeq_epi8(bl, last));
+        unsigned int mask = _mm256_movemask_epi8(eq);
+        if (mask != 0) {
+            size_t found = verify_mask(hay, i, mask, needle, m);
+            if (found != NOT_FOUND) {
+                return found;
+            }
+        }
+    }
+    return search_tail(hay, n, needle, m, i);
+}
+
+static size_t count_byte_sse2(const char* data, size_t n, char c) {
+    const __m128i target = _mm_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, target));
+        count += __builtin_popcount(mask);
+    }
+    for (; i < n; i++) {
+        count += (data[i] == c);
+    }
+    return count;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_byte_avx2(const char* data, size_t n, char c) {
+    const __m256i target = _mm256_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+        unsigned int mask =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, target));
+        count += __builtin_popcount(mask);
+    }
+    for (; i < n; i++) {
+        count += (data[i] == c);
+    }
+    return count;
+}
+
+/* Search for a needle of at least two bytes with the best available kernel.
+ */
+static size_t search_vector(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    if (have_avx2()) {
+        return search_avx2(hay, n, needle, m);
+    }
+    return search_sse2(hay, n, needle, m);
+}
+
+static unsigned int byte_mask_sse2(const char* data, char c) {
+    __m128i block = _mm_loadu_si128((const __m128i*)data);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+__attribute__((target("avx2")))
+static unsigned int byte_mask_avx2(const char* data, char c) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)data);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)));
+}
+#endif
+
+/* Set bit i of `mask` if data[i] == c, for as many bytes as the best available
+ * kernel handles at once, and return how many that was. Returns 0 if there are
+ * fewer than that many bytes left, or if there is no vector kernel.
+ */
+static size_t byte_mask(const char* data, size_t n, char c,
+    unsigned int* mask) {
+#ifdef QSTRING_SIMD
+    if (n >= 32 && have_avx2()) {
+        *mask = byte_mask_avx2(data, c);
+        return 32;
+    }
+    if (n >= 16) {
+        *mask = byte_mask_sse2(data, c);
+        return 16;
+    }
+#endif
+    (void)data;
+    (void)n;
+    (void)c;
+    (void)mask;
+    return 0;
+}
+
+/* Count the occurrences of a single byte. */
+static size_t count_byte(const char* data, size_t n, char c) {
+#ifdef QSTRING_SIMD
+    if (have_avx2()) {
+        return count_byte_avx2(data, n, c);
+    }
+    return count_byte_sse2(data, n, c);
+#else
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += (data[i] == c);
+    }
+    return count;
+#endif
+}
+
+/* Needles at least this long whose first and last bytes are equal are
+ * searched for with Horspool even when the vector kernels are available. The
+ * kernels only filter on the two end bytes, so they lose their advantage when
+ * those are the same byte, while Horspool's skips grow with the needle.
+ */
+#define VECTOR_SAME_ENDS_MAX 32
+
+/* Return true if a forward search for the needle, which must be at least two
+ * bytes long, should use the vector kernels rather than memchr or Horspool.
+ */
+static bool use_vector(const char* needle, size_t m) {
+#ifdef QSTRING_SIMD
+    return m < VECTOR_SAME_ENDS_MAX || needle[0] != needle[m - 1];
+#else
+    (void)needle;
+    (void)m;
+    return false;
+#endif
+}
+
+static size_t search_forward(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    if (m == 0) {
+        return 0;
+    }
+    if (m > n) {
+        return NOT_FOUND;
+    }
+#ifdef QSTRING_SIMD
+    if (m > 1 && use_vector(needle, m)) {
+        return search_vector(hay, n, needle, m);
+    }
+#endif
+    if (m < HORSPOOL_THRESHOLD) {
+        return search_memchr(hay, n, needle, m);
+    }
+    unsigned char shift[256];
+    horspool_table(shift, needle, m);
+    return search_horspool(hay, n, needle, m, shift);
+}
+
+static size_t search_backward(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    if (m == 0) {
+        return n;
+    }
+    if (m > n) {
+        return NOT_FOUND;
+    }
+    if (m < HORSPOOL_THRESHOLD) {
+        return rsearch_naive(hay, n, needle, m);
+    }
+    unsigned char rshift[256];
+    horspool_rtable(rshift, needle, m);
+    return rsearch_horspool(hay, n, needle, m, rshift);
+}
+
+/* Initialize a pattern that borrows the needle's data instead of copying it.
+ * This is how the functions that don't take a qpattern share code with the
+ * ones that do. Only the tables that forward searches, and backward searches
+ * if `backward` is true, will use are built.
+ */
+static void pattern_init(qpattern* p, qstring needle, bool backward) {
+    size_t m = needle.len;
+    p->needle = needle;
+    p->vector = m > 1 && use_vector(needle.data, m);
+    p->skip = !p->vector && m >= HORSPOOL_THRESHOLD;
+    p->rskip = backward && m >= HORSPOOL_THRESHOLD;
+    if (p->skip) {
+        horspool_table(p->shift, needle.data, m);
+    }
+    if (p->rskip) {
+        horspool_rtable(p->rshift, needle.data, m);
+    }
+}
+
+static size_t pattern_search(const qpattern* p, const char* hay, size_t n) {
+    size_t m = p->needle.len;
+    if (m == 0) {
+        return 0;
+    }
+    if (m > n) {
+        return NOT_FOUND;
+    }
+#ifdef QSTRING_SIMD
+    if (p->vector) {
+        return search_vector(hay, n, p->needle.data, m);
+    }
+#endif
+    if (!p->skip) {
+        return search_memchr(hay, n, p->needle.data, m);
+    }
+    return search_horspool(hay, n, p->needle.data, m, p->shift);
+}
+
+static size_t pattern_rsearch(const qpattern* p, const char* hay, size_t n) {
+    size_t m = p->needle.len;
+    if (m == 0) {
+        return n;
+    }
+    if (m > n) {
+        return NOT_FOUND;
+    }
+    if (!p->rskip) {
+        return rsearch_naive(hay, n, p->needle.data, m);
+    }
+    return rsearch_horspool(hay, n, p->needle.data, m, p->rshift);
+}
+
+qpattern qpattern_compile(qstring needle) {
+    qpattern ret;
+    qstring copy = qstring_copy(needle);
+    if (copy.data == NULL) {
+        ret.needle = copy;
+        ret.vector = ret.skip = ret.rskip = false;
+        return ret;
+    }
+    pattern_init(&ret, copy, true);
+    return ret;
+}
+
+void qpattern_cleanup(qpattern* p) {
+    qstring_cleanup(p->needle);
+    p->needle.len = 0;
+    p->needle.data = NULL;
+}
+
+qmatcher qmatcher_compile(const qstring* patterns, size_t n) {
+    qmatcher ret;
+    memset(&ret, 0, sizeof ret);
+    ret.npatterns = n;
+
+    /* Give each byte that occurs in a needle its own class, and lump all the
+     * other bytes into one class after them.
+     */
+    bool used[256] = {false};
+    size_t maxstates = 1;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < patterns[i].len; j++) {
+            used[(unsigned char)patterns[i].data[j]] = true;
+        }
+        maxstates += patterns[i].len;
+    }
+    size_t nused = 0;
+    for (size_t c = 0; c < 256; c++) {
+        if (used[c]) {
+            ret.classes[c] = nused++;
+        }
+    }
+    for (size_t c = 0; c < 256; c++) {
+        if (!used[c]) {
+            ret.classes[c] = nused;
+        }
+    }
+    ret.nclasses = (nused < 256) ? nused + 1 : 256;
+    size_t nc = ret.nclasses;
+
+    ret.table = calloc(maxstates * nc, sizeof *ret.table);
+    ret.out = calloc(maxstates, sizeof *ret.out);
+    ret.dict = calloc(maxstates, sizeof *ret.dict);
+    ret.lens = malloc(n * sizeof *ret.lens + 1);
+    uint32_t* fail = malloc(maxstates * sizeof *fail);
+    uint32_t* queue = malloc(maxstates * sizeof *queue);
+    if (ret.table == NULL || ret.out == NULL || ret.dict == NULL ||
+            ret.lens == NULL || fail == NULL || queue == NULL) {
+        free(fail);
+        free(queue);
+        qmatcher_cleanup(&ret);
+        return ret;
+    }
+
+    /* Build the trie. Nothing can transition back to the root, so 0 means that
+     * there's no edge.
+     */
+    ret.nstates = 1;
+    for (size_t i = 0; i < n; i++) {
+        ret.lens[i] = patterns[i].len;
+        if (patterns[i].len > ret.maxlen) {
+            ret.maxlen = patterns[i].len;
+        }
+        if (patterns[i].len == 0) {
+            continue;
+        }
+        uint32_t s = 0;
+        for (size_t j = 0; j < patterns[i].len; j++) {
+            size_t c = ret.classes[(unsigned char)patterns[i].data[j]];
+            if (ret.table[s * nc + c] == 0) {
+                ret.table[s * nc + c] = ret.nstates++;
+            }
+            s = ret.table[s * nc + c];
+        }
+        if (ret.out[s] == 0) {
+            ret.out[s] = i + 1;
+        }
+    }
+
+    /* Compute failure links breadth-first and fill in the missing edges with
+     * the transitions of the failure state, turning the trie into a DFA. A
+     * state's row still holds only its trie edges when it's dequeued, since
+     * rows are filled in in BFS order.
+     */
+    size_t head = 0;
+    size_t tail = 0;
+    for (size_t c = 0; c < nc; c++) {
+        uint32_t t = ret.table[c];
+        if (t != 0) {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        for (size_t c = 0; c < nc; c++) {
+            uint32_t t = ret.table[s * nc + c];
+            uint32_t f = ret.table[fail[s] * nc + c];
+            if (t != 0) {
+                fail[t] = f;
+                ret.dict[t] = (ret.out[f] != 0) ? f : ret.dict[f];
+                queue[tail++] = t;
+            } else {
+                ret.table[s * nc + c] = f;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+
+    /* Give back the rows reserved for states that weren't needed. */
+    uint32_t* table = realloc(ret.table, ret.nstates * nc * sizeof *table);
+    if (table != NULL) {
+        ret.table = table;
+    }
+    return ret;
+}
+
+void qmatcher_cleanup(qmatcher* m) {
+    free(m->table);
+    free(m->out);
+    free(m->dict);
+    free(m->lens);
+    memset(m, 0, sizeof *m);
+}
+
+/* Return the state with output that should be reported after reading a byte
+ * and moving to state `s`, or 0 if there's no match ending here.
+ */
+static uint32_t matcher_output(const qmatcher* m, uint32_t s) {
+    return (m->out[s] != 0) ? s : m->dict[s];
+}
+
+size_t qstring_find_any(qstring qs, const qmatcher* m, size_t* pattern) {
+    /* The automaton reports matches in order of where they end, so the first
+     * one reported may yet be beaten by a match that ends later but starts
+     * earlier, or starts at the same index and is longer. Any such match ends
+     * within a longest needle's length of the best match's start, so the
+     * search stops once it is past that point.
+     */
+    qmatch best = {.index = qs.len, .len = 0, .pattern = 0};
+    bool found = false;
+    qmatcher_iter it = qmatcher_iter_new(m, qs);
+    qmatch match;
+    while (qmatcher_next(&it, &match)) {
+        if (found && it.pos > best.index + m->maxlen) {
+            break;
+        }
+        if (!found || match.index < best.index ||
+                (match.index == best.index && match.len > best.len)) {
+            best = match;
+            found = true;
+        }
+    }
+    if (found && pattern != NULL) {
+        *pattern = best.pattern;
+    }
+    return best.index;
+}
+
+size_t qstring_count_any(qstring qs, const qmatcher* m, size_t* counts) {
+    memset(counts, 0, m->npatterns * sizeof *counts);
+    if (m->nstates == 0) {
+        return 0;
+    }
+    size_t total = 0;
+    uint32_t s = 0;
+    for (size_t i = 0; i < qs.len; i++) {
+        s = m->table[s * m->nclasses + m->classes[(unsigned char)qs.data[i]]];
+        for (uint32_t o = matcher_output(m, s); o != 0; o = m->dict[o]) {
+            counts[m->out[o] - 1]++;
+            total++;
+        }
+    }
+    return total;
+}
+
+qmatcher_iter qmatcher_iter_new(const qmatcher* m, qstring qs) {
+    qmatcher_iter ret = {.matcher = m, .qs = qs, .pos = 0, .state = 0,
+        .pending = 0};
+    return ret;
+}
+
+bool qmatcher_next(qmatcher_iter* it, qmatch* match) {
+    const qmatcher* m = it->matcher;
+    if (m->nstates == 0) {
+        return false;
+    }
+    while (it->pending == 0) {
+        if (it->pos >= it->qs.len) {
+            return false;
+        }
+        unsigned char c = it->qs.data[it->pos++];
+        it->state = m->table[it->state * m->nclasses + m->classes[c]];
+        it->pending = matcher_output(m, it->state);
+    }
+    uint32_t o = it->pending;
+    match->pattern = m->out[o] - 1;
+    match->len = m->lens[match->pattern];
+    match->index = it->pos - match->len;
+    it->pending = m->dict[o];
+    return true;
+}
+
+/* A growable list of matches. The first few are stored in the struct itself,
+ * so that finding a handful of matches doesn't need an allocation of its own.
+ */
+#define MATCHLIST_INLINE 32
+
+typedef struct {
+    qmatch* items;
+    size_t len;
+    size_t cap;
+    qmatch inline_items[MATCHLIST_INLINE];
+} matchlist;
+
+static void matchlist_init(matchlist* ml) {
+    ml->items = ml->inline_items;
+    ml->len = 0;
+    ml->cap = MATCHLIST_INLINE;
+}
+
+static void matchlist_cleanup(matchlist* ml) {
+    if (ml->items != ml->inline_items) {
+        free(ml->items);
     }
-    size_t newlen = qs.len + count * (after.len - before.len);
+}
+
+static bool matchlist_push(matchlist* ml, size_t index, size_t len,
+    size_t pattern) {
+    if (ml->len == ml->cap) {
+        size_t newcap = ml->cap * 2;
+        qmatch* items;
+        if (ml->items == ml->inline_items) {
+            items = malloc(newcap * sizeof *items);
+            if (items != NULL) {
+                memcpy(items, ml->items, ml->len * sizeof *items);
+            }
+        } else {
+            items = realloc(ml->items, newcap * sizeof *items);
+        }
+        if (items == NULL) {
+            return false;
+        }
+        ml->items = items;
+        ml->cap = newcap;
+    }
+    qmatch m = {.index = index, .len = len, .pattern = pattern};
+    ml->items[ml->len++] = m;
+    return true;
+}
+
+/* Return a copy of `qs` with each match in `ml` replaced by
+ * `afters[match.pattern]`. The matches must be in order and must not overlap.
+ * The result is sized exactly, so it takes a single allocation.
+ */
+static qstring splice_matches(qarena* arena, qstring qs, const matchlist* ml,
+    const qstring* afters) {
+    size_t removed = 0;
+    size_t added = 0;
+    for (size_t i = 0; i < ml->len; i++) {
+        removed += ml->items[i].len;
+        added += afters[ml->items[i].pattern].len;
+    }
+    size_t newlen = qs.len - removed + added;
     qstring ret = {.len = 0, .data = NULL};
-    ret.data = malloc(newlen + 1);
+    ret.data = alloc_data(arena, newlen + 1);
     if (ret.data == NULL) {
         return ret;
     }
-    //size_t index = 0;
-    // TODO: Finish this with qstring_find_in
+
+    char* out = ret.data;
+    size_t prev = 0;
+    for (size_t i = 0; i < ml->len; i++) {
+        const qmatch* m = &ml->items[i];
+        qstring after = afters[m->pattern];
+        memcpy(out, qs.data + prev, m->index - prev);
+        out += m->index - prev;
+        memcpy(out, after.data, after.len);
+        out += after.len;
+        prev = m->index + m->len;
+    }
+    memcpy(out, qs.data + prev, qs.len - prev);
+    ret.len = newlen;
+    ret.data[ret.len] = '\0';
+    return ret;
+}
+
+static qstring replace_all(qarena* arena, qstring qs, const qpattern* p,
+    qstring after) {
+    qstring failed = {.len = 0, .data = NULL};
+    size_t m = p->needle.len;
+    matchlist ml;
+    matchlist_init(&ml);
+
+    /* Record where the matches are in a single pass. The empty string matches
+     * before every byte and at the end.
+     */
+    size_t i = 0;
+    while (i <= qs.len) {
+        size_t found = pattern_search(p, qs.data + i, qs.len - i);
+        if (found == NOT_FOUND) {
+            break;
+        }
+        if (!matchlist_push(&ml, i + found, m, 0)) {
+            matchlist_cleanup(&ml);
+            return failed;
+        }
+        i += found + ((m == 0) ? 1 : m);
+    }
+
+    qstring ret = (ml.len == 0) ? qstring_copy_a(arena, qs) :
+        splice_matches(arena, qs, &ml, &after);
+    matchlist_cleanup(&ml);
+    return ret;
+}
+
+qstring qstring_replace_all(qstring qs, qstring before, qstring after) {
+    return qstring_replace_all_a(NULL, qs, before, after);
+}
+
+qstring qstring_replace_all_a(qarena* arena, qstring qs, qstring before,
+    qstring after) {
+    qpattern p;
+    pattern_init(&p, before, false);
+    return replace_all(arena, qs, &p, after);
+}
+
+qstring qstring_replace_all_p(qstring qs, const qpattern* p, qstring after) {
+    return replace_all(NULL, qs, p, after);
+}
+
+/* Record the leftmost-longest non-overlapping matches of the matcher in `ml`,
+ * or return false if allocation fails.
+ *
+ * The automaton reports matches in order of where they end, so whether a
+ * match is chosen can't be decided until every match that starts at or
+ * before it has been seen, which is once the automaton is a needle's length
+ * past its start. Until then the longest match at each start is kept in
+ * `ring`, which has one entry for each of the `size` start positions that may
+ * still be undecided, where `size` is the length of the longest needle. So
+ * only the chosen matches are stored, however many overlapping ones there are.
+ */
+static bool collect_longest(const qmatcher* m, qstring qs, qmatch* ring,
+    size_t size, matchlist* ml) {
+    for (size_t i = 0; i < size; i++) {
+        ring[i].len = 0;
+    }
+    /* Every start before `decided` has been decided, and `held` entries of
+       the ring are in use. */
+    size_t decided = 0;
+    size_t held = 0;
+    size_t end = 0;
+    qmatcher_iter it = qmatcher_iter_new(m, qs);
+    qmatch match;
+    bool more;
+    do {
+        more = qmatcher_next(&it, &match);
+        /* No match still to come starts before `limit`. */
+        size_t limit = qs.len;
+        if (more) {
+            size_t e = match.index + match.len;
+            limit = (e > size) ? e - size : 0;
+        }
+        while (decided < limit) {
+            if (held == 0) {
+                decided = limit;
+                break;
+            }
+            qmatch* slot = &ring[decided % size];
+            if (slot->len != 0) {
+                if (decided >= end) {
+                    if (!matchlist_push(ml, slot->index, slot->len,
+                            slot->pattern)) {
+                        return false;
+                    }
+                    end = decided + slot->len;
+                }
+                slot->len = 0;
+                held--;
+            }
+            decided++;
+        }
+        if (more) {
+            qmatch* slot = &ring[match.index % size];
+            if (slot->len == 0) {
+                held++;
+            }
+            if (match.len > slot->len) {
+                *slot = match;
+            }
+        }
+    } while (more);
+    return true;
+}
+
+static qstring replace_any(qarena* arena, qstring qs, const qmatcher* m,
+    const qstring* afters) {
+    qstring ret = {.len = 0, .data = NULL};
+    size_t size = m->maxlen;
+    if (m->nstates == 0 || size == 0) {
+        return qstring_copy_a(arena, qs);
+    }
+
+    qmatch small[64];
+    qmatch* ring = (size <= 64) ? small : malloc(size * sizeof *ring);
+    if (ring == NULL) {
+        return ret;
+    }
+    matchlist ml;
+    matchlist_init(&ml);
+    if (collect_longest(m, qs, ring, size, &ml)) {
+        ret = (ml.len == 0) ? qstring_copy_a(arena, qs) :
+            splice_matches(arena, qs, &ml, afters);
+    }
+    matchlist_cleanup(&ml);
+    if (ring != small) {
+        free(ring);
+    }
+    return ret;
+}
+
+qstring qstring_replace_any(qstring qs, const qmatcher* m,
+    const qstring* afters) {
+    return replace_any(NULL, qs, m, afters);
+}
+
+qstring qstring_replace_many(qstring qs, const qstring* befores,
+    const qstring* afters, size_t n) {
+    return qstring_replace_many_a(NULL, qs, befores, afters, n);
+}
+
+qstring qstring_replace_many_a(qarena* arena, qstring qs,
+    const qstring* befores, const qstring* afters, size_t n) {
+    qmatcher m = qmatcher_compile(befores, n);
+    if (m.nstates == 0) {
+        qstring failed = {.len = 0, .data = NULL};
+        return failed;
+    }
+    qstring ret = replace_any(arena, qs, &m, afters);
+    qmatcher_cleanup(&m);
     return ret;
 }
 
-static qstring replace_substr(qstring qs, size_t start, size_t n,
-    qstring replacing) {
+static qstring replace_substr(qarena* arena, qstring qs, size_t start,
+    size_t n, qstring replacing) {
     size_t newlen = qs.len - n + replacing.len;
     qstring ret = {.len = 0, .data = NULL};
-    ret.data = malloc(newlen + 1);
+    ret.data = alloc_data(arena, newlen + 1);
     if (ret.data == NULL) {
         return ret;
     }
@@ -157,25 +1055,36 @@ static qstring replace_substr(qstring qs, size_t start, size_t n,
     memcpy(ret.data + start, replacing.data, replacing.len);
     /* Copy the original string after the replaced substring. */
     memcpy(ret.data + start + replacing.len, qs.data + start + n,
-        qs.len - (start - n + 1));
+        qs.len - (start + n));
     ret.len = newlen;
+    ret.data[ret.len] = '\0';
     return ret;
 }
 
 qstring qstring_replace_first(qstring qs, qstring before, qstring after) {
+    return qstring_replace_first_a(NULL, qs, before, after);
+}
+
+qstring qstring_replace_first_a(qarena* arena, qstring qs, qstring before,
+    qstring after) {
     size_t index = qstring_find(qs, before);
     if (index == qs.len) {
-        return qstring_copy(qs);
+        return qstring_copy_a(arena, qs);
     }
-    return replace_substr(qs, index, before.len, after);
+    return replace_substr(arena, qs, index, before.len, after);
 }
 
 qstring qstring_replace_last(qstring qs, qstring before, qstring after) {
+    return qstring_replace_last_a(NULL, qs, before, after);
+}
+
+qstring qstring_replace_last_a(qarena* arena, qstring qs, qstring before,
+    qstring after) {
     size_t index = qstring_rfind(qs, before);
     if (index == qs.len) {
-        return qstring_copy(qs);
+        return qstring_copy_a(arena, qs);
     }
-    return replace_substr(qs, index, before.len, after);
+    return replace_substr(arena, qs, index, before.len, after);
 }
 
 size_t qstring_find(qstring qs, qstring datum) {
@@ -186,22 +1095,18 @@ size_t qstring_find_in(qstring qs, qstring datum, size_t start, size_t n) {
     if (start >= qs.len) {
         return qs.len;
     }
-    if (start + n >= qs.len) {
+    if (n > qs.len - start) {
         n = qs.len - start;
     }
-    /* This check is not just an optimization: it's necessary to prevent memcmp
-     * from examining invalid memory.
+    /* This check is not just an optimization: the search engine assumes that
+     * the needle fits inside the haystack.
      */
     if (datum.len > n) {
         return qs.len;
     }
 
-    for (size_t i = start; i < start + n; i++) {
-        if (memcmp(qs.data + i, datum.data, datum.len) == 0) {
-            return i;
-        }
-    }
-    return qs.len;
+    size_t i = search_forward(qs.data + start, n, datum.data, datum.len);
+    return (i == NOT_FOUND) ? qs.len : start + i;
 }
 
 size_t qstring_rfind(qstring qs, qstring datum) {
@@ -212,37 +1117,51 @@ size_t qstring_rfind_in(qstring qs, qstring datum, size_t start, size_t n) {
     if (start >= qs.len) {
         return qs.len;
     }
-    if (start + n >= qs.len) {
+    if (n > qs.len - start) {
         n = qs.len - start;
     }
-    /* This check is not just an optimization: it's necessary to prevent memcmp
-     * from examining invalid memory.
-     */
     if (datum.len > n) {
         return qs.len;
     }
 
-    for (size_t i = start; i < start + n; i++) {
-        size_t ri = (start + n) - (i + 1);
-        if (memcmp(qs.data + ri, datum.data, datum.len) == 0) {
-            return ri;
-        }
-    }
-    return qs.len;
+    size_t i = search_backward(qs.data + start, n, datum.data, datum.len);
+    return (i == NOT_FOUND) ? qs.len : start + i;
+}
+
+size_t qstring_find_p(qstring qs, const qpattern* p) {
+    size_t i = pattern_search(p, qs.data, qs.len);
+    return (i == NOT_FOUND) ? qs.len : i;
+}
+
+size_t qstring_rfind_p(qstring qs, const qpattern* p) {
+    size_t i = pattern_rsearch(p, qs.data, qs.len);
+    return (i == NOT_FOUND) ? qs.len : i;
 }
 
 size_t qstring_count(qstring qs, qstring datum) {
-    /* Make sure to test weird cases like count("aaa", "aa") == 1 */
-    if (datum.len > qs.len) {
-        return 0;
+    qpattern p;
+    pattern_init(&p, datum, false);
+    return qstring_count_p(qs, &p);
+}
+
+size_t qstring_count_p(qstring qs, const qpattern* p) {
+    size_t m = p->needle.len;
+    if (m == 0) {
+        return qs.len + 1;
+    }
+    if (m == 1) {
+        return count_byte(qs.data, qs.len, p->needle.data[0]);
     }
 
     size_t count = 0;
-    for (size_t i = 0; i < qs.len; i++) {
-        if (memcmp(qs.data + i, datum.data, datum.len) == 0) {
-            count++;
-            i += datum.len;
+    size_t i = 0;
+    while (i < qs.len) {
+        size_t found = pattern_search(p, qs.data + i, qs.len - i);
+        if (found == NOT_FOUND) {
+            break;
         }
+        count++;
+        i += found + m;
     }
     return count;
 }
@@ -257,32 +1176,449 @@ bool qstring_endswith(qstring qs, qstring suffix) {
         memcmp(qs.data + (qs.len - suffix.len), suffix.data, suffix.len) == 0;
 }
 
-qstring qstring_lstrip(qstring qs, qstring to_strip) {
-    size_t nprefix = 0;
-    while (memchr(to_strip.data, qs.data[nprefix], to_strip.len) != NULL) {
-        nprefix++;
+/* Case-insensitive comparison folds A to Z to lowercase. The vector version
+ * moves 'A' to the bottom of the signed byte range, so that the uppercase
+ * letters are the bytes that compare less than -128 + 26.
+ */
+static unsigned char fold_ascii(unsigned char c) {
+    return (c - 'A' < 26u) ? c + ('a' - 'A') : c;
+}
+
+#ifdef QSTRING_SIMD
+static __m128i fold_sse2(__m128i v) {
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static __m256i fold_avx2(__m256i v) {
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 26)),
+        shifted);
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+#endif
+
+static bool equals_ci(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+#ifdef QSTRING_SIMD
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = fold_sse2(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m128i vb = fold_sse2(_mm_loadu_si128((const __m128i*)(b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (fold_ascii(a[i]) != fold_ascii(b[i])) {
+            return false;
+        }
     }
-    return qstring_substr(qs, nprefix, qs.len - nprefix);
+    return true;
 }
 
-qstring qstring_rstrip(qstring qs, qstring to_strip) {
-    size_t nsuffix = 0;
-    while (memchr(to_strip.data, qs.data[qs.len - (nsuffix + 1)], to_strip.len)
-            != NULL) {
-        nsuffix++;
+/* Search for the needle from position `i` on, one position at a time. */
+static size_t search_ci_scalar(const char* hay, size_t n, const char* needle,
+    size_t m, size_t i) {
+    unsigned char first = fold_ascii(needle[0]);
+    for (; i + m <= n; i++) {
+        if (fold_ascii(hay[i]) == first &&
+                equals_ci(hay + i + 1, needle + 1, m - 1)) {
+            return i;
+        }
+    }
+    return NOT_FOUND;
+}
+
+#ifdef QSTRING_SIMD
+/* Like verify_mask, but for the case-insensitive search. */
+static size_t verify_mask_ci(const char* hay, size_t i, unsigned int mask,
+    const char* needle, size_t m) {
+    while (mask != 0) {
+        unsigned int bit = __builtin_ctz(mask);
+        if (equals_ci(hay + i + bit, needle, m)) {
+            return i + bit;
+        }
+        mask &= mask - 1;
     }
-    return qstring_substr(qs, 0, qs.len - nsuffix);
+    return NOT_FOUND;
+}
+
+/* The same first-and-last-byte filter as search_sse2 and search_avx2, on
+ * folded bytes. Both require 1 <= m <= n.
+ */
+static size_t search_ci_sse2(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    const __m128i first = _mm_set1_epi8(fold_ascii(needle[0]));
+    const __m128i last = _mm_set1_epi8(fold_ascii(needle[m - 1]));
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i bf = fold_sse2(_mm_loadu_si128((const __m128i*)(hay + i)));
+        __m128i bl = fold_sse2(_mm_loadu_si128(
+            (const __m128i*)(hay + i + m - 1)));
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(bf, first),
+            _mm_cmpeq_epi8(bl, last));
+        unsigned int mask = _mm_movemask_epi8(eq);
+        if (mask != 0) {
+            size_t found = verify_mask_ci(hay, i, mask, needle, m);
+            if (found != NOT_FOUND) {
+                return found;
+            }
+        }
+    }
+    return search_ci_scalar(hay, n, needle, m, i);
+}
+
+__attribute__((target("avx2")))
+static size_t search_ci_avx2(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    const __m256i first = _mm256_set1_epi8(fold_ascii(needle[0]));
+    const __m256i last = _mm256_set1_epi8(fold_ascii(needle[m - 1]));
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i bf = fold_avx2(_mm256_loadu_si256((const __m256i*)(hay + i)));
+        __m256i bl = fold_avx2(_mm256_loadu_si256(
+            (const __m256i*)(hay + i + m - 1)));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+            _mm256_cmpeq_epi8(bl, last));
+        unsigned int mask = _mm256_movemask_epi8(eq);
+        if (mask != 0) {
+            size_t found = verify_mask_ci(hay, i, mask, needle, m);
+            if (found != NOT_FOUND) {
+                return found;
+            }
+        }
+    }
+    return search_ci_scalar(hay, n, needle, m, i);
+}
+#endif
+
+static size_t search_ci(const char* hay, size_t n, const char* needle,
+    size_t m) {
+    if (m == 0) {
+        return 0;
+    }
+    if (m > n) {
+        return NOT_FOUND;
+    }
+#ifdef QSTRING_SIMD
+    if (have_avx2()) {
+        return search_ci_avx2(hay, n, needle, m);
+    }
+    return search_ci_sse2(hay, n, needle, m);
+#else
+    return search_ci_scalar(hay, n, needle, m, 0);
+#endif
+}
+
+bool qstring_equals_ci(qstring a, qstring b) {
+    return a.len == b.len && equals_ci(a.data, b.data, a.len);
+}
+
+bool qstring_startswith_ci(qstring qs, qstring prefix) {
+    return qs.len >= prefix.len && equals_ci(qs.data, prefix.data, prefix.len);
+}
+
+bool qstring_endswith_ci(qstring qs, qstring suffix) {
+    return qs.len >= suffix.len &&
+        equals_ci(qs.data + (qs.len - suffix.len), suffix.data, suffix.len);
+}
+
+size_t qstring_find_ci(qstring qs, qstring datum) {
+    size_t found = search_ci(qs.data, qs.len, datum.data, datum.len);
+    return (found == NOT_FOUND) ? qs.len : found;
+}
+
+size_t qstring_count_ci(qstring qs, qstring datum) {
+    if (datum.len == 0) {
+        return qs.len + 1;
+    }
+    size_t count = 0;
+    size_t i = 0;
+    while (i < qs.len) {
+        size_t found = search_ci(qs.data + i, qs.len - i, datum.data,
+            datum.len);
+        if (found == NOT_FOUND) {
+            break;
+        }
+        count++;
+        i += found + datum.len;
+    }
+    return count;
+}
+
+/* A set of bytes stored as a 256-bit bitmap, so that testing membership is a
+ * single lookup instead of a memchr over the characters in the set.
+ */
+typedef struct {
+    unsigned char bits[32];
+} byteset;
+
+static void byteset_init(byteset* set, qstring chars) {
+    memset(set->bits, 0, sizeof set->bits);
+    for (size_t i = 0; i < chars.len; i++) {
+        unsigned char c = chars.data[i];
+        set->bits[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+static bool byteset_has(const byteset* set, unsigned char c) {
+    return (set->bits[c >> 3] >> (c & 7)) & 1;
+}
+
+/* Return the number of bytes at the start of `qs` that are in `set`. */
+static size_t span_left(qstring qs, const byteset* set) {
+    size_t i = 0;
+    while (i < qs.len && byteset_has(set, qs.data[i])) {
+        i++;
+    }
+    return i;
+}
+
+/* Return the number of bytes at the end of `qs` that are in `set`. */
+static size_t span_right(qstring qs, const byteset* set) {
+    size_t i = 0;
+    while (i < qs.len && byteset_has(set, qs.data[qs.len - (i + 1)])) {
+        i++;
+    }
+    return i;
+}
+
+qstring qstring_lstrip(qstring qs, qstring to_strip) {
+    return qrange_to_qstring(qrange_lstrip(qrange_new(qs), to_strip));
+}
+
+qstring qstring_rstrip(qstring qs, qstring to_strip) {
+    return qrange_to_qstring(qrange_rstrip(qrange_new(qs), to_strip));
 }
 
 qstring qstring_strip(qstring qs, qstring to_strip) {
-    size_t nsuffix = 0;
-    while (memchr(to_strip.data, qs.data[qs.len - (nsuffix + 1)], to_strip.len)
-            != NULL) {
-        nsuffix++;
+    return qrange_to_qstring(qrange_strip(qrange_new(qs), to_strip));
+}
+
+qrange qrange_new(qstring qs) {
+    qrange ret = {.len = qs.len, .data = qs.data};
+    return ret;
+}
+
+qrange qrange_new_buffer(const char* buffer, size_t n) {
+    qrange ret = {.len = n, .data = buffer};
+    return ret;
+}
+
+/* Most of the qrange functions are implemented by the qstring functions,
+ * which never rely on the null terminator when searching, so a range can be
+ * passed to them as if it were a qstring. The returned qstring must never be
+ * written to or freed.
+ */
+static qstring as_qstring(qrange r) {
+    qstring ret = {.len = r.len, .data = (char*)r.data};
+    return ret;
+}
+
+qstring qliteral_range(qrange r) {
+    return as_qstring(r);
+}
+
+qstring qrange_to_qstring(qrange r) {
+    return qstring_new_buffer_a(NULL, r.data, r.len);
+}
+
+qstring qrange_to_qstring_a(qarena* arena, qrange r) {
+    return qstring_new_buffer_a(arena, r.data, r.len);
+}
+
+bool qrange_equals(qrange r1, qrange r2) {
+    return r1.len == r2.len && memcmp(r1.data, r2.data, r1.len) == 0;
+}
+
+qrange qrange_substr(qrange r, size_t start, size_t n) {
+    if (start >= r.len) {
+        return qrange_new_buffer(r.data + r.len, 0);
+    }
+    if (n > r.len - start) {
+        n = r.len - start;
     }
-    size_t nprefix = 0;
-    while (memchr(to_strip.data, qs.data[nprefix], to_strip.len) != NULL) {
-        nprefix++;
+    return qrange_new_buffer(r.data + start, n);
+}
+
+qrange qrange_lstrip(qrange r, qstring to_strip) {
+    byteset set;
+    byteset_init(&set, to_strip);
+    size_t nprefix = span_left(as_qstring(r), &set);
+    return qrange_new_buffer(r.data + nprefix, r.len - nprefix);
+}
+
+qrange qrange_rstrip(qrange r, qstring to_strip) {
+    byteset set;
+    byteset_init(&set, to_strip);
+    size_t nsuffix = span_right(as_qstring(r), &set);
+    return qrange_new_buffer(r.data, r.len - nsuffix);
+}
+
+qrange qrange_strip(qrange r, qstring to_strip) {
+    byteset set;
+    byteset_init(&set, to_strip);
+    size_t nprefix = span_left(as_qstring(r), &set);
+    if (nprefix == r.len) {
+        return qrange_new_buffer(r.data + r.len, 0);
+    }
+    size_t nsuffix = span_right(as_qstring(r), &set);
+    return qrange_new_buffer(r.data + nprefix, r.len - nprefix - nsuffix);
+}
+
+size_t qrange_find(qrange r, qstring datum) {
+    return qstring_find(as_qstring(r), datum);
+}
+
+size_t qrange_rfind(qrange r, qstring datum) {
+    return qstring_rfind(as_qstring(r), datum);
+}
+
+size_t qrange_find_p(qrange r, const qpattern* p) {
+    return qstring_find_p(as_qstring(r), p);
+}
+
+size_t qrange_rfind_p(qrange r, const qpattern* p) {
+    return qstring_rfind_p(as_qstring(r), p);
+}
+
+size_t qrange_count(qrange r, qstring datum) {
+    return qstring_count(as_qstring(r), datum);
+}
+
+size_t qrange_count_p(qrange r, const qpattern* p) {
+    return qstring_count_p(as_qstring(r), p);
+}
+
+size_t qrange_find_any(qrange r, const qmatcher* m, size_t* pattern) {
+    return qstring_find_any(as_qstring(r), m, pattern);
+}
+
+bool qrange_startswith(qrange r, qstring prefix) {
+    return qstring_startswith(as_qstring(r), prefix);
+}
+
+bool qrange_endswith(qrange r, qstring suffix) {
+    return qstring_endswith(as_qstring(r), suffix);
+}
+
+qsplit qsplit_char(qrange r, char delim, size_t maxsplit) {
+    qsplit ret;
+    memset(&ret, 0, sizeof ret);
+    ret.r = r;
+    ret.maxsplit = maxsplit;
+    ret.mode = QSPLIT_CHAR;
+    ret.delim = delim;
+    return ret;
+}
+
+qsplit qsplit_str(qrange r, qstring delim, size_t maxsplit) {
+    qsplit ret;
+    memset(&ret, 0, sizeof ret);
+    ret.r = r;
+    ret.maxsplit = maxsplit;
+    ret.mode = QSPLIT_STR;
+    ret.delims = delim;
+    return ret;
+}
+
+qsplit qsplit_any(qrange r, qstring delims, size_t maxsplit) {
+    qsplit ret;
+    memset(&ret, 0, sizeof ret);
+    ret.r = r;
+    ret.maxsplit = maxsplit;
+    ret.mode = QSPLIT_ANY;
+    byteset set;
+    byteset_init(&set, delims);
+    memcpy(ret.set, set.bits, sizeof ret.set);
+    return ret;
+}
+
+/* Return the index of the next single-byte delimiter at or after it->scan, or
+ * NOT_FOUND. The delimiters in a whole block are found at once and kept in
+ * it->mask, so that short fields don't cost a memchr call each.
+ */
+static size_t next_delim_char(qsplit* it) {
+    while (it->mask == 0) {
+        size_t avail = it->r.len - it->scan;
+        size_t width = byte_mask(it->r.data + it->scan, avail, it->delim,
+            &it->mask);
+        if (width == 0) {
+            const char* p = memchr(it->r.data + it->scan, it->delim, avail);
+            if (p == NULL) {
+                it->scan = it->r.len;
+                return NOT_FOUND;
+            }
+            it->scan = (p - it->r.data) + 1;
+            return p - it->r.data;
+        }
+        it->base = it->scan;
+        it->scan += width;
+    }
+    size_t d = it->base + __builtin_ctz(it->mask);
+    it->mask &= it->mask - 1;
+    return d;
+}
+
+static bool in_set(const qsplit* it, unsigned char c) {
+    return (it->set[c >> 3] >> (c & 7)) & 1;
+}
+
+bool qsplit_next(qsplit* it, qrange* field) {
+    if (it->done) {
+        return false;
+    }
+    qrange r = it->r;
+
+    if (it->mode == QSPLIT_ANY) {
+        /* Runs of delimiters count as one, and there are no empty fields. */
+        while (it->pos < r.len && in_set(it, r.data[it->pos])) {
+            it->pos++;
+        }
+        if (it->pos == r.len) {
+            it->done = true;
+            return false;
+        }
+    }
+
+    size_t start = it->pos;
+    if (it->maxsplit != 0 && it->nsplits == it->maxsplit) {
+        *field = qrange_new_buffer(r.data + start, r.len - start);
+        it->done = true;
+        return true;
+    }
+
+    size_t end;
+    size_t skip = 1;
+    if (it->mode == QSPLIT_CHAR) {
+        end = next_delim_char(it);
+    } else if (it->mode == QSPLIT_STR) {
+        skip = it->delims.len;
+        end = (skip == 0) ? NOT_FOUND : search_forward(r.data + start,
+            r.len - start, it->delims.data, it->delims.len);
+        if (end != NOT_FOUND) {
+            end += start;
+        }
+    } else {
+        end = start;
+        while (end < r.len && !in_set(it, r.data[end])) {
+            end++;
+        }
+        if (end == r.len) {
+            end = NOT_FOUND;
+        }
+    }
+
+    if (end == NOT_FOUND) {
+        *field = qrange_new_buffer(r.data + start, r.len - start);
+        it->done = true;
+        return true;
     }
-    return qstring_substr(qs, nprefix, qs.len - nprefix - nsuffix);
+    *field = qrange_new_buffer(r.data + start, end - start);
+    it->pos = end + skip;
+    it->nsplits++;
+    return true;
 }
@@ -23,6 +23,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include "qarena.h"
 
 typedef struct {
     /* Both fields are considered public and read-only. */
@@ -35,7 +37,130 @@ typedef struct {
     /* TODO: unsigned char*? */
 } qstring;
 
-/* TODO: Add a qrange type? */
+/**
+ * A qrange is a view of a range of bytes that belong to some other object,
+ * usually a qstring. Creating a qrange never allocates or copies, so slicing,
+ * stripping and searching a string with the qrange functions costs nothing but
+ * the search itself. For example, to look at the second field of a line
+ * without allocating:
+ *
+ *   qrange field = qrange_substr(qrange_new(line), 5, 3);
+ *   if (qrange_startswith(field, qliteral("GET"))) ...
+ *
+ * A qrange is only valid as long as the object it views. Its data field is not
+ * null-terminated, so it must not be passed to standard C string functions.
+ * Use qrange_to_qstring to turn it into a qstring of its own.
+ */
+typedef struct {
+    /* Both fields are considered public and read-only. */
+
+    /* The number of bytes in the range. */
+    size_t len;
+    /* The first byte of the range. */
+    const char* data;
+} qrange;
+
+/**
+ * A compiled search pattern. Searching for a qpattern instead of a plain
+ * qstring skips the preprocessing that each search would otherwise repeat,
+ * which matters when the same needle is searched for in many short haystacks,
+ * e.g. every line of a file.
+ *
+ * qpatterns are created by qpattern_compile and freed by qpattern_cleanup. All
+ * fields are private, except that `needle.data` may be read to check whether
+ * compilation failed.
+ */
+typedef struct {
+    /* The pattern's own copy of the needle. */
+    qstring needle;
+    /* Whether forward searches use the vector kernels, whether they use the
+       shift table instead, and whether backward searches use the reverse
+       shift table. Each table is only filled in if it is used. */
+    bool vector;
+    bool skip;
+    bool rskip;
+    /* Boyer-Moore-Horspool shift tables for forward and backward searches. */
+    unsigned char shift[256];
+    unsigned char rshift[256];
+} qpattern;
+
+/**
+ * A set of needles compiled into an Aho-Corasick automaton, for finding all of
+ * them in a single pass over the haystack, however many there are.
+ *
+ * Bytes that don't appear in any needle are merged into one equivalence class,
+ * so each row of the transition table has one entry per distinct byte in the
+ * needles rather than 256. This keeps the table small enough to stay in cache
+ * for large dictionaries.
+ *
+ * qmatchers are created by qmatcher_compile and freed by qmatcher_cleanup. All
+ * fields are private.
+ */
+typedef struct {
+    size_t npatterns;
+    size_t nstates;
+    size_t nclasses;
+    /* The equivalence class of each byte value. */
+    unsigned char classes[256];
+    /* The transition from state s on class c is table[s * nclasses + c]. */
+    uint32_t* table;
+    /* One more than the index of the needle that ends at each state, or 0. */
+    uint32_t* out;
+    /* The next state along the failure chain for which out is non-zero, or 0.
+     */
+    uint32_t* dict;
+    /* The length of each needle, and of the longest one. */
+    size_t* lens;
+    size_t maxlen;
+} qmatcher;
+
+/**
+ * A match found by a qmatcher: `pattern` is the index of the needle that
+ * matched and `index` is where the match starts in the haystack.
+ */
+typedef struct {
+    size_t index;
+    size_t len;
+    size_t pattern;
+} qmatch;
+
+/**
+ * An iterator over all the matches of a qmatcher in a qstring. Create it with
+ * qmatcher_iter_new and advance it with qmatcher_next. All fields are
+ * private.
+ */
+typedef struct {
+    const qmatcher* matcher;
+    qstring qs;
+    size_t pos;
+    uint32_t state;
+    uint32_t pending;
+} qmatcher_iter;
+
+/**
+ * An iterator that splits a qrange into fields, yielding each field as a view
+ * so that no field is ever copied. Create it with qsplit_char, qsplit_str or
+ * qsplit_any and advance it with qsplit_next. All fields are private.
+ */
+typedef struct {
+    qrange r;
+    /* The start of the next field. */
+    size_t pos;
+    size_t nsplits;
+    size_t maxsplit;
+    enum { QSPLIT_CHAR, QSPLIT_STR, QSPLIT_ANY } mode;
+    char delim;
+    qstring delims;
+    /* A bitmap of the delimiters, for QSPLIT_ANY. */
+    unsigned char set[32];
+    /* For QSPLIT_CHAR, the delimiters found among the bytes before `scan`
+       that haven't been consumed yet, with bit i of `mask` standing for the
+       byte at `base + i`. */
+    size_t scan;
+    size_t base;
+    unsigned int mask;
+    bool done;
+} qsplit;
 
 /**
  * Return a qstring containing a heap-allocated copy of the string parameter,
@@ -135,10 +260,28 @@ qstring qstring_concat(qstring, qstring);
 qstring qstring_format(qstring fmtstr, ...);
 
 /**
- * Replace all non-overlapping instances of `before` with `after` in `qs`.
+ * Replace all non-overlapping instances of `before` with `after` in `qs`. If
+ * `before` is the empty string, then `after` is inserted before every byte of
+ * `qs` and at the end.
+ *
+ * The haystack is scanned once, and the result is allocated once at its exact
+ * size.
  */
 qstring qstring_replace_all(qstring qs, qstring before, qstring after);
 
+/**
+ * Replace every instance of `befores[i]` with `afters[i]` in `qs`, for all `i`
+ * less than `n`, in a single pass. Where instances overlap, the one that
+ * starts first wins, and of those that start at the same index, the longest
+ * wins. Replacements are not themselves searched, so
+ *
+ *   qstring_replace_many("ab", {"a", "b"}, {"b", "a"}, 2) == "ba"
+ *
+ * Empty strings in `befores` are ignored.
+ */
+qstring qstring_replace_many(qstring qs, const qstring* befores,
+    const qstring* afters, size_t n);
+
 /**
  * Replace the first instance of `before` with `after` in `qs`.
  */
@@ -149,6 +292,28 @@ qstring qstring_replace_first(qstring qs, qstring before, qstring after);
  */
 qstring qstring_replace_last(qstring qs, qstring before, qstring after);
 
+/**
+ * Variants of the functions above that allocate their result from `arena`
+ * instead of the heap (see qarena.h). The returned qstrings must NOT be passed
+ * to qstring_cleanup, since they are freed along with the arena. If `arena` is
+ * NULL then the result is heap-allocated as usual.
+ */
+qstring qstring_new_a(qarena* arena, const char*);
+qstring qstring_new_buffer_a(qarena* arena, const char*, size_t n);
+qstring qstring_copy_a(qarena* arena, qstring);
+qstring qstring_substr_a(qarena* arena, qstring qs, size_t start, size_t n);
+qstring qstring_remove_a(qarena* arena, qstring qs, size_t start, size_t n);
+qstring qstring_concat_a(qarena* arena, qstring, qstring);
+qstring qstring_format_a(qarena* arena, qstring fmtstr, ...);
+qstring qstring_replace_all_a(qarena* arena, qstring qs, qstring before,
+    qstring after);
+qstring qstring_replace_many_a(qarena* arena, qstring qs,
+    const qstring* befores, const qstring* afters, size_t n);
+qstring qstring_replace_first_a(qarena* arena, qstring qs, qstring before,
+    qstring after);
+qstring qstring_replace_last_a(qarena* arena, qstring qs, qstring before,
+    qstring after);
+
 /**
  * Return the index of the first instance of `datum` in `qs`. If `datum` is not
  * found, then `qs.len` is returned.
@@ -156,7 +321,14 @@ qstring qstring_replace_last(qstring qs, qstring before, qstring after);
 size_t qstring_find(qstring qs, qstring datum);
 
 /**
- * Return the first instance of `datum` in the specified substring of `qs`.
+ * Return the first instance of `datum` in the specified substring of `qs`. Only
+ * matches that lie entirely within the substring are found. If there are none,
+ * then `qs.len` is returned.
+ *
+ * On x86, needles are located with SSE2 or AVX2 kernels that test 16 or 32
+ * positions at a time, chosen at runtime. Elsewhere, short needles are located
+ * by skipping to occurrences of their first byte with memchr, and longer ones
+ * with the Boyer-Moore-Horspool algorithm.
  */
 size_t qstring_find_in(qstring qs, qstring datum, size_t start, size_t n);
 
@@ -167,15 +339,112 @@ size_t qstring_find_in(qstring qs, qstring datum, size_t start, size_t n);
 size_t qstring_rfind(qstring qs, qstring datum);
 
 /**
- * Return the last instance of `datum` in the specified substring of `qs`.
+ * Return the last instance of `datum` in the specified substring of `qs`. As
+ * with qstring_find_in, only matches that lie entirely within the substring
+ * are found.
  */
-size_t qstring_rfind_in(qstring datum, qstring qs, size_t start, size_t n);
+size_t qstring_rfind_in(qstring qs, qstring datum, size_t start, size_t n);
 
 /**
- * Return the number of non-overlapping occurrences of `datum` in `qs`.
+ * Return the number of non-overlapping occurrences of `datum` in `qs`. The
+ * empty string occurs `qs.len + 1` times, once at each index and once at the
+ * end.
  */
 size_t qstring_count(qstring qs, qstring datum);
 
+/**
+ * Compile `needle` into a qpattern for use with the *_p functions below. The
+ * pattern holds its own copy of `needle`, so the argument may be freed
+ * afterwards.
+ *
+ * If allocation fails, the pattern's needle has a NULL data field and a length
+ * of 0. Such a pattern would match everywhere like an empty needle, so check
+ * for failure before using it:
+ *
+ *   qpattern p = qpattern_compile(needle);
+ *   if (p.needle.data == NULL) { ... }
+ *
+ * The returned pattern must eventually be passed to qpattern_cleanup to avoid a
+ * memory leak.
+ */
+qpattern qpattern_compile(qstring needle);
+
+/**
+ * Free the memory held by a qpattern.
+ */
+void qpattern_cleanup(qpattern*);
+
+/**
+ * Equivalent to qstring_find, qstring_rfind, qstring_count and
+ * qstring_replace_all, except that the needle is a compiled pattern.
+ */
+size_t qstring_find_p(qstring qs, const qpattern*);
+size_t qstring_rfind_p(qstring qs, const qpattern*);
+size_t qstring_count_p(qstring qs, const qpattern*);
+qstring qstring_replace_all_p(qstring qs, const qpattern* before,
+    qstring after);
+
+/**
+ * Compile the `n` needles in `patterns` into a qmatcher. The matcher does not
+ * refer to the needles after it has been compiled. Empty needles never match.
+ * If the same needle appears more than once, matches report the first index.
+ * If allocation fails, the matcher has no states and never matches.
+ *
+ * The returned matcher must eventually be passed to qmatcher_cleanup to avoid
+ * a memory leak.
+ */
+qmatcher qmatcher_compile(const qstring* patterns, size_t n);
+
+/**
+ * Free the memory held by a qmatcher.
+ */
+void qmatcher_cleanup(qmatcher*);
+
+/**
+ * Return the index of the first match of any of the matcher's needles in `qs`,
+ * or `qs.len` if there is none. The first match is the one that starts
+ * earliest; if several start at the same index, the longest is chosen, as in
+ * qstring_replace_many. If `pattern` is not NULL, the index of the needle that
+ * matched is placed in it.
+ */
+size_t qstring_find_any(qstring qs, const qmatcher*, size_t* pattern);
+
+/**
+ * Count the occurrences of each of the matcher's needles in `qs`. The count
+ * for needle `i` is placed in `counts[i]`, which must have room for all the
+ * needles. Unlike qstring_count, overlapping occurrences are all counted. The
+ * total number of occurrences is returned.
+ */
+size_t qstring_count_any(qstring qs, const qmatcher*, size_t* counts);
+
+/**
+ * Equivalent to qstring_replace_many, except that the needles are compiled
+ * into a qmatcher. Each instance of the matcher's `i`th needle is replaced by
+ * `afters[i]`.
+ */
+qstring qstring_replace_any(qstring qs, const qmatcher*, const qstring* afters);
+
+/**
+ * Return an iterator over every match of the matcher's needles in `qs`,
+ * including overlapping ones. For example,
+ *
+ *   qmatcher_iter it = qmatcher_iter_new(&m, qs);
+ *   qmatch match;
+ *   while (qmatcher_next(&it, &match)) {
+ *       ...
+ *   }
+ *
+ * Matches are produced in order of where they end, and for matches that end at
+ * the same index, from longest to shortest.
+ */
+qmatcher_iter qmatcher_iter_new(const qmatcher*, qstring qs);
+
+/**
+ * Place the next match in `match` and return true, or return false if there
+ * are no more matches.
+ */
+bool qmatcher_next(qmatcher_iter*, qmatch* match);
+
 /**
  * Return true if `qs` starts with `prefix`.
  */
@@ -186,6 +455,19 @@ bool qstring_startswith(qstring qs, qstring prefix);
  */
 bool qstring_endswith(qstring qs, qstring suffix);
 
+/**
+ * Case-insensitive versions of the comparison and search functions, which
+ * treat the ASCII letters A to Z as equal to a to z and compare all other
+ * bytes exactly. Nothing is allocated; letters are folded on the fly, 16 or
+ * 32 bytes at a time where the CPU allows. For Unicode case folding, see the
+ * _ci functions in qstring_utf8.h.
+ */
+bool qstring_equals_ci(qstring a, qstring b);
+bool qstring_startswith_ci(qstring qs, qstring prefix);
+bool qstring_endswith_ci(qstring qs, qstring suffix);
+size_t qstring_find_ci(qstring qs, qstring datum);
+size_t qstring_count_ci(qstring qs, qstring datum);
+
 /**
  * Remove characters from the beginning of `qs` until the first character not
  * in `to_strip` is encountered. The order of characters in `to_strip` does
@@ -206,11 +488,121 @@ qstring qstring_rstrip(qstring, qstring to_strip);
  */
 qstring qstring_strip(qstring, qstring to_strip);
 
+/**
+ * Return a view of the whole of `qs`.
+ */
+qrange qrange_new(qstring qs);
+
+/**
+ * Return a view of the first `n` bytes of the buffer, which need not be
+ * null-terminated.
+ */
+qrange qrange_new_buffer(const char*, size_t n);
+
+/**
+ * Return a newly-allocated qstring with a copy of the bytes in the range. The
+ * returned qstring must eventually be passed to qstring_cleanup, or in the
+ * case of qrange_to_qstring_a, freed along with the arena.
+ */
+qstring qrange_to_qstring(qrange);
+qstring qrange_to_qstring_a(qarena* arena, qrange);
+
+/**
+ * Return a qstring that shares the bytes of `r`, so that a view can be passed
+ * without copying as the needle, prefix, suffix or set of bytes to strip of
+ * any of the qstring and qrange functions. For example,
+ *
+ *   size_t i = qstring_find(line, qliteral_range(key));
+ *
+ * Like the return value of qliteral, the returned qstring should NOT be passed
+ * to qstring_cleanup. Unlike it, the data is not necessarily null-terminated.
+ */
+qstring qliteral_range(qrange r);
+
+/**
+ * Return true if the two ranges contain the same bytes.
+ */
+bool qrange_equals(qrange, qrange);
+
+/**
+ * Equivalent to the qstring functions of the same names, except that they
+ * operate on and return views instead of copies. Indices are relative to the
+ * start of the range, and searches that fail return `r.len`.
+ */
+qrange qrange_substr(qrange r, size_t start, size_t n);
+qrange qrange_lstrip(qrange r, qstring to_strip);
+qrange qrange_rstrip(qrange r, qstring to_strip);
+qrange qrange_strip(qrange r, qstring to_strip);
+size_t qrange_find(qrange r, qstring datum);
+size_t qrange_rfind(qrange r, qstring datum);
+size_t qrange_find_p(qrange r, const qpattern*);
+size_t qrange_rfind_p(qrange r, const qpattern*);
+size_t qrange_count(qrange r, qstring datum);
+size_t qrange_count_p(qrange r, const qpattern*);
+size_t qrange_find_any(qrange r, const qmatcher*, size_t* pattern);
+bool qrange_startswith(qrange r, qstring prefix);
+bool qrange_endswith(qrange r, qstring suffix);
+
+/**
+ * Return an iterator over the fields of `r` separated by the byte `delim`.
+ * Adjacent delimiters delimit an empty field, so
+ *
+ *   "a,,b" -> "a", "", "b"
+ *
+ * and a range with no delimiters has one field, the whole range. If `maxsplit`
+ * is not 0, then at most `maxsplit` splits are made and the last field is the
+ * rest of the range.
+ *
+ * On x86 the delimiters are found 16 or 32 bytes at a time and remembered
+ * between calls, so that short fields are cheap to iterate over.
+ */
+qsplit qsplit_char(qrange r, char delim, size_t maxsplit);
+
+/**
+ * The same as qsplit_char, except that the delimiter is a string. If `delim`
+ * is empty then the range is not split. `delim` must remain valid for as long
+ * as the iterator is used.
+ */
+qsplit qsplit_str(qrange r, qstring delim, size_t maxsplit);
+
+/**
+ * Return an iterator over the fields of `r` separated by runs of any of the
+ * bytes in `delims`. Leading and trailing delimiters are ignored and empty
+ * fields are never produced, so
+ *
+ *   qsplit_any("  a \t b ", " \t", 0) -> "a", "b"
+ *
+ * If `maxsplit` is not 0, then at most `maxsplit` splits are made and the last
+ * field is the rest of the range after any leading delimiters.
+ */
+qsplit qsplit_any(qrange r, qstring delims, size_t maxsplit);
+
+/**
+ * Place the next field in `field` and return true, or return false if there
+ * are no more fields. For example,
+ *
+ *   qsplit it = qsplit_char(qrange_new(line), ',', 0);
+ *   qrange field;
+ *   while (qsplit_next(&it, &field)) {
+ *       ...
+ *   }
+ */
+bool qsplit_next(qsplit*, qrange* field);
+
+/**
+ * Convenience macro for splitting on runs of whitespace.
+ */
+#define qsplit_ws(r, maxsplit) \
+    qsplit_any(r, qliteral(" \t\n\r\v\f"), maxsplit)
+
 /**
  * Convenience macros for stripping whitespace.
  */
-#define qstring_rstrip_ws(qs) qstring_rstrip(qs, " \t\n\r\v\f")
-#define qstring_lstrip_ws(qs) qstring_lstrip(qs, " \t\n\r\v\f")
-#define qstring_strip_ws(qs)  qstring_strip(qs, " \t\n\r\v\f")
+#define qstring_rstrip_ws(qs) qstring_rstrip(qs, qliteral(" \t\n\r\v\f"))
+#define qstring_lstrip_ws(qs) qstring_lstrip(qs, qliteral(" \t\n\r\v\f"))
+#define qstring_strip_ws(qs)  qstring_strip(qs, qliteral(" \t\n\r\v\f"))
+#define qrange_rstrip_ws(r)   qrange_rstrip(r, qliteral(" \t\n\r\v\f"))
+#define qrange_lstrip_ws(r)   qrange_lstrip(r, qliteral(" \t\n\r\v\f"))
+#define qrange_strip_ws(r)    qrange_strip(r, qliteral(" \t\n\r\v\f"))
 
 #endif
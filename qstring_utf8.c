@@ -0,0 +1,1059 @@
+/* Implementation of the qstring_utf8 library. See qstring_utf8.h for API
+ * documentation.
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "qstring_utf8.h"
+
+/* As in qstring.c, SSE2 is part of the x86-64 baseline and is used unless
+ * QSTRING_NO_SIMD is defined. The kernels store code points with 32-bit
+ * stores, so they also require utf8_char to be exactly 32 bits wide.
+ */
+#if !defined(QSTRING_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__)) && UINT_LEAST32_MAX == UINT32_MAX
+#define QSTRING_SIMD 1
+#include <immintrin.h>
+
+static bool have_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Decode the multibyte sequence at the start of `s`, which holds `n` bytes and
+ * whose first byte is not ASCII, following table 3-7 of the Unicode standard.
+ * Place the code point in `out` and return the length of the sequence, or
+ * return 0 if the sequence is not valid.
+ */
+static size_t decode_multibyte(const unsigned char* s, size_t n,
+    utf8_char* out) {
+    unsigned char c = s[0];
+    if (c >= 0xC2 && c <= 0xDF) {
+        if (n < 2 || (s[1] & 0xC0) != 0x80) {
+            return 0;
+        }
+        *out = ((utf8_char)(c & 0x1F) << 6) | (s[1] & 0x3F);
+        return 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        /* The second byte's range excludes overlong forms after E0 and
+         * surrogates after ED.
+         */
+        unsigned char lo = (c == 0xE0) ? 0xA0 : 0x80;
+        unsigned char hi = (c == 0xED) ? 0x9F : 0xBF;
+        if (n < 3 || s[1] < lo || s[1] > hi || (s[2] & 0xC0) != 0x80) {
+            return 0;
+        }
+        *out = ((utf8_char)(c & 0x0F) << 12) | ((utf8_char)(s[1] & 0x3F) << 6)
+            | (s[2] & 0x3F);
+        return 3;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        /* Likewise for overlong forms after F0 and code points beyond U+10FFFF
+         * after F4.
+         */
+        unsigned char lo = (c == 0xF0) ? 0x90 : 0x80;
+        unsigned char hi = (c == 0xF4) ? 0x8F : 0xBF;
+        if (n < 4 || s[1] < lo || s[1] > hi || (s[2] & 0xC0) != 0x80 ||
+            (s[3] & 0xC0) != 0x80) {
+            return 0;
+        }
+        *out = ((utf8_char)(c & 0x07) << 18) | ((utf8_char)(s[1] & 0x3F) << 12)
+            | ((utf8_char)(s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        return 4;
+    }
+    /* Continuation bytes, C0, C1 and F5 to FF can't start a sequence. */
+    return 0;
+}
+
+/* Widen a run of ASCII bytes at the start of `s` into `out`, as many bytes at
+ * a time as possible, and return how many bytes were widened. Stops before
+ * the first block that contains a non-ASCII byte, so the caller must finish
+ * the rest.
+ */
+static size_t decode_ascii(const unsigned char* s, size_t n, utf8_char* out) {
+    size_t i = 0;
+#ifdef QSTRING_SIMD
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        if (_mm_movemask_epi8(v) != 0) {
+            return i;
+        }
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(out + i + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(out + i + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i*)(out + i + 12),
+            _mm_unpackhi_epi16(hi, zero));
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, s + i, 8);
+        if (word & 0x8080808080808080ull) {
+            return i;
+        }
+        for (size_t j = 0; j < 8; j++) {
+            out[i + j] = s[i + j];
+        }
+    }
+#endif
+    return i;
+}
+
+qstring_utf8 qstring_utf8_decode(qstring qs) {
+    qstring_utf8 ret = {.len = 0, .data = NULL};
+    /* Each byte decodes to at most one code point, so this is enough, and the
+     * excess is given back at the end.
+     */
+    utf8_char* data = malloc((qs.len + 1) * sizeof *data);
+    if (data == NULL) {
+        return ret;
+    }
+
+    const unsigned char* s = (const unsigned char*)qs.data;
+    size_t i = 0;
+    size_t len = 0;
+    while (i < qs.len) {
+        if (s[i] < 0x80) {
+            size_t n = decode_ascii(s + i, qs.len - i, data + len);
+            i += n;
+            len += n;
+            /* Finish a short run byte by byte. */
+            while (i < qs.len && s[i] < 0x80) {
+                data[len++] = s[i++];
+            }
+        } else {
+            size_t n = decode_multibyte(s + i, qs.len - i, data + len);
+            if (n == 0) {
+                free(data);
+                return ret;
+            }
+            i += n;
+            len++;
+        }
+    }
+    data[len] = 0;
+
+    if (len < qs.len) {
+        utf8_char* shrunk = realloc(data, (len + 1) * sizeof *data);
+        if (shrunk != NULL) {
+            data = shrunk;
+        }
+    }
+    ret.len = len;
+    ret.data = data;
+    return ret;
+}
+
+qstring_utf8 qstring_utf8_new(const char* s) {
+    qstring qs = {.len = strlen(s), .data = (char*)s};
+    return qstring_utf8_decode(qs);
+}
+
+/* Return the number of bytes needed to encode `c`, or 0 if it can't be
+ * encoded.
+ */
+static size_t encoded_length(utf8_char c) {
+    if (c < 0x80) {
+        return 1;
+    } else if (c < 0x800) {
+        return 2;
+    } else if (c < 0x10000) {
+        return (c >= 0xD800 && c <= 0xDFFF) ? 0 : 3;
+    } else if (c <= 0x10FFFF) {
+        return 4;
+    }
+    return 0;
+}
+
+/* Narrow a run of ASCII code points at the start of `s` into `out`, as many at
+ * a time as possible, and return how many were narrowed.
+ */
+static size_t encode_ascii(const utf8_char* s, size_t n, char* out) {
+    size_t i = 0;
+#ifdef QSTRING_SIMD
+    const __m128i high = _mm_set1_epi32(~0x7F);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + i + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*)(s + i + 12));
+        __m128i all = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        __m128i bad = _mm_and_si128(all, high);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(bad, _mm_setzero_si128())) !=
+            0xFFFF) {
+            return i;
+        }
+        /* Every lane is below 0x80, so the saturating packs are exact. */
+        __m128i ab = _mm_packs_epi32(a, b);
+        __m128i cd = _mm_packs_epi32(c, d);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(ab, cd));
+    }
+#else
+    (void)s;
+    (void)n;
+    (void)out;
+#endif
+    return i;
+}
+
+qstring qstring_utf8_encode(qstring_utf8 qs) {
+    qstring ret = {.len = 0, .data = NULL};
+    size_t len = 0;
+    for (size_t i = 0; i < qs.len; i++) {
+        size_t n = encoded_length(qs.data[i]);
+        if (n == 0) {
+            return ret;
+        }
+        len += n;
+    }
+
+    char* data = malloc(len + 1);
+    if (data == NULL) {
+        return ret;
+    }
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < qs.len) {
+        utf8_char c = qs.data[i];
+        if (c < 0x80) {
+            size_t n = encode_ascii(qs.data + i, qs.len - i, data + pos);
+            i += n;
+            pos += n;
+            while (i < qs.len && qs.data[i] < 0x80) {
+                data[pos++] = qs.data[i++];
+            }
+            continue;
+        }
+
+        if (c < 0x800) {
+            data[pos++] = 0xC0 | (c >> 6);
+        } else if (c < 0x10000) {
+            data[pos++] = 0xE0 | (c >> 12);
+            data[pos++] = 0x80 | ((c >> 6) & 0x3F);
+        } else {
+            data[pos++] = 0xF0 | (c >> 18);
+            data[pos++] = 0x80 | ((c >> 12) & 0x3F);
+            data[pos++] = 0x80 | ((c >> 6) & 0x3F);
+        }
+        data[pos++] = 0x80 | (c & 0x3F);
+        i++;
+    }
+    data[pos] = '\0';
+    ret.len = pos;
+    ret.data = data;
+    return ret;
+}
+
+/* Validation on x86 follows the lookup algorithm of Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte" (2021). Every error
+ * in UTF-8 shows up in the first 12 bits of some pair of adjacent bytes, so
+ * three 16-entry tables, indexed by the high and low nibble of the previous
+ * byte and the high nibble of the current byte, each give the set of errors
+ * that the pair might have, and the pair is invalid when all three agree. The
+ * one exception is a continuation byte that is the third or fourth byte of a
+ * sequence, which is checked by looking back two and three bytes.
+ *
+ * The table lookups need the shuffle instruction of SSSE3, which is not part
+ * of the x86-64 baseline, so only the AVX2 kernel uses them. Without AVX2,
+ * ASCII is skipped 16 bytes at a time and the rest is checked byte by byte.
+ */
+#ifdef QSTRING_SIMD
+/* The kinds of errors. */
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+/* Set a 256-bit vector to the same 16 bytes in both lanes, for shuffles. */
+#define LOOKUP16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static __m256i nibble_high(__m256i v) {
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+/* Return the errors in the 32 bytes of `input`, given the 32 bytes before it
+ * in `prev`.
+ */
+__attribute__((target("avx2")))
+static __m256i check_block_avx2(__m256i input, __m256i prev) {
+    /* The input shifted right by one, two and three bytes, with the end of the
+     * previous block shifted in.
+     */
+    __m256i carried = _mm256_permute2x128_si256(prev, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+    const __m256i byte_1_high_table = LOOKUP16(
+        /* 0xxx: ASCII. */
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        /* 10xx: a continuation byte. */
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        /* 1100 and 1101: two-byte leads. */
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        /* 1110: a three-byte lead. */
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        /* 1111: a four-byte lead. */
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte_1_low_table = LOOKUP16(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte_2_high_table = LOOKUP16(
+        /* 0xxx: ASCII. */
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        /* 1000, 1001 and 101x: continuation bytes. */
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+            OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        /* 11xx: leads. */
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+        nibble_high(prev1));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table,
+        _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+        nibble_high(input));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high,
+        byte_1_low), byte_2_high);
+
+    /* The high bit is set where a byte must be the third or fourth byte of a
+     * sequence, which the tables report as TWO_CONTS.
+     */
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+        _mm256_set1_epi8(0x80));
+    return _mm256_xor_si256(must23, special);
+}
+
+/* Return nonzero bytes where the block ends in the middle of a sequence. */
+__attribute__((target("avx2")))
+static __m256i incomplete_avx2(__m256i input) {
+    const __m256i max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0xF0 - 1, 0xE0 - 1, 0xC0 - 1);
+    return _mm256_subs_epu8(input, max);
+}
+
+__attribute__((target("avx2")))
+static bool validate_avx2(const char* data, size_t n) {
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i < n) {
+        __m256i input;
+        if (i + 32 <= n) {
+            input = _mm256_loadu_si256((const __m256i*)(data + i));
+        } else {
+            /* Pad the last block with ASCII. */
+            char tail[32] = {0};
+            memcpy(tail, data + i, n - i);
+            input = _mm256_loadu_si256((const __m256i*)tail);
+        }
+        if (_mm256_movemask_epi8(input) == 0) {
+            /* An ASCII block is only wrong if the previous block ended in the
+             * middle of a sequence.
+             */
+            error = _mm256_or_si256(error, prev_incomplete);
+        } else {
+            error = _mm256_or_si256(error, check_block_avx2(input, prev));
+            prev_incomplete = incomplete_avx2(input);
+        }
+        prev = input;
+        i += 32;
+    }
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const char* data, size_t n) {
+    /* Bytes above -65 as signed bytes are the ones that aren't continuation
+     * bytes. Each byte lane counts up to 255 blocks before the lanes are
+     * summed.
+     */
+    const __m256i cont = _mm256_set1_epi8(-65);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t k = 0; k < 255 && i + 32 <= n; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(v, cont));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc,
+            _mm256_setzero_si256()));
+    }
+    /* The lanes are summed through memory since the intrinsics that move a
+     * 64-bit lane into a register only exist on x86-64.
+     */
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, total);
+    size_t count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++) {
+        count += ((data[i] & 0xC0) != 0x80);
+    }
+    return count;
+}
+
+static size_t count_sse2(const char* data, size_t n) {
+    const __m128i cont = _mm_set1_epi8(-65);
+    __m128i total = _mm_setzero_si128();
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i acc = _mm_setzero_si128();
+        for (size_t k = 0; k < 255 && i + 16 <= n; k++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(v, cont));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(acc, _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, total);
+    size_t count = lanes[0] + lanes[1];
+    for (; i < n; i++) {
+        count += ((data[i] & 0xC0) != 0x80);
+    }
+    return count;
+}
+#endif
+
+/* Return the number of ASCII bytes at the start of `s`, give or take a block:
+ * the count stops at the start of the first block with a non-ASCII byte.
+ */
+static size_t skip_ascii(const unsigned char* s, size_t n) {
+    size_t i = 0;
+#ifdef QSTRING_SIMD
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        if (_mm_movemask_epi8(v) != 0) {
+            break;
+        }
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, s + i, 8);
+        if (word & 0x8080808080808080ull) {
+            break;
+        }
+    }
+#endif
+    return i;
+}
+
+bool qstring_utf8_validate(qstring qs) {
+#ifdef QSTRING_SIMD
+    if (have_avx2()) {
+        return validate_avx2(qs.data, qs.len);
+    }
+#endif
+    const unsigned char* s = (const unsigned char*)qs.data;
+    size_t i = 0;
+    while (i < qs.len) {
+        if (s[i] < 0x80) {
+            i += skip_ascii(s + i, qs.len - i);
+            while (i < qs.len && s[i] < 0x80) {
+                i++;
+            }
+        } else {
+            utf8_char c;
+            size_t n = decode_multibyte(s + i, qs.len - i, &c);
+            if (n == 0) {
+                return false;
+            }
+            i += n;
+        }
+    }
+    return true;
+}
+
+size_t qstring_utf8_count(qstring qs) {
+#ifdef QSTRING_SIMD
+    if (have_avx2()) {
+        return count_avx2(qs.data, qs.len);
+    }
+    return count_sse2(qs.data, qs.len);
+#else
+    size_t count = 0;
+    for (size_t i = 0; i < qs.len; i++) {
+        count += ((qs.data[i] & 0xC0) != 0x80);
+    }
+    return count;
+#endif
+}
+
+/* The simple case foldings of the code points above ASCII, generated from
+ * Unicode 14.0's CaseFolding.txt. Each entry maps the code points from `first`
+ * to `last` by adding `delta`; if `stride` is 2, only every other code point
+ * in the range is mapped, which covers the many blocks where uppercase and
+ * lowercase letters alternate.
+ */
+static const struct {
+    uint32_t first;
+    uint32_t last;
+    int32_t delta;
+    uint8_t stride;
+} fold_ranges[] = {
+    {0x000B5, 0x000B5, 775, 1},
+    {0x000C0, 0x000D6, 32, 1},
+    {0x000D8, 0x000DE, 32, 1},
+    {0x00100, 0x0012E, 1, 2},
+    {0x00132, 0x00136, 1, 2},
+    {0x00139, 0x00147, 1, 2},
+    {0x0014A, 0x00176, 1, 2},
+    {0x00178, 0x00178, -121, 1},
+    {0x00179, 0x0017D, 1, 2},
+    {0x0017F, 0x0017F, -268, 1},
+    {0x00181, 0x00181, 210, 1},
+    {0x00182, 0x00184, 1, 2},
+    {0x00186, 0x00186, 206, 1},
+    {0x00187, 0x00187, 1, 1},
+    {0x00189, 0x0018A, 205, 1},
+    {0x0018B, 0x0018B, 1, 1},
+    {0x0018E, 0x0018E, 79, 1},
+    {0x0018F, 0x0018F, 202, 1},
+    {0x00190, 0x00190, 203, 1},
+    {0x00191, 0x00191, 1, 1},
+    {0x00193, 0x00193, 205, 1},
+    {0x00194, 0x00194, 207, 1},
+    {0x00196, 0x00196, 211, 1},
+    {0x00197, 0x00197, 209, 1},
+    {0x00198, 0x00198, 1, 1},
+    {0x0019C, 0x0019C, 211, 1},
+    {0x0019D, 0x0019D, 213, 1},
+    {0x0019F, 0x0019F, 214, 1},
+    {0x001A0, 0x001A4, 1, 2},
+    {0x001A6, 0x001A6, 218, 1},
+    {0x001A7, 0x001A7, 1, 1},
+    {0x001A9, 0x001A9, 218, 1},
+    {0x001AC, 0x001AC, 1, 1},
+    {0x001AE, 0x001AE, 218, 1},
+    {0x001AF, 0x001AF, 1, 1},
+    {0x001B1, 0x001B2, 217, 1},
+    {0x001B3, 0x001B5, 1, 2},
+    {0x001B7, 0x001B7, 219, 1},
+    {0x001B8, 0x001B8, 1, 1},
+    {0x001BC, 0x001BC, 1, 1},
+    {0x001C4, 0x001C4, 2, 1},
+    {0x001C5, 0x001C5, 1, 1},
+    {0x001C7, 0x001C7, 2, 1},
+    {0x001C8, 0x001C8, 1, 1},
+    {0x001CA, 0x001CA, 2, 1},
+    {0x001CB, 0x001DB, 1, 2},
+    {0x001DE, 0x001EE, 1, 2},
+    {0x001F1, 0x001F1, 2, 1},
+    {0x001F2, 0x001F4, 1, 2},
+    {0x001F6, 0x001F6, -97, 1},
+    {0x001F7, 0x001F7, -56, 1},
+    {0x001F8, 0x0021E, 1, 2},
+    {0x00220, 0x00220, -130, 1},
+    {0x00222, 0x00232, 1, 2},
+    {0x0023A, 0x0023A, 10795, 1},
+    {0x0023B, 0x0023B, 1, 1},
+    {0x0023D, 0x0023D, -163, 1},
+    {0x0023E, 0x0023E, 10792, 1},
+    {0x00241, 0x00241, 1, 1},
+    {0x00243, 0x00243, -195, 1},
+    {0x00244, 0x00244, 69, 1},
+    {0x00245, 0x00245, 71, 1},
+    {0x00246, 0x0024E, 1, 2},
+    {0x00345, 0x00345, 116, 1},
+    {0x00370, 0x00372, 1, 2},
+    {0x00376, 0x00376, 1, 1},
+    {0x0037F, 0x0037F, 116, 1},
+    {0x00386, 0x00386, 38, 1},
+    {0x00388, 0x0038A, 37, 1},
+    {0x0038C, 0x0038C, 64, 1},
+    {0x0038E, 0x0038F, 63, 1},
+    {0x00391, 0x003A1, 32, 1},
+    {0x003A3, 0x003AB, 32, 1},
+    {0x003C2, 0x003C2, 1, 1},
+    {0x003CF, 0x003CF, 8, 1},
+    {0x003D0, 0x003D0, -30, 1},
+    {0x003D1, 0x003D1, -25, 1},
+    {0x003D5, 0x003D5, -15, 1},
+    {0x003D6, 0x003D6, -22, 1},
+    {0x003D8, 0x003EE, 1, 2},
+    {0x003F0, 0x003F0, -54, 1},
+    {0x003F1, 0x003F1, -48, 1},
+    {0x003F4, 0x003F4, -60, 1},
+    {0x003F5, 0x003F5, -64, 1},
+    {0x003F7, 0x003F7, 1, 1},
+    {0x003F9, 0x003F9, -7, 1},
+    {0x003FA, 0x003FA, 1, 1},
+    {0x003FD, 0x003FF, -130, 1},
+    {0x00400, 0x0040F, 80, 1},
+    {0x00410, 0x0042F, 32, 1},
+    {0x00460, 0x00480, 1, 2},
+    {0x0048A, 0x004BE, 1, 2},
+    {0x004C0, 0x004C0, 15, 1},
+    {0x004C1, 0x004CD, 1, 2},
+    {0x004D0, 0x0052E, 1, 2},
+    {0x00531, 0x00556, 48, 1},
+    {0x010A0, 0x010C5, 7264, 1},
+    {0x010C7, 0x010C7, 7264, 1},
+    {0x010CD, 0x010CD, 7264, 1},
+    {0x013F8, 0x013FD, -8, 1},
+    {0x01C80, 0x01C80, -6222, 1},
+    {0x01C81, 0x01C81, -6221, 1},
+    {0x01C82, 0x01C82, -6212, 1},
+    {0x01C83, 0x01C84, -6210, 1},
+    {0x01C85, 0x01C85, -6211, 1},
+    {0x01C86, 0x01C86, -6204, 1},
+    {0x01C87, 0x01C87, -6180, 1},
+    {0x01C88, 0x01C88, 35267, 1},
+    {0x01C90, 0x01CBA, -3008, 1},
+    {0x01CBD, 0x01CBF, -3008, 1},
+    {0x01E00, 0x01E94, 1, 2},
+    {0x01E9B, 0x01E9B, -58, 1},
+    {0x01E9E, 0x01E9E, -7615, 1},
+    {0x01EA0, 0x01EFE, 1, 2},
+    {0x01F08, 0x01F0F, -8, 1},
+    {0x01F18, 0x01F1D, -8, 1},
+    {0x01F28, 0x01F2F, -8, 1},
+    {0x01F38, 0x01F3F, -8, 1},
+    {0x01F48, 0x01F4D, -8, 1},
+    {0x01F59, 0x01F5F, -8, 2},
+    {0x01F68, 0x01F6F, -8, 1},
+    {0x01F88, 0x01F8F, -8, 1},
+    {0x01F98, 0x01F9F, -8, 1},
+    {0x01FA8, 0x01FAF, -8, 1},
+    {0x01FB8, 0x01FB9, -8, 1},
+    {0x01FBA, 0x01FBB, -74, 1},
+    {0x01FBC, 0x01FBC, -9, 1},
+    {0x01FBE, 0x01FBE, -7173, 1},
+    {0x01FC8, 0x01FCB, -86, 1},
+    {0x01FCC, 0x01FCC, -9, 1},
+    {0x01FD8, 0x01FD9, -8, 1},
+    {0x01FDA, 0x01FDB, -100, 1},
+    {0x01FE8, 0x01FE9, -8, 1},
+    {0x01FEA, 0x01FEB, -112, 1},
+    {0x01FEC, 0x01FEC, -7, 1},
+    {0x01FF8, 0x01FF9, -128, 1},
+    {0x01FFA, 0x01FFB, -126, 1},
+    {0x01FFC, 0x01FFC, -9, 1},
+    {0x02126, 0x02126, -7517, 1},
+    {0x0212A, 0x0212A, -8383, 1},
+    {0x0212B, 0x0212B, -8262, 1},
+    {0x02132, 0x02132, 28, 1},
+    {0x02160, 0x0216F, 16, 1},
+    {0x02183, 0x02183, 1, 1},
+    {0x024B6, 0x024CF, 26, 1},
+    {0x02C00, 0x02C2F, 48, 1},
+    {0x02C60, 0x02C60, 1, 1},
+    {0x02C62, 0x02C62, -10743, 1},
+    {0x02C63, 0x02C63, -3814, 1},
+    {0x02C64, 0x02C64, -10727, 1},
+    {0x02C67, 0x02C6B, 1, 2},
+    {0x02C6D, 0x02C6D, -10780, 1},
+    {0x02C6E, 0x02C6E, -10749, 1},
+    {0x02C6F, 0x02C6F, -10783, 1},
+    {0x02C70, 0x02C70, -10782, 1},
+    {0x02C72, 0x02C72, 1, 1},
+    {0x02C75, 0x02C75, 1, 1},
+    {0x02C7E, 0x02C7F, -10815, 1},
+    {0x02C80, 0x02CE2, 1, 2},
+    {0x02CEB, 0x02CED, 1, 2},
+    {0x02CF2, 0x02CF2, 1, 1},
+    {0x0A640, 0x0A66C, 1, 2},
+    {0x0A680, 0x0A69A, 1, 2},
+    {0x0A722, 0x0A72E, 1, 2},
+    {0x0A732, 0x0A76E, 1, 2},
+    {0x0A779, 0x0A77B, 1, 2},
+    {0x0A77D, 0x0A77D, -35332, 1},
+    {0x0A77E, 0x0A786, 1, 2},
+    {0x0A78B, 0x0A78B, 1, 1},
+    {0x0A78D, 0x0A78D, -42280, 1},
+    {0x0A790, 0x0A792, 1, 2},
+    {0x0A796, 0x0A7A8, 1, 2},
+    {0x0A7AA, 0x0A7AA, -42308, 1},
+    {0x0A7AB, 0x0A7AB, -42319, 1},
+    {0x0A7AC, 0x0A7AC, -42315, 1},
+    {0x0A7AD, 0x0A7AD, -42305, 1},
+    {0x0A7AE, 0x0A7AE, -42308, 1},
+    {0x0A7B0, 0x0A7B0, -42258, 1},
+    {0x0A7B1, 0x0A7B1, -42282, 1},
+    {0x0A7B2, 0x0A7B2, -42261, 1},
+    {0x0A7B3, 0x0A7B3, 928, 1},
+    {0x0A7B4, 0x0A7C2, 1, 2},
+    {0x0A7C4, 0x0A7C4, -48, 1},
+    {0x0A7C5, 0x0A7C5, -42307, 1},
+    {0x0A7C6, 0x0A7C6, -35384, 1},
+    {0x0A7C7, 0x0A7C9, 1, 2},
+    {0x0A7D0, 0x0A7D0, 1, 1},
+    {0x0A7D6, 0x0A7D8, 1, 2},
+    {0x0A7F5, 0x0A7F5, 1, 1},
+    {0x0AB70, 0x0ABBF, -38864, 1},
+    {0x0FF21, 0x0FF3A, 32, 1},
+    {0x10400, 0x10427, 40, 1},
+    {0x104B0, 0x104D3, 40, 1},
+    {0x10570, 0x1057A, 39, 1},
+    {0x1057C, 0x1058A, 39, 1},
+    {0x1058C, 0x10592, 39, 1},
+    {0x10594, 0x10595, 39, 1},
+    {0x10C80, 0x10CB2, 64, 1},
+    {0x118A0, 0x118BF, 32, 1},
+    {0x16E40, 0x16E5F, 32, 1},
+    {0x1E900, 0x1E921, 34, 1},
+};
+
+utf8_char qstring_utf8_fold(utf8_char c) {
+    if (c < 0x80) {
+        return (c - 'A' < 26u) ? c + ('a' - 'A') : c;
+    }
+    size_t lo = 0;
+    size_t hi = sizeof fold_ranges / sizeof fold_ranges[0];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c < fold_ranges[mid].first) {
+            hi = mid;
+        } else if (c > fold_ranges[mid].last) {
+            lo = mid + 1;
+        } else {
+            if ((c - fold_ranges[mid].first) % fold_ranges[mid].stride != 0) {
+                return c;
+            }
+            return c + fold_ranges[mid].delta;
+        }
+    }
+    return c;
+}
+
+/* Return the length of the common prefix of `a` and `b` under case folding. */
+static size_t common_prefix_ci(const utf8_char* a, size_t n,
+    const utf8_char* b, size_t m) {
+    size_t i = 0;
+    while (i < n && i < m && (a[i] == b[i] ||
+            qstring_utf8_fold(a[i]) == qstring_utf8_fold(b[i]))) {
+        i++;
+    }
+    return i;
+}
+
+bool qstring_utf8_equals_ci(qstring_utf8 a, qstring_utf8 b) {
+    return a.len == b.len &&
+        common_prefix_ci(a.data, a.len, b.data, b.len) == a.len;
+}
+
+bool qstring_utf8_startswith_ci(qstring_utf8 qs, qstring_utf8 prefix) {
+    return qs.len >= prefix.len &&
+        common_prefix_ci(qs.data, qs.len, prefix.data, prefix.len) ==
+            prefix.len;
+}
+
+size_t qstring_utf8_find_ci(qstring_utf8 qs, qstring_utf8 datum) {
+    if (datum.len == 0) {
+        return 0;
+    }
+    utf8_char first = qstring_utf8_fold(datum.data[0]);
+    for (size_t i = 0; i + datum.len <= qs.len; i++) {
+        if (qstring_utf8_fold(qs.data[i]) == first &&
+                common_prefix_ci(qs.data + i, datum.len, datum.data,
+                    datum.len) == datum.len) {
+            return i;
+        }
+    }
+    return qs.len;
+}
+
+size_t qstring_utf8_count_ci(qstring_utf8 qs, qstring_utf8 datum) {
+    if (datum.len == 0) {
+        return qs.len + 1;
+    }
+    size_t count = 0;
+    size_t i = 0;
+    while (i < qs.len) {
+        qstring_utf8 rest = {.len = qs.len - i, .data = qs.data + i};
+        size_t found = qstring_utf8_find_ci(rest, datum);
+        if (found == rest.len) {
+            break;
+        }
+        count++;
+        i += found + datum.len;
+    }
+    return count;
+}
+
+/* An impossible code point, used for bytes that aren't valid UTF-8 so that
+ * they only ever match themselves.
+ */
+#define INVALID_BYTE 0x80000000u
+
+/* Decode and fold the code point at the start of `s`, which holds `n > 0`
+ * bytes, and place the number of bytes that it takes in `len`.
+ */
+static utf8_char next_folded(const unsigned char* s, size_t n, size_t* len) {
+    if (s[0] < 0x80) {
+        *len = 1;
+        return (s[0] - 'A' < 26u) ? s[0] + ('a' - 'A') : s[0];
+    }
+    utf8_char c;
+    *len = decode_multibyte(s, n, &c);
+    if (*len == 0) {
+        *len = 1;
+        return INVALID_BYTE | s[0];
+    }
+    return qstring_utf8_fold(c);
+}
+
+/* Match `p` against the start of `s` under case folding. Return the number of
+ * bytes of `s` that it matches, or (size_t)-1 if it doesn't match.
+ */
+static size_t match_ci_utf8(const unsigned char* s, size_t n,
+    const unsigned char* p, size_t m) {
+    size_t i = 0;
+    size_t j = 0;
+    while (j < m) {
+        if (i == n) {
+            return (size_t)-1;
+        }
+        /* Identical ASCII needs no decoding. */
+        if (s[i] == p[j] && s[i] < 0x80) {
+            i++;
+            j++;
+            continue;
+        }
+        size_t slen, plen;
+        if (next_folded(s + i, n - i, &slen) !=
+                next_folded(p + j, m - j, &plen)) {
+            return (size_t)-1;
+        }
+        i += slen;
+        j += plen;
+    }
+    return i;
+}
+
+bool qstring_equals_ci_utf8(qstring a, qstring b) {
+    return match_ci_utf8((const unsigned char*)a.data, a.len,
+        (const unsigned char*)b.data, b.len) == a.len;
+}
+
+bool qstring_startswith_ci_utf8(qstring qs, qstring prefix) {
+    return match_ci_utf8((const unsigned char*)qs.data, qs.len,
+        (const unsigned char*)prefix.data, prefix.len) != (size_t)-1;
+}
+
+/* Find the first match at or after byte `start`, placing its length in bytes
+ * in `len`. Returns qs.len if there is none.
+ */
+static size_t find_ci_utf8(qstring qs, qstring datum, size_t start,
+    size_t* len) {
+    const unsigned char* s = (const unsigned char*)qs.data;
+    const unsigned char* p = (const unsigned char*)datum.data;
+    size_t plen;
+    utf8_char first = next_folded(p, datum.len, &plen);
+    size_t i = start;
+    while (i < qs.len) {
+        size_t slen;
+        if (next_folded(s + i, qs.len - i, &slen) == first) {
+            size_t matched = match_ci_utf8(s + i, qs.len - i, p, datum.len);
+            if (matched != (size_t)-1) {
+                *len = matched;
+                return i;
+            }
+        }
+        i += slen;
+    }
+    return qs.len;
+}
+
+size_t qstring_find_ci_utf8(qstring qs, qstring datum) {
+    if (datum.len == 0) {
+        return 0;
+    }
+    size_t len;
+    return find_ci_utf8(qs, datum, 0, &len);
+}
+
+size_t qstring_count_ci_utf8(qstring qs, qstring datum) {
+    if (datum.len == 0) {
+        return qs.len + 1;
+    }
+    size_t count = 0;
+    size_t i = 0;
+    while (true) {
+        size_t len;
+        i = find_ci_utf8(qs, datum, i, &len);
+        if (i == qs.len) {
+            break;
+        }
+        count++;
+        i += len;
+    }
+    return count;
+}
+
+void qstring_utf8_cleanup(qstring_utf8 qs) {
+    free(qs.data);
+}
+
+qutf8 qutf8_new(qrange bytes) {
+    qutf8 ret = {.bytes = {.len = 0, .data = NULL}, .len = 0, .index = NULL};
+    qstring qs = {.len = bytes.len, .data = (char*)bytes.data};
+    if (qstring_utf8_validate(qs)) {
+        ret.bytes = bytes;
+        ret.len = qstring_utf8_count(qs);
+    }
+    return ret;
+}
+
+void qutf8_cleanup(qutf8* u) {
+    free(u->index);
+    u->index = NULL;
+}
+
+/* Return the position of lead byte number `n`, counting from 0, at or after
+ * s[pos]. The text must have that many lead bytes after `pos`.
+ */
+static size_t skip_code_points(const unsigned char* s, size_t len, size_t pos,
+    size_t n) {
+    /* Skip eight bytes at a time while the lead byte is further on. A byte is
+     * a continuation byte if its top two bits are 10.
+     */
+    while (pos + 8 <= len) {
+        uint64_t word;
+        memcpy(&word, s + pos, 8);
+        uint64_t cont = word & ~(word << 1) & 0x8080808080808080ull;
+        /* Sum the one bit per byte with a multiply. */
+        size_t nleads = 8 - (((cont >> 7) * 0x0101010101010101ull) >> 56);
+        if (nleads > n) {
+            break;
+        }
+        n -= nleads;
+        pos += 8;
+    }
+    while (true) {
+        if ((s[pos] & 0xC0) != 0x80) {
+            if (n == 0) {
+                return pos;
+            }
+            n--;
+        }
+        pos++;
+    }
+}
+
+/* Build the index of every QUTF8_STRIDE'th code point. Returns false if it
+ * can't be allocated, in which case offsets are found by scanning from the
+ * start of the text.
+ */
+static bool build_index(qutf8* u) {
+    size_t n = (u->len + QUTF8_STRIDE - 1) / QUTF8_STRIDE;
+    size_t* index = malloc(n * sizeof *index);
+    if (index == NULL) {
+        return false;
+    }
+    const unsigned char* s = (const unsigned char*)u->bytes.data;
+    index[0] = 0;
+    for (size_t k = 1; k < n; k++) {
+        index[k] = skip_code_points(s, u->bytes.len, index[k - 1],
+            QUTF8_STRIDE);
+    }
+    u->index = index;
+    return true;
+}
+
+size_t qutf8_offset(qutf8* u, size_t i) {
+    if (i >= u->len) {
+        return u->bytes.len;
+    }
+    size_t pos = 0;
+    size_t skip = i;
+    if (i >= QUTF8_STRIDE && (u->index != NULL || build_index(u))) {
+        pos = u->index[i / QUTF8_STRIDE];
+        skip = i % QUTF8_STRIDE;
+    }
+    return skip_code_points((const unsigned char*)u->bytes.data, u->bytes.len,
+        pos, skip);
+}
+
+utf8_char qutf8_at(qutf8* u, size_t i) {
+    if (i >= u->len) {
+        return 0;
+    }
+    size_t pos = qutf8_offset(u, i);
+    const unsigned char* s = (const unsigned char*)u->bytes.data + pos;
+    if (s[0] < 0x80) {
+        return s[0];
+    }
+    utf8_char c = 0;
+    decode_multibyte(s, u->bytes.len - pos, &c);
+    return c;
+}
+
+qrange qutf8_substr(qutf8* u, size_t start, size_t n) {
+    if (start >= u->len) {
+        return qrange_new_buffer(u->bytes.data + u->bytes.len, 0);
+    }
+    if (n > u->len - start) {
+        n = u->len - start;
+    }
+    size_t from = qutf8_offset(u, start);
+    size_t to = qutf8_offset(u, start + n);
+    return qrange_new_buffer(u->bytes.data + from, to - from);
+}
+
+size_t qutf8_find(qutf8* u, qstring datum) {
+    size_t pos = qrange_find(u->bytes, datum);
+    if (pos == u->bytes.len) {
+        return u->len;
+    }
+    /* A valid needle starts with a lead byte, so the match starts on a code
+     * point boundary. Find its index by counting from the nearest indexed
+     * code point before it.
+     */
+    size_t base = 0;
+    size_t from = 0;
+    if (u->len > QUTF8_STRIDE && (u->index != NULL || build_index(u))) {
+        size_t lo = 0;
+        size_t hi = (u->len + QUTF8_STRIDE - 1) / QUTF8_STRIDE;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (u->index[mid] <= pos) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        base = lo * QUTF8_STRIDE;
+        from = u->index[lo];
+    }
+    qstring between = {.len = pos - from, .data = (char*)u->bytes.data + from};
+    return base + qstring_utf8_count(between);
+}
@@ -1,6 +1,28 @@
+/* Unicode strings. A qstring_utf8 holds one 32-bit code point per element, so
+ * that code points can be indexed directly, and converts to and from UTF-8
+ * encoded qstrings.
+ *
+ * Decoding validates its input: overlong encodings, surrogates, code points
+ * beyond U+10FFFF and truncated sequences are all rejected. Runs of ASCII are
+ * decoded 16 bytes at a time. When only validity or the number of code points
+ * is needed, qstring_utf8_validate and qstring_utf8_count work directly on
+ * the encoded qstring without decoding it.
+ *
+ * As with qstrings, the data field is heap-allocated and null-terminated (by
+ * a zero code point), and a qstring_utf8 with a length of 0 and a NULL data
+ * field is returned if allocation or decoding fails.
+ *
+ *
+ * Author:  Ian Fisher (iafisher@protonmail.com)
+ * Version: July 2018
+ */
+
 #ifndef QSTRING_UTF8_H
 #define QSTRING_UTF8_H
 
+#include <stddef.h>
+#include "qstring.h"
+
 /* Define the utf8_char type as a 32-bit integer. */
 #if __STDC_VERSION__ >= 199901L
 #include <stdint.h>
@@ -10,8 +32,141 @@ typedef unsigned long int utf8_char;
 #endif
 
 typedef struct {
+    /* Both fields are considered public and read-only. */
+
+    /* The number of code points, excluding the null terminator. */
     size_t len;
     utf8_char* data;
 } qstring_utf8;
 
+/**
+ * A qutf8 is a compact alternative to qstring_utf8 for large text: it keeps the
+ * text as UTF-8, in a qrange owned by someone else, and supports indexing by
+ * code point with a sparse index of the byte offset of every
+ * QUTF8_STRIDE'th code point. The index costs an eighth of a byte per code
+ * point, against the three extra bytes per code point of a qstring_utf8, and
+ * it is only built the first time that it is needed.
+ *
+ * Functions that may build the index take a pointer to the qutf8.
+ */
+#define QUTF8_STRIDE 64
+
+typedef struct {
+    /* Public and read-only: the text, and its length in code points. */
+    qrange bytes;
+    size_t len;
+    /* The index, or NULL if it hasn't been built. */
+    size_t* index;
+} qutf8;
+
+/**
+ * Decode the UTF-8 encoded qstring into code points. If `qs` is not valid
+ * UTF-8, a qstring_utf8 with a NULL data field is returned.
+ *
+ * The returned qstring_utf8 must eventually be passed to qstring_utf8_cleanup
+ * to avoid a memory leak.
+ */
+qstring_utf8 qstring_utf8_decode(qstring qs);
+
+/**
+ * Decode the null-terminated UTF-8 string.
+ */
+qstring_utf8 qstring_utf8_new(const char*);
+
+/**
+ * Encode the code points as UTF-8. If any of them is a surrogate or is beyond
+ * U+10FFFF, a qstring with a NULL data field is returned.
+ *
+ * The returned qstring must eventually be passed to qstring_cleanup to avoid a
+ * memory leak.
+ */
+qstring qstring_utf8_encode(qstring_utf8);
+
+/**
+ * Return true if `qs` is valid UTF-8, by the same rules that
+ * qstring_utf8_decode follows. This works in place, so it doesn't need the
+ * four bytes per character that decoding takes.
+ */
+bool qstring_utf8_validate(qstring qs);
+
+/**
+ * Return the number of code points in the UTF-8 encoded `qs`. This is simply
+ * the number of bytes that are not continuation bytes, so it is only
+ * meaningful if `qs` is valid UTF-8.
+ */
+size_t qstring_utf8_count(qstring qs);
+
+/**
+ * Return the simple case folding of `c`, as defined by the Unicode standard's
+ * CaseFolding.txt (the mappings with status C and S). Two code points are
+ * equal ignoring case if their foldings are equal.
+ */
+utf8_char qstring_utf8_fold(utf8_char c);
+
+/**
+ * Case-insensitive comparison and search of qstring_utf8s, which compare code
+ * points by their simple case folding. The searches return the index of the
+ * first match, or `qs.len` if there is none, and count non-overlapping
+ * matches.
+ */
+bool qstring_utf8_equals_ci(qstring_utf8 a, qstring_utf8 b);
+bool qstring_utf8_startswith_ci(qstring_utf8 qs, qstring_utf8 prefix);
+size_t qstring_utf8_find_ci(qstring_utf8 qs, qstring_utf8 datum);
+size_t qstring_utf8_count_ci(qstring_utf8 qs, qstring_utf8 datum);
+
+/**
+ * The same for UTF-8 encoded qstrings, decoded on the fly without allocating.
+ * Since folding can change the length of a code point's encoding (the Kelvin
+ * sign folds to k), matches are found by code point, and the searches return
+ * the byte offset of the first match. Invalid bytes only match themselves.
+ *
+ * For ASCII-only case folding, the qstring_*_ci functions in qstring.h are
+ * faster.
+ */
+bool qstring_equals_ci_utf8(qstring a, qstring b);
+bool qstring_startswith_ci_utf8(qstring qs, qstring prefix);
+size_t qstring_find_ci_utf8(qstring qs, qstring datum);
+size_t qstring_count_ci_utf8(qstring qs, qstring datum);
+
+/**
+ * Free the qstring_utf8's data field.
+ */
+void qstring_utf8_cleanup(qstring_utf8);
+
+/**
+ * Return a qutf8 for `bytes`, which must outlive it. If `bytes` is not valid
+ * UTF-8, the data field of the returned object's bytes is NULL.
+ *
+ * The returned object must eventually be passed to qutf8_cleanup.
+ */
+qutf8 qutf8_new(qrange bytes);
+
+/**
+ * Free the qutf8's index.
+ */
+void qutf8_cleanup(qutf8*);
+
+/**
+ * Return the byte offset of code point `i`, or `u->bytes.len` if `i` is out of
+ * bounds. Takes time proportional to QUTF8_STRIDE once the index is built.
+ */
+size_t qutf8_offset(qutf8* u, size_t i);
+
+/**
+ * Return code point `i`, or 0 if `i` is out of bounds.
+ */
+utf8_char qutf8_at(qutf8* u, size_t i);
+
+/**
+ * Return a view of `n` code points starting at code point `start`, with the
+ * same handling of out-of-bounds indices as qstring_substr.
+ */
+qrange qutf8_substr(qutf8* u, size_t start, size_t n);
+
+/**
+ * Return the code point index of the first instance of `datum`, which should
+ * be valid UTF-8, or `u->len` if it is not found.
+ */
+size_t qutf8_find(qutf8* u, qstring datum);
+
 #endif
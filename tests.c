@@ -5,11 +5,23 @@
  * Version: July 2018
  */
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "qarena.h"
+#include "qbuilder.h"
+#include "qhash.h"
+#include "qintern.h"
 #include "qio.h"
+#include "qio_utf8.h"
+#include "qrope.h"
+#include "qshared.h"
+#include "qsmall.h"
 #include "qstring.h"
+#include "qstring_utf8.h"
 #include "unittest.h"
 
 
@@ -161,6 +173,15 @@ void test_qstring_concat() {
 
     qstring_cleanup(qs);
 
+    /* The second string needn't be null-terminated. */
+    qstring prefix = qstring_new_buffer("Hello, world!", 5);
+    qstring hello = {.len = 5, .data = (char*)helloworld};
+    qs = qstring_concat(prefix, hello);
+    ASSERT_STREQ("HelloHello", qs.data);
+    ASSERT_UINTEQ(10, qs.len);
+    qstring_cleanup(qs);
+    qstring_cleanup(prefix);
+
     /* Concatenate with the empty string. */
     qs = qstring_concat(qliteral(helloworld), qliteral(""));
 
@@ -199,15 +220,411 @@ void test_qstring_format() {
 }
 
 void test_qstring_replace() {
-    // TODO (replace_all, replace_first, replace_last)
+    qstring qs = qstring_replace_all(qliteral("a-b-c"), qliteral("-"),
+        qliteral(", "));
+
+    ASSERT_STREQ("a, b, c", qs.data);
+    ASSERT_UINTEQ(7, qs.len);
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+
+    qstring_cleanup(qs);
+
+    /* Replace with a shorter string. */
+    qs = qstring_replace_all(qliteral("one, two, three"), qliteral(", "),
+        qliteral(""));
+
+    ASSERT_STREQ("onetwothree", qs.data);
+    ASSERT_UINTEQ(11, qs.len);
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+
+    qstring_cleanup(qs);
+
+    /* Matches at both ends and non-overlapping matches. */
+    qs = qstring_replace_all(qliteral("aaaaa"), qliteral("aa"), qliteral("b"));
+
+    ASSERT_STREQ("bba", qs.data);
+    ASSERT_UINTEQ(3, qs.len);
+
+    qstring_cleanup(qs);
+
+    /* No matches. */
+    qs = qstring_replace_all(qliteral(helloworld), qliteral("xyz"),
+        qliteral("abc"));
+
+    ASSERT_STREQ(helloworld, qs.data);
+    ASSERT(qs.data != helloworld);
+
+    qstring_cleanup(qs);
+
+    /* Replace the empty string. */
+    qs = qstring_replace_all(qliteral("abc"), qliteral(""), qliteral("-"));
+
+    ASSERT_STREQ("-a-b-c-", qs.data);
+    ASSERT_UINTEQ(7, qs.len);
+
+    qstring_cleanup(qs);
+
+    /* A long needle. */
+    qs = qstring_replace_all(
+        qliteral("Look on my works, ye Mighty, and despair!"),
+        qliteral("ye Mighty"), qliteral("you"));
+
+    ASSERT_STREQ("Look on my works, you, and despair!", qs.data);
+
+    qstring_cleanup(qs);
+
+    /* More matches than fit in the inline match list. */
+    qstring many = qstring_repeat(',', 100);
+    qs = qstring_replace_all(many, qliteral(","), qliteral(", "));
+
+    ASSERT_UINTEQ(200, qs.len);
+    ASSERT_UINTEQ(100, qstring_count(qs, qliteral(", ")));
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+
+    qstring_cleanup(qs);
+    qstring_cleanup(many);
+
+    /* Test qstring_replace_first and qstring_replace_last. */
+    qs = qstring_replace_first(qliteral("a-b-c"), qliteral("-"),
+        qliteral("+++"));
+
+    ASSERT_STREQ("a+++b-c", qs.data);
+    ASSERT_UINTEQ(7, qs.len);
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+
+    qstring_cleanup(qs);
+
+    qs = qstring_replace_last(qliteral("a-b-c"), qliteral("-"), qliteral(""));
+
+    ASSERT_STREQ("a-bc", qs.data);
+    ASSERT_UINTEQ(4, qs.len);
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+
+    qstring_cleanup(qs);
+
+    qs = qstring_replace_last(qliteral("a-b-c"), qliteral("+"), qliteral(""));
+
+    ASSERT_STREQ("a-b-c", qs.data);
+
+    qstring_cleanup(qs);
+
+    /* Test qstring_replace_many. */
+    qstring befores[] = {qliteral("&"), qliteral("<"), qliteral(">"),
+        qliteral("<<")};
+    qstring afters[] = {qliteral("&amp;"), qliteral("&lt;"), qliteral("&gt;"),
+        qliteral("&laquo;")};
+    qs = qstring_replace_many(qliteral("a < b && c >> d <<< e"), befores,
+        afters, 4);
+
+    ASSERT_STREQ("a &lt; b &amp;&amp; c &gt;&gt; d &laquo;&lt; e", qs.data);
+    ASSERT_UINTEQ(strlen(qs.data), qs.len);
+
+    qstring_cleanup(qs);
+
+    /* Replacements are not searched again. */
+    qstring swap_before[] = {qliteral("a"), qliteral("b")};
+    qstring swap_after[] = {qliteral("b"), qliteral("a")};
+    qs = qstring_replace_many(qliteral("abba"), swap_before, swap_after, 2);
+
+    ASSERT_STREQ("baab", qs.data);
+
+    qstring_cleanup(qs);
+
+    /* The match that starts first wins. */
+    qstring overlap_before[] = {qliteral("bcd"), qliteral("abc")};
+    qstring overlap_after[] = {qliteral("1"), qliteral("2")};
+    qs = qstring_replace_many(qliteral("abcde"), overlap_before, overlap_after,
+        2);
+
+    ASSERT_STREQ("2de", qs.data);
+
+    qstring_cleanup(qs);
+
+    /* A longer match that starts earlier is reported after shorter ones that
+       it overlaps, and a short match after it is still replaced. */
+    qstring late_before[] = {qliteral("b"), qliteral("c"), qliteral("abcx")};
+    qstring late_after[] = {qliteral("B"), qliteral("C"), qliteral("-")};
+    qs = qstring_replace_many(qliteral("abcxbcabc"), late_before, late_after,
+        3);
+
+    ASSERT_STREQ("-BCaBC", qs.data);
+
+    qstring_cleanup(qs);
+
+    /* Nested needles match at every position of a run, but only the longest
+       is replaced each time. */
+    qstring nested_before[] = {qliteral("a"), qliteral("aa"), qliteral("aaa")};
+    qstring nested_after[] = {qliteral("1"), qliteral("2"), qliteral("3")};
+    qstring run = qstring_repeat('a', 10000);
+    qs = qstring_replace_many(run, nested_before, nested_after, 3);
+
+    ASSERT_UINTEQ(3334, qs.len);
+    ASSERT(qs.data[0] == '3' && qs.data[3332] == '3' && qs.data[3333] == '1');
+
+    qstring_cleanup(qs);
+    qstring_cleanup(run);
 }
 
 void test_qstring_find() {
-    // TODO (find, find_in, rfind, rfind_in)
+    qstring qs = qliteral(helloworld);
+
+    ASSERT_UINTEQ(0, qstring_find(qs, qliteral("Hello")));
+    ASSERT_UINTEQ(4, qstring_find(qs, qliteral("o")));
+    ASSERT_UINTEQ(7, qstring_find(qs, qliteral("world!")));
+    ASSERT_UINTEQ(0, qstring_find(qs, qliteral("")));
+    ASSERT_UINTEQ(qs.len, qstring_find(qs, qliteral("World")));
+    ASSERT_UINTEQ(qs.len, qstring_find(qs, qliteral("Hello, world!!")));
+
+    /* Needles long enough to use the Horspool search. */
+    qstring text = qliteral("I met a traveller from an antique land, who said");
+    ASSERT_UINTEQ(8, qstring_find(text, qliteral("traveller from")));
+    ASSERT_UINTEQ(26, qstring_find(text, qliteral("antique land")));
+    ASSERT_UINTEQ(text.len, qstring_find(text, qliteral("antique lands")));
+    ASSERT_UINTEQ(text.len, qstring_find(text, qliteral("traveler from")));
+    ASSERT_UINTEQ(0, qstring_find(text, text));
+
+    /* Repetitive needles, which exercise the shift table. */
+    qstring as = qliteral("aaaaaaaaaaaaaaaaaaaaaaaaaaaaab");
+    ASSERT_UINTEQ(20, qstring_find(as, qliteral("aaaaaaaaab")));
+    ASSERT_UINTEQ(as.len, qstring_find(as, qliteral("aaaaaaaaaab0")));
+
+    /* Null bytes in the haystack and needle. */
+    qstring bin = {.len = 9, .data = "ab\0cd\0efg"};
+    qstring needle = {.len = 3, .data = "\0cd"};
+    ASSERT_UINTEQ(2, qstring_find(bin, needle));
+    needle.data = "\0ef";
+    ASSERT_UINTEQ(5, qstring_find(bin, needle));
+
+    /* Haystacks whose vectorized search stops a byte short of a full needle,
+     * one for each block size.
+     */
+    qstring a17 = qstring_repeat('a', 17);
+    qstring a33 = qstring_repeat('a', 33);
+    ASSERT_UINTEQ(17, qstring_find(a17, qliteral("xy")));
+    ASSERT_UINTEQ(33, qstring_find(a33, qliteral("xy")));
+    qstring_cleanup(a17);
+    qstring_cleanup(a33);
+
+    /* Test qstring_find_in. */
+    ASSERT_UINTEQ(8, qstring_find_in(qs, qliteral("o"), 5, 8));
+    ASSERT_UINTEQ(8, qstring_find_in(qs, qliteral("o"), 8, 1));
+    ASSERT_UINTEQ(qs.len, qstring_find_in(qs, qliteral("o"), 5, 3));
+    ASSERT_UINTEQ(qs.len, qstring_find_in(qs, qliteral("o"), 1000, 5));
+    /* The match must fit entirely within the substring. */
+    ASSERT_UINTEQ(qs.len, qstring_find_in(qs, qliteral("world"), 7, 4));
+    ASSERT_UINTEQ(7, qstring_find_in(qs, qliteral("world"), 7, 5));
+    ASSERT_UINTEQ(7, qstring_find_in(qs, qliteral("world"), 0, 1000));
+    ASSERT_UINTEQ(8, qstring_find_in(text, qliteral("traveller from"), 8, 14));
+    ASSERT_UINTEQ(text.len,
+        qstring_find_in(text, qliteral("traveller from"), 8, 13));
+
+    /* Haystacks long enough to use the vectorized search, with the match in
+     * the middle of a block, at the end of a block, and in the tail.
+     */
+    for (size_t pos = 0; pos < 150; pos += 7) {
+        qstring buf = qstring_repeat('a', 150);
+        buf.data[pos] = 'b';
+        ASSERT_UINTEQ(pos, qstring_find(buf, qliteral("b")));
+        if (pos > 0) {
+            ASSERT_UINTEQ(pos - 1, qstring_find(buf, qliteral("ab")));
+            ASSERT_UINTEQ(pos - 1, qstring_find(buf, qliteral("aba")));
+        }
+        if (pos >= 9) {
+            ASSERT_UINTEQ(pos - 9, qstring_find(buf, qliteral("aaaaaaaaab")));
+        }
+        ASSERT_UINTEQ(buf.len, qstring_find(buf, qliteral("bb")));
+        qstring_cleanup(buf);
+    }
+
+    /* Test qstring_rfind and qstring_rfind_in. */
+    ASSERT_UINTEQ(8, qstring_rfind(qs, qliteral("o")));
+    ASSERT_UINTEQ(7, qstring_rfind(qs, qliteral("world!")));
+    ASSERT_UINTEQ(0, qstring_rfind(qs, qliteral("Hello")));
+    ASSERT_UINTEQ(qs.len, qstring_rfind(qs, qliteral("World")));
+    ASSERT_UINTEQ(20, qstring_rfind(as, qliteral("aaaaaaaaab")));
+    ASSERT_UINTEQ(19, qstring_rfind(as, qliteral("aaaaaaaaaa")));
+    ASSERT_UINTEQ(8, qstring_rfind(text, qliteral("traveller from")));
+    ASSERT_UINTEQ(4, qstring_rfind_in(qs, qliteral("o"), 0, 8));
+    ASSERT_UINTEQ(qs.len, qstring_rfind_in(qs, qliteral("o"), 5, 3));
+    ASSERT_UINTEQ(qs.len, qstring_rfind_in(qs, qliteral("world"), 7, 4));
+    ASSERT_UINTEQ(7, qstring_rfind_in(qs, qliteral("world"), 7, 5));
+}
+
+void test_qpattern() {
+    qstring lines[] = {
+        qliteral("GET /index.html 200"),
+        qliteral("GET /api/v1/users 404 /api/v1/users"),
+        qliteral("POST /api/v1/users 200"),
+        qliteral(""),
+    };
+
+    /* A pattern long enough to use the shift tables. */
+    qstring needle = qstring_new("/api/v1/users");
+    qpattern p = qpattern_compile(needle);
+    qstring_cleanup(needle);
+
+    ASSERT_UINTEQ(lines[0].len, qstring_find_p(lines[0], &p));
+    ASSERT_UINTEQ(4, qstring_find_p(lines[1], &p));
+    ASSERT_UINTEQ(22, qstring_rfind_p(lines[1], &p));
+    ASSERT_UINTEQ(5, qstring_find_p(lines[2], &p));
+    ASSERT_UINTEQ(5, qstring_rfind_p(lines[2], &p));
+    ASSERT_UINTEQ(0, qstring_find_p(lines[3], &p));
+
+    ASSERT_UINTEQ(0, qstring_count_p(lines[0], &p));
+    ASSERT_UINTEQ(2, qstring_count_p(lines[1], &p));
+    ASSERT_UINTEQ(1, qstring_count_p(lines[2], &p));
+
+    qstring qs = qstring_replace_all_p(lines[1], &p, qliteral("/u"));
+    ASSERT_STREQ("GET /u 404 /u", qs.data);
+    ASSERT_UINTEQ(13, qs.len);
+    qstring_cleanup(qs);
+
+    qpattern_cleanup(&p);
+
+    /* A short pattern. */
+    p = qpattern_compile(qliteral("200"));
+
+    ASSERT_UINTEQ(16, qstring_find_p(lines[0], &p));
+    ASSERT_UINTEQ(lines[1].len, qstring_rfind_p(lines[1], &p));
+    ASSERT_UINTEQ(1, qstring_count_p(lines[2], &p));
+
+    qs = qstring_replace_all_p(lines[0], &p, qliteral("OK"));
+    ASSERT_STREQ("GET /index.html OK", qs.data);
+    qstring_cleanup(qs);
+
+    qpattern_cleanup(&p);
+
+    /* A long pattern whose first and last bytes are equal, which is searched
+       for with the shift tables even where SIMD is available. */
+    qstring hay = qliteral("status=ok status=error status=ok "
+        "status=errors status=ok status=errors");
+    needle = qliteral("status=errors status=ok status=errors");
+    ASSERT_UINTEQ(33, qstring_find(hay, needle));
+    ASSERT_UINTEQ(33, qstring_rfind(hay, needle));
+    ASSERT_UINTEQ(1, qstring_count(hay, needle));
+    p = qpattern_compile(needle);
+    ASSERT_UINTEQ(33, qstring_find_p(hay, &p));
+    ASSERT_UINTEQ(33, qstring_rfind_p(hay, &p));
+    ASSERT_UINTEQ(1, qstring_count_p(hay, &p));
+    ASSERT_UINTEQ(0, qstring_count_p(lines[1], &p));
+    qpattern_cleanup(&p);
 }
 
 void test_qstring_count() {
-    // TODO
+    ASSERT_UINTEQ(2, qstring_count(qliteral(helloworld), qliteral("o")));
+    ASSERT_UINTEQ(1, qstring_count(qliteral(helloworld), qliteral("world")));
+    ASSERT_UINTEQ(0, qstring_count(qliteral(helloworld), qliteral("World")));
+    ASSERT_UINTEQ(0, qstring_count(qliteral("ab"), qliteral("abc")));
+    ASSERT_UINTEQ(0, qstring_count(qliteral(""), qliteral("a")));
+
+    /* Occurrences are non-overlapping. */
+    ASSERT_UINTEQ(1, qstring_count(qliteral("aaa"), qliteral("aa")));
+    ASSERT_UINTEQ(2, qstring_count(qliteral("aaaa"), qliteral("aa")));
+    ASSERT_UINTEQ(2, qstring_count(qliteral("abab"), qliteral("ab")));
+
+    /* The empty string occurs at every index. */
+    ASSERT_UINTEQ(4, qstring_count(qliteral("abc"), qliteral("")));
+    ASSERT_UINTEQ(1, qstring_count(qliteral(""), qliteral("")));
+
+    /* Long needles. */
+    qstring text = qliteral("the quick brown fox; the quick brown dog");
+    ASSERT_UINTEQ(2, qstring_count(text, qliteral("the quick brown ")));
+    ASSERT_UINTEQ(1, qstring_count(text, qliteral("quick brown dog")));
+    ASSERT_UINTEQ(2,
+        qstring_count(qliteral("xyzxyzxyzxyzxyzx"), qliteral("xyzxyzx")));
+
+    /* Long enough to use the vectorized count. */
+    qstring buf = qstring_repeat('-', 100);
+    buf.data[0] = buf.data[31] = buf.data[32] = buf.data[99] = '+';
+    ASSERT_UINTEQ(4, qstring_count(buf, qliteral("+")));
+    ASSERT_UINTEQ(96, qstring_count(buf, qliteral("-")));
+    ASSERT_UINTEQ(1, qstring_count(buf, qliteral("++")));
+    ASSERT_UINTEQ(2, qstring_count(buf, qliteral("-+")));
+    qstring_cleanup(buf);
+}
+
+void test_qmatcher() {
+    qstring words[] = {
+        qliteral("he"), qliteral("she"), qliteral("his"), qliteral("hers"),
+    };
+    qmatcher m = qmatcher_compile(words, 4);
+    qstring qs = qliteral("ushers and his hens");
+
+    size_t pattern = 100;
+    ASSERT_UINTEQ(1, qstring_find_any(qs, &m, &pattern));
+    ASSERT_UINTEQ(1, pattern);
+    /* "he" is found first, but "hers" starts at the same index and is longer.
+     */
+    ASSERT_UINTEQ(0, qstring_find_any(qliteral("hers"), &m, &pattern));
+    ASSERT_UINTEQ(3, pattern);
+    ASSERT_UINTEQ(0, qstring_find_any(qliteral("hello"), &m, NULL));
+    ASSERT_UINTEQ(5, qstring_find_any(qliteral("abcde"), &m, &pattern));
+
+    size_t counts[4];
+    ASSERT_UINTEQ(5, qstring_count_any(qs, &m, counts));
+    ASSERT_UINTEQ(2, counts[0]);
+    ASSERT_UINTEQ(1, counts[1]);
+    ASSERT_UINTEQ(1, counts[2]);
+    ASSERT_UINTEQ(1, counts[3]);
+
+    /* "ushers" contains "she" and "he" ending at the same index, then "hers".
+     */
+    qmatcher_iter it = qmatcher_iter_new(&m, qliteral("ushers"));
+    qmatch match;
+    ASSERT(qmatcher_next(&it, &match));
+    ASSERT_UINTEQ(1, match.pattern);
+    ASSERT_UINTEQ(1, match.index);
+    ASSERT_UINTEQ(3, match.len);
+    ASSERT(qmatcher_next(&it, &match));
+    ASSERT_UINTEQ(0, match.pattern);
+    ASSERT_UINTEQ(2, match.index);
+    ASSERT(qmatcher_next(&it, &match));
+    ASSERT_UINTEQ(3, match.pattern);
+    ASSERT_UINTEQ(2, match.index);
+    ASSERT(!qmatcher_next(&it, &match));
+    ASSERT(!qmatcher_next(&it, &match));
+
+    qmatcher_cleanup(&m);
+
+    /* The leftmost match wins even though another one ends before it. */
+    qstring nested[] = {qliteral("abcd"), qliteral("bc")};
+    m = qmatcher_compile(nested, 2);
+    ASSERT_UINTEQ(0, qstring_find_any(qliteral("abcd"), &m, &pattern));
+    ASSERT_UINTEQ(0, pattern);
+    ASSERT_UINTEQ(1, qstring_find_any(qliteral("abce"), &m, &pattern));
+    ASSERT_UINTEQ(1, pattern);
+    qmatcher_cleanup(&m);
+
+    /* Needles containing every byte value, null bytes, duplicates and an empty
+     * needle.
+     */
+    char all[256];
+    for (size_t i = 0; i < 256; i++) {
+        all[i] = i;
+    }
+    qstring binwords[] = {
+        {.len = 256, .data = all},
+        {.len = 2, .data = all + 254},
+        qliteral(""),
+        {.len = 2, .data = all + 254},
+    };
+    m = qmatcher_compile(binwords, 4);
+    qstring binqs = {.len = 256, .data = all};
+    /* The match that starts first is found. */
+    ASSERT_UINTEQ(0, qstring_find_any(binqs, &m, &pattern));
+    ASSERT_UINTEQ(0, pattern);
+    size_t bincounts[4];
+    ASSERT_UINTEQ(2, qstring_count_any(binqs, &m, bincounts));
+    ASSERT_UINTEQ(1, bincounts[0]);
+    ASSERT_UINTEQ(1, bincounts[1]);
+    ASSERT_UINTEQ(0, bincounts[2]);
+    ASSERT_UINTEQ(0, bincounts[3]);
+    qmatcher_cleanup(&m);
+
+    /* A matcher with no needles never matches. */
+    m = qmatcher_compile(NULL, 0);
+    ASSERT_UINTEQ(qs.len, qstring_find_any(qs, &m, NULL));
+    qmatcher_cleanup(&m);
 }
 
 void test_qstring_startswith_endswith() {
@@ -226,6 +643,45 @@ void test_qstring_startswith_endswith() {
     ASSERT(!qstring_endswith(qs, qliteral("world")));
 }
 
+void test_qstring_case_insensitive() {
+    qstring qs = qliteral(helloworld);
+
+    ASSERT(qstring_equals_ci(qs, qliteral("hELLO, WORLD!")));
+    ASSERT(!qstring_equals_ci(qs, qliteral("hELLO, WORLD?")));
+    ASSERT(!qstring_equals_ci(qs, qliteral("hello")));
+    ASSERT(qstring_startswith_ci(qs, qliteral("HELLO")));
+    ASSERT(!qstring_startswith_ci(qs, qliteral("ELLO")));
+    ASSERT(qstring_endswith_ci(qs, qliteral("WORLD!")));
+    /* Only letters are folded: '@' and '`' are 0x20 away from letters. */
+    ASSERT(!qstring_equals_ci(qliteral("@[`{"), qliteral("`{@[")));
+
+    ASSERT_UINTEQ(7, qstring_find_ci(qs, qliteral("WoRlD")));
+    ASSERT_UINTEQ(4, qstring_find_ci(qs, qliteral("O")));
+    ASSERT_UINTEQ(0, qstring_find_ci(qs, qliteral("")));
+    ASSERT_UINTEQ(qs.len, qstring_find_ci(qs, qliteral("worlds")));
+    ASSERT_UINTEQ(2, qstring_count_ci(qs, qliteral("o")));
+    ASSERT_UINTEQ(3, qstring_count_ci(qs, qliteral("L")));
+    ASSERT_UINTEQ(qs.len + 1, qstring_count_ci(qs, qliteral("")));
+
+    /* Long enough for the vector kernels, with matches straddling blocks. */
+    qbuilder b = qbuilder_new();
+    for (size_t i = 0; i < 100; i++) {
+        qbuilder_append(&b, qliteral("xxxxxxxxxxxxxxxxxxxxxxxxxxxxxNeEdLe"));
+    }
+    qstring long_qs = qbuilder_finish(&b);
+    ASSERT_UINTEQ(29, qstring_find_ci(long_qs, qliteral("needle")));
+    ASSERT_UINTEQ(100, qstring_count_ci(long_qs, qliteral("NEEDLE")));
+    ASSERT_UINTEQ(100, qstring_count_ci(long_qs, qliteral("e")) / 3);
+    ASSERT(qstring_endswith_ci(long_qs, qliteral("XNEEDLE")));
+    qstring other = qstring_copy(long_qs);
+    other.data[3000] = 'y';
+    ASSERT(!qstring_equals_ci(long_qs, other));
+    other.data[3000] = 'X';
+    ASSERT(qstring_equals_ci(long_qs, other));
+    qstring_cleanup(other);
+    qstring_cleanup(long_qs);
+}
+
 void test_qstring_strip() {
     /* Test qstring_lstrip. */
     qstring qs = qstring_lstrip(qliteral("abababCCCab"), qliteral("ba"));
@@ -304,6 +760,863 @@ void test_qstring_strip() {
     ASSERT_CHAREQ('\0', qs.data[qs.len]);
 
     qstring_cleanup(qs);
+
+    /* Strip the empty string. */
+    qs = qstring_strip(qliteral(""), qliteral("ab"));
+
+    ASSERT_UINTEQ(0, qs.len);
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+
+    qstring_cleanup(qs);
+
+    /* Strip nothing. */
+    qs = qstring_strip(qliteral(" text "), qliteral(""));
+
+    ASSERT_STREQ(" text ", qs.data);
+
+    qstring_cleanup(qs);
+
+    /* Strip non-ASCII bytes and the null byte. */
+    qstring binset = {.len = 2, .data = "\xff\0"};
+    qstring binstr = {.len = 5, .data = "\0\xffx\xff\0"};
+    qs = qstring_strip(binstr, binset);
+
+    ASSERT_STREQ("x", qs.data);
+    ASSERT_UINTEQ(1, qs.len);
+
+    qstring_cleanup(qs);
+
+    /* Test the whitespace macros. */
+    qs = qstring_strip_ws(qliteral("\t  text\r\n"));
+
+    ASSERT_STREQ("text", qs.data);
+
+    qstring_cleanup(qs);
+}
+
+void test_qrange() {
+    qstring line = qliteral("  GET /index.html 200  ");
+    qrange r = qrange_new(line);
+
+    ASSERT(r.data == line.data);
+    ASSERT_UINTEQ(line.len, r.len);
+
+    /* Stripping and slicing don't copy. */
+    qrange stripped = qrange_strip_ws(r);
+    ASSERT(stripped.data == line.data + 2);
+    ASSERT_UINTEQ(19, stripped.len);
+    ASSERT(qrange_equals(stripped,
+        qrange_new(qliteral("GET /index.html 200"))));
+
+    ASSERT_UINTEQ(21, qrange_rstrip_ws(r).len);
+    ASSERT_UINTEQ(21, qrange_lstrip_ws(r).len);
+    ASSERT_UINTEQ(0, qrange_strip_ws(qrange_new(qliteral(" \t "))).len);
+    ASSERT_UINTEQ(0, qrange_strip_ws(qrange_new(qliteral(""))).len);
+
+    qrange method = qrange_substr(stripped, 0, 3);
+    ASSERT(method.data == stripped.data);
+    ASSERT(qrange_equals(method, qrange_new(qliteral("GET"))));
+    ASSERT(!qrange_equals(method, qrange_new(qliteral("GE"))));
+    ASSERT(!qrange_equals(method, qrange_new(qliteral("PUT"))));
+    ASSERT_UINTEQ(0, qrange_substr(stripped, 100, 5).len);
+    ASSERT_UINTEQ(3, qrange_substr(stripped, 16, 100).len);
+
+    /* Searches are relative to the start of the range. */
+    ASSERT_UINTEQ(4, qrange_find(stripped, qliteral("/")));
+    ASSERT_UINTEQ(10, qrange_rfind(stripped, qliteral(".")));
+    ASSERT_UINTEQ(stripped.len, qrange_find(stripped, qliteral("POST")));
+    ASSERT_UINTEQ(2, qrange_count(stripped, qliteral("0")));
+    ASSERT(qrange_startswith(stripped, qliteral("GET ")));
+    ASSERT(qrange_endswith(stripped, qliteral(" 200")));
+    ASSERT(!qrange_endswith(method, qliteral(" 200")));
+
+    /* The end of the range is respected even though the data goes on. */
+    ASSERT_UINTEQ(method.len, qrange_find(method, qliteral("/")));
+    ASSERT_UINTEQ(0, qrange_count(method, qliteral(" ")));
+
+    /* Views can be used as needles without copying. Here the needle "GE" is
+     * not followed by a null byte.
+     */
+    qstring ge = qliteral_range(qrange_substr(method, 0, 2));
+    ASSERT(ge.data == line.data + 2);
+    ASSERT_UINTEQ(2, ge.len);
+    ASSERT_UINTEQ(2, qstring_find(line, qliteral_range(stripped)));
+    ASSERT_UINTEQ(2, qstring_find(line, ge));
+    ASSERT_UINTEQ(1, qstring_count(line, ge));
+    ASSERT(qrange_startswith(stripped, ge));
+    ASSERT(!qrange_endswith(method, ge));
+    ASSERT_UINTEQ(1, qrange_strip(method, ge).len);
+
+    qpattern p = qpattern_compile(qliteral("index.html"));
+    ASSERT_UINTEQ(5, qrange_find_p(stripped, &p));
+    ASSERT_UINTEQ(5, qrange_rfind_p(stripped, &p));
+    ASSERT_UINTEQ(1, qrange_count_p(stripped, &p));
+    ASSERT_UINTEQ(method.len, qrange_find_p(method, &p));
+    qpattern_cleanup(&p);
+
+    qstring words[] = {qliteral("200"), qliteral("html")};
+    qmatcher m = qmatcher_compile(words, 2);
+    size_t pattern;
+    ASSERT_UINTEQ(11, qrange_find_any(stripped, &m, &pattern));
+    ASSERT_UINTEQ(1, pattern);
+    qmatcher_cleanup(&m);
+
+    /* Materializing a range makes a null-terminated copy. */
+    qstring qs = qrange_to_qstring(method);
+    ASSERT_STREQ("GET", qs.data);
+    ASSERT_UINTEQ(3, qs.len);
+    qstring_cleanup(qs);
+}
+
+/* Return true if the fields produced by `it` are the strings in `expected`,
+ * which ends with NULL.
+ */
+static bool split_matches(qsplit it, const char** expected) {
+    qrange field;
+    while (qsplit_next(&it, &field)) {
+        if (*expected == NULL ||
+                !qrange_equals(field, qrange_new(qliteral(*expected)))) {
+            return false;
+        }
+        expected++;
+    }
+    return *expected == NULL;
+}
+
+void test_qsplit() {
+    qrange csv = qrange_new(qliteral("a,bb,,ccc,"));
+    qsplit it = qsplit_char(csv, ',', 0);
+    qrange field;
+
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT(qrange_equals(field, qrange_new(qliteral("a"))));
+    ASSERT(field.data == csv.data);
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT(qrange_equals(field, qrange_new(qliteral("bb"))));
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT_UINTEQ(0, field.len);
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT(qrange_equals(field, qrange_new(qliteral("ccc"))));
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT_UINTEQ(0, field.len);
+    ASSERT(!qsplit_next(&it, &field));
+    ASSERT(!qsplit_next(&it, &field));
+
+    /* No delimiters, and the empty string. */
+    it = qsplit_char(qrange_new(qliteral("abc")), ',', 0);
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT_UINTEQ(3, field.len);
+    ASSERT(!qsplit_next(&it, &field));
+    it = qsplit_char(qrange_new(qliteral("")), ',', 0);
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT_UINTEQ(0, field.len);
+    ASSERT(!qsplit_next(&it, &field));
+
+    /* Maximum number of splits. */
+    it = qsplit_char(csv, ',', 2);
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT(qsplit_next(&it, &field));
+    ASSERT(qrange_equals(field, qrange_new(qliteral(",ccc,"))));
+    ASSERT(!qsplit_next(&it, &field));
+
+    /* A line long enough to use the vectorized path, with delimiters at the
+     * edges of the blocks.
+     */
+    qstring buf = qstring_repeat('x', 100);
+    size_t delims[] = {0, 15, 16, 31, 32, 33, 63, 64, 95, 99};
+    for (size_t i = 0; i < sizeof delims / sizeof delims[0]; i++) {
+        buf.data[delims[i]] = '|';
+    }
+    it = qsplit_char(qrange_new(buf), '|', 0);
+    size_t nfields = 0;
+    size_t total = 0;
+    size_t prev = 0;
+    bool ok = true;
+    while (qsplit_next(&it, &field)) {
+        ok = ok && field.data == buf.data + prev;
+        if (nfields < sizeof delims / sizeof delims[0]) {
+            ok = ok && field.len == delims[nfields] - prev;
+            prev = delims[nfields] + 1;
+        }
+        total += field.len;
+        nfields++;
+    }
+    ASSERT(ok);
+    ASSERT_UINTEQ(11, nfields);
+    ASSERT_UINTEQ(90, total);
+    qstring_cleanup(buf);
+
+    /* Split on a multi-byte delimiter. */
+    const char* expected1[] = {"a", "b", "", "c", NULL};
+    ASSERT(split_matches(qsplit_str(qrange_new(qliteral("a::b::::c")),
+        qliteral("::"), 0), expected1));
+    const char* expected2[] = {"a", "b::c", NULL};
+    ASSERT(split_matches(qsplit_str(qrange_new(qliteral("a::b::c")),
+        qliteral("::"), 1), expected2));
+    const char* expected3[] = {"a::b", NULL};
+    ASSERT(split_matches(qsplit_str(qrange_new(qliteral("a::b")),
+        qliteral(""), 0), expected3));
+
+    /* Split on runs of whitespace. */
+    const char* expected4[] = {"GET", "/", "200", NULL};
+    ASSERT(split_matches(qsplit_ws(qrange_new(qliteral(" \tGET  /  200\n")), 0),
+        expected4));
+    const char* expected5[] = {"a", "b  c ", NULL};
+    ASSERT(split_matches(qsplit_ws(qrange_new(qliteral("  a b  c ")), 1),
+        expected5));
+    const char* expected6[] = {NULL};
+    ASSERT(split_matches(qsplit_ws(qrange_new(qliteral("   ")), 0),
+        expected6));
+    const char* expected7[] = {"k", "v", "x", "y", NULL};
+    ASSERT(split_matches(qsplit_any(qrange_new(qliteral("k=v;x=y")),
+        qliteral("=;"), 0), expected7));
+}
+
+void test_qbuilder() {
+    qbuilder b = qbuilder_new();
+
+    ASSERT_UINTEQ(0, b.len);
+    ASSERT(b.data == NULL);
+
+    ASSERT(qbuilder_append(&b, qliteral("Hello")));
+    ASSERT(qbuilder_append_char(&b, ','));
+    ASSERT(qbuilder_append_buffer(&b, " world!!!", 7));
+
+    ASSERT_STREQ(helloworld, b.data);
+    ASSERT_UINTEQ(13, b.len);
+    ASSERT(b.cap >= b.len);
+
+    ASSERT(qbuilder_append_format(&b, qliteral(" %d + %d = %s"), 1, 1, "2"));
+
+    ASSERT_STREQ("Hello, world! 1 + 1 = 2", b.data);
+    ASSERT_UINTEQ(23, b.len);
+
+    /* The finished qstring takes over the builder's buffer. */
+    char* data = b.data;
+    qstring qs = qbuilder_finish(&b);
+
+    ASSERT(qs.data == data);
+    ASSERT_STREQ("Hello, world! 1 + 1 = 2", qs.data);
+    ASSERT_UINTEQ(23, qs.len);
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+    ASSERT_UINTEQ(0, b.len);
+    ASSERT(b.data == NULL);
+
+    qstring_cleanup(qs);
+
+    /* Finishing an empty builder gives the empty string. */
+    qs = qbuilder_finish(&b);
+
+    ASSERT_UINTEQ(0, qs.len);
+    ASSERT_CHAREQ('\0', qs.data[qs.len]);
+
+    qstring_cleanup(qs);
+
+    /* Grow past the initial capacity many times, with null bytes. */
+    bool ok = true;
+    for (size_t i = 0; i < 1000; i++) {
+        ok = qbuilder_append_char(&b, i % 10 + '0') && ok;
+    }
+    ASSERT(ok);
+    ASSERT(qbuilder_append_buffer(&b, "\0x", 2));
+
+    ASSERT_UINTEQ(1002, b.len);
+    ASSERT_CHAREQ('0', b.data[0]);
+    ASSERT_CHAREQ('9', b.data[999]);
+    ASSERT_CHAREQ('\0', b.data[1000]);
+    ASSERT_CHAREQ('x', b.data[1001]);
+    ASSERT_CHAREQ('\0', b.data[1002]);
+
+    /* Format output that doesn't fit in the spare capacity. */
+    ASSERT(qbuilder_shrink(&b));
+    ASSERT_UINTEQ(1002, b.cap);
+    ASSERT(qbuilder_append_format(&b, qliteral("%s"), helloworld));
+    ASSERT_UINTEQ(1015, b.len);
+    ASSERT_STREQ(helloworld, b.data + 1002);
+
+    /* Clearing keeps the capacity. */
+    size_t cap = b.cap;
+    qbuilder_clear(&b);
+
+    ASSERT_UINTEQ(0, b.len);
+    ASSERT_UINTEQ(cap, b.cap);
+    ASSERT_STREQ("", b.data);
+
+    ASSERT(qbuilder_reserve(&b, 5000));
+    ASSERT(b.cap >= 5000);
+
+    qbuilder_cleanup(&b);
+}
+
+static bool rope_equals(const qrope* r, qstring expected) {
+    qstring flat = qrope_to_qstring(r);
+    bool ret = r->len == expected.len && flat.len == expected.len &&
+        memcmp(flat.data, expected.data, flat.len) == 0;
+    qstring_cleanup(flat);
+    return ret;
+}
+
+void test_qrope() {
+    qrope r = qrope_new();
+    ASSERT_UINTEQ(0, r.len);
+    ASSERT(rope_equals(&r, qliteral("")));
+    ASSERT_UINTEQ(0, qrope_find(&r, qliteral("a")));
+    ASSERT(qrope_insert(&r, 0, qliteral("world")));
+    ASSERT(qrope_insert(&r, 0, qliteral("Hello, ")));
+    ASSERT(qrope_insert(&r, 100, qliteral("!")));
+    ASSERT(rope_equals(&r, qliteral("Hello, world!")));
+    ASSERT_UINTEQ(7, qrope_find(&r, qliteral("world")));
+    ASSERT_UINTEQ(r.len, qrope_find(&r, qliteral("World")));
+    ASSERT_UINTEQ(0, qrope_find(&r, qliteral("")));
+
+    ASSERT(qrope_remove(&r, 5, 2));
+    ASSERT(qrope_remove(&r, 10, 100));
+    ASSERT(qrope_remove(&r, 100, 1));
+    ASSERT(rope_equals(&r, qliteral("Helloworld")));
+
+    qstring sub = qrope_substr(&r, 3, 4);
+    ASSERT_STREQ("lowo", sub.data);
+    qstring_cleanup(sub);
+    sub = qrope_substr(&r, 8, 100);
+    ASSERT_STREQ("ld", sub.data);
+    qstring_cleanup(sub);
+    sub = qrope_substr(&r, 100, 1);
+    ASSERT_STREQ("", sub.data);
+    qstring_cleanup(sub);
+
+    /* Concatenating moves the chunks. */
+    qrope other = qrope_from_qstring(qliteral(" and more"));
+    qrope_concat(&r, &other);
+    ASSERT_UINTEQ(0, other.len);
+    ASSERT(rope_equals(&r, qliteral("Helloworld and more")));
+    qrope_cleanup(&other);
+    qrope_cleanup(&r);
+    ASSERT_UINTEQ(0, r.len);
+
+    /* A match that spans many chunks, each shorter than the datum. */
+    qstring big = qstring_repeat('a', 5 * QROPE_CHUNK);
+    r = qrope_from_qstring(big);
+    for (size_t i = 1; i < 20; i++) {
+        ASSERT(qrope_remove(&r, i * 30, 1));
+    }
+    ASSERT(qrope_insert(&r, 4000, qliteral("b")));
+    qrope tail = qrope_new();
+    const char* pieces[] = {"x", "y", "zz", "y", "x"};
+    for (size_t i = 0; i < 5; i++) {
+        qrope piece = qrope_from_qstring(qliteral(pieces[i]));
+        qrope_concat(&tail, &piece);
+    }
+    qrope_concat(&r, &tail);
+    ASSERT_UINTEQ(r.len - 6, qrope_find(&r, qliteral("xyzzyx")));
+    ASSERT_UINTEQ(4000 - 2, qrope_find(&r, qliteral("aab")));
+    ASSERT_UINTEQ(r.len, qrope_find(&r, qliteral("aabb")));
+    qrope_cleanup(&r);
+
+    /* Concatenating many small ropes keeps the tree balanced. */
+    r = qrope_new();
+    for (size_t i = 0; i < 10000; i++) {
+        qrope piece = qrope_from_qstring(qliteral((i % 2 == 0) ? "ab" : "c"));
+        qrope_concat(&r, &piece);
+    }
+    ASSERT_UINTEQ(15000, r.len);
+    ASSERT_UINTEQ(2, qrope_find(&r, qliteral("cabc")));
+    /* 14 is the base-2 logarithm of 10000, rounded up. */
+    ASSERT(qrope_depth(&r) <= 4 * 14);
+    qrope_cleanup(&r);
+
+    /* Random edits, checked against the same edits to a qstring. */
+    qstring expected = qstring_copy(big);
+    r = qrope_from_qstring(big);
+    uint64_t seed = 12345;
+    bool ok = true;
+    for (size_t i = 0; i < 3000 && ok; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        size_t at = (seed >> 33) % (expected.len + 1);
+        size_t n = (seed >> 20) % ((i % 7 == 0) ? 2 * QROPE_CHUNK : 40);
+        qstring next;
+        if ((seed >> 60) % 2 == 0) {
+            qstring text = qstring_repeat('a' + i % 26, n);
+            ok = ok && qrope_insert(&r, at, text);
+            qstring before = qstring_substr(expected, 0, at);
+            qstring after = qstring_substr(expected, at, expected.len);
+            qstring joined = qstring_concat(before, text);
+            next = qstring_concat(joined, after);
+            qstring_cleanup(before);
+            qstring_cleanup(after);
+            qstring_cleanup(joined);
+            qstring_cleanup(text);
+        } else {
+            ok = ok && qrope_remove(&r, at, n);
+            next = qstring_remove(expected, at, n);
+        }
+        qstring_cleanup(expected);
+        expected = next;
+        if (i % 100 == 0) {
+            ok = ok && rope_equals(&r, expected);
+            qstring datum = qstring_substr(expected, at, 1 + i % 50);
+            ok = ok && qrope_find(&r, datum) == qstring_find(expected, datum);
+            qstring_cleanup(datum);
+        }
+    }
+    ASSERT(ok);
+    ASSERT(rope_equals(&r, expected));
+    qstring_cleanup(expected);
+    qstring_cleanup(big);
+    qrope_cleanup(&r);
+}
+
+static void* copy_and_cleanup(void* arg) {
+    qshared* qs = arg;
+    for (int i = 0; i < 10000; i++) {
+        qshared copy = qshared_copy(*qs);
+        qshared sub = qshared_substr(copy, 1, 3);
+        qshared_cleanup(copy);
+        qshared_cleanup(sub);
+    }
+    return NULL;
+}
+
+void test_qshared() {
+    qshared qs = qshared_new("Hello, world");
+    ASSERT_UINTEQ(12, qs.len);
+    ASSERT_STREQ("Hello, world", qs.data);
+    ASSERT_UINTEQ(1, qshared_refcount(qs));
+
+    /* Copies and substrings share the buffer. */
+    qshared copy = qshared_copy(qs);
+    ASSERT(copy.data == qs.data);
+    qshared hello = qshared_substr(qs, 0, 5);
+    ASSERT(hello.data == qs.data);
+    ASSERT_UINTEQ(5, hello.len);
+    qshared world = qshared_substr(qs, 7, 100);
+    ASSERT(world.data == qs.data + 7);
+    ASSERT_UINTEQ(5, world.len);
+    ASSERT_STREQ("world", world.data);
+    qshared empty = qshared_substr(qs, 100, 5);
+    ASSERT_UINTEQ(0, empty.len);
+    ASSERT_UINTEQ(5, qshared_refcount(qs));
+    ASSERT(qrange_equals(qshared_range(hello), qrange_new(qliteral("Hello"))));
+
+    /* The buffer outlives the qshared that it was created with. */
+    qshared_cleanup(qs);
+    qshared_cleanup(copy);
+    ASSERT_UINTEQ(3, qshared_refcount(hello));
+    qstring flat = qshared_to_qstring(hello);
+    ASSERT_STREQ("Hello", flat.data);
+    qstring_cleanup(flat);
+    qshared_cleanup(hello);
+    qshared_cleanup(empty);
+    ASSERT_UINTEQ(1, qshared_refcount(world));
+    qshared_cleanup(world);
+
+    /* Removals at either end and replacements without a match share. */
+    qs = qshared_adopt(qstring_new("abcabc"));
+    ASSERT_STREQ("abcabc", qs.data);
+    qshared r = qshared_remove(qs, 0, 2);
+    ASSERT(r.data == qs.data + 2);
+    ASSERT(qrange_equals(qshared_range(r), qrange_new(qliteral("cabc"))));
+    qshared_cleanup(r);
+    r = qshared_remove(qs, 4, 10);
+    ASSERT(r.data == qs.data);
+    ASSERT(qrange_equals(qshared_range(r), qrange_new(qliteral("abca"))));
+    qshared_cleanup(r);
+    r = qshared_remove(qs, 6, 1);
+    ASSERT(r.data == qs.data);
+    ASSERT_UINTEQ(6, r.len);
+    qshared_cleanup(r);
+    r = qshared_remove(qs, 1, 4);
+    ASSERT(r.data != qs.data);
+    ASSERT_STREQ("ac", r.data);
+    qshared_cleanup(r);
+
+    r = qshared_replace_all(qs, qliteral("x"), qliteral("y"));
+    ASSERT(r.data == qs.data);
+    qshared_cleanup(r);
+    r = qshared_replace_first(qs, qliteral("x"), qliteral("y"));
+    ASSERT(r.data == qs.data);
+    qshared_cleanup(r);
+    r = qshared_replace_last(qs, qliteral("x"), qliteral("y"));
+    ASSERT(r.data == qs.data);
+    qshared_cleanup(r);
+    r = qshared_replace_all(qs, qliteral("b"), qliteral("BB"));
+    ASSERT_STREQ("aBBcaBBc", r.data);
+    qshared_cleanup(r);
+    r = qshared_replace_first(qs, qliteral("b"), qliteral(""));
+    ASSERT_STREQ("acabc", r.data);
+    qshared_cleanup(r);
+    r = qshared_replace_last(qs, qliteral("b"), qliteral(""));
+    ASSERT_STREQ("abcac", r.data);
+    qshared_cleanup(r);
+    r = qshared_replace_all(qs, qliteral(""), qliteral("-"));
+    ASSERT_STREQ("-a-b-c-a-b-c-", r.data);
+    qshared_cleanup(r);
+
+    /* Replacing within a substring only looks at the substring. */
+    qshared sub = qshared_substr(qs, 0, 2);
+    r = qshared_replace_all(sub, qliteral("c"), qliteral("!"));
+    ASSERT(r.data == sub.data);
+    ASSERT_UINTEQ(2, r.len);
+    qshared_cleanup(r);
+    qshared_cleanup(sub);
+    ASSERT_UINTEQ(1, qshared_refcount(qs));
+
+    /* Removing from the middle of a substring that stops short of the end of
+     * its buffer still gives a null-terminated result.
+     */
+    qshared whole = qshared_new("abcdefXYZ");
+    sub = qshared_substr(whole, 0, 6);
+    r = qshared_remove(sub, 2, 2);
+    ASSERT_STREQ("abef", r.data);
+    ASSERT_UINTEQ(4, r.len);
+    ASSERT_UINTEQ(4, strlen(r.data));
+    qshared_cleanup(r);
+    qshared_cleanup(sub);
+    qshared_cleanup(whole);
+
+    /* Copies and cleanups from several threads at once. */
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, copy_and_cleanup, &qs);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    ASSERT_UINTEQ(1, qshared_refcount(qs));
+    qshared_cleanup(qs);
+
+    /* Failed qshareds can be copied and cleaned up. */
+    qstring none = {.len = 0, .data = NULL};
+    qs = qshared_adopt(none);
+    ASSERT(qs.data == NULL);
+    ASSERT_UINTEQ(0, qshared_refcount(qs));
+    copy = qshared_copy(qs);
+    ASSERT(copy.data == NULL);
+    qshared_cleanup(copy);
+    qshared_cleanup(qs);
+}
+
+void test_qhash() {
+    /* The hash of each length class, which every implementation must agree
+       on. */
+    char buffer[5000];
+    for (size_t i = 0; i < sizeof buffer; i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+    ASSERT(qhash(buffer, 0) == 0x9b2c3138da306a31ull);
+    ASSERT(qhash(buffer, 1) == 0x4c9a403b853257ceull);
+    ASSERT(qhash(buffer, 3) == 0x4b192cd2ae98ef91ull);
+    ASSERT(qhash(buffer, 4) == 0x45d40303c5f9f939ull);
+    ASSERT(qhash(buffer, 8) == 0x992eb3406545b58aull);
+    ASSERT(qhash(buffer, 9) == 0xc9f1eca51eba7d86ull);
+    ASSERT(qhash(buffer, 16) == 0x9ba51d588f471a3dull);
+    ASSERT(qhash(buffer, 17) == 0x68f0a47215193e5aull);
+    ASSERT(qhash(buffer, 100) == 0x56cfd718c91052f5ull);
+    ASSERT(qhash(buffer, 128) == 0x64b4a7d8557d8bafull);
+    ASSERT(qhash(buffer, 129) == 0xd3b6391bf7e0b2f1ull);
+    ASSERT(qhash(buffer, 1000) == 0x67398a398c0d9d9full);
+    ASSERT(qhash(buffer, 5000) == 0x0a0aa053df1ea04eull);
+
+    /* The hash depends only on the bytes, not on where they are. */
+    qstring qs = qstring_new_buffer(buffer + 3, 1000);
+    ASSERT(qstring_hash(qs) == qhash(buffer + 3, 1000));
+    ASSERT(qrange_hash(qrange_new(qs)) == qstring_hash(qs));
+    qstring_cleanup(qs);
+
+    /* Changing any one byte changes the hash. */
+    size_t lens[] = {3, 7, 12, 40, 300, 1000};
+    bool all_differ = true;
+    for (size_t j = 0; j < sizeof lens / sizeof lens[0]; j++) {
+        uint64_t h = qhash(buffer, lens[j]);
+        for (size_t i = 0; i < lens[j]; i++) {
+            buffer[i] ^= 1;
+            all_differ = all_differ && qhash(buffer, lens[j]) != h;
+            buffer[i] ^= 1;
+        }
+    }
+    ASSERT(all_differ);
+    ASSERT(qhash("a", 1) != qhash("a\0", 2));
+    ASSERT(qhash("", 0) != qhash("\0", 1));
+}
+
+void test_qmap() {
+    qmap m = qmap_new();
+    void* value = NULL;
+    ASSERT_UINTEQ(0, m.len);
+    ASSERT(!qmap_get(&m, qliteral("a"), &value));
+    ASSERT(!qmap_remove(&m, qliteral("a")));
+
+    int one = 1, two = 2, three = 3;
+    ASSERT(qmap_set(&m, qliteral("one"), &one));
+    ASSERT(qmap_set(&m, qliteral("two"), &two));
+    ASSERT(qmap_set(&m, qliteral(""), &three));
+    ASSERT_UINTEQ(3, m.len);
+    ASSERT(qmap_get(&m, qliteral("one"), &value) && value == &one);
+    ASSERT(qmap_get(&m, qliteral("two"), &value) && value == &two);
+    ASSERT(qmap_get(&m, qliteral(""), &value) && value == &three);
+    ASSERT(qmap_get(&m, qliteral("one"), NULL));
+    ASSERT(!qmap_get(&m, qliteral("on"), NULL));
+
+    /* Keys are compared by contents. */
+    qstring key = qstring_new("two");
+    ASSERT(qmap_set(&m, key, &one));
+    ASSERT_UINTEQ(3, m.len);
+    ASSERT(qmap_get_h(&m, key, qstring_hash(key), &value) && value == &one);
+    qstring_cleanup(key);
+
+    ASSERT(qmap_remove(&m, qliteral("two")));
+    ASSERT(!qmap_remove(&m, qliteral("two")));
+    ASSERT(!qmap_get(&m, qliteral("two"), NULL));
+    ASSERT_UINTEQ(2, m.len);
+    qmap_cleanup(&m);
+    ASSERT_UINTEQ(0, m.len);
+
+    /* Enough keys to grow the table many times, with removals in between. */
+    qarena arena = qarena_new(0);
+    const size_t nkeys = 21000;
+    qstring* keys = malloc(nkeys * sizeof *keys);
+    for (size_t i = 0; i < nkeys; i++) {
+        keys[i] = qstring_format_a(&arena, qliteral("key-%zu"), i);
+    }
+    m = qmap_new();
+    bool ok = true;
+    for (size_t i = 0; i < nkeys; i++) {
+        ok = ok && qmap_set(&m, keys[i], &keys[i]);
+        if (i % 3 == 2) {
+            ok = ok && qmap_remove_h(&m, keys[i - 1],
+                qstring_hash(keys[i - 1]));
+        }
+    }
+    ASSERT(ok);
+    ASSERT_UINTEQ(nkeys - nkeys / 3, m.len);
+    for (size_t i = 0; i < nkeys; i++) {
+        bool found = qmap_get(&m, keys[i], &value);
+        ok = ok && found == (i % 3 != 1) && (!found || value == &keys[i]);
+    }
+    ASSERT(ok);
+
+    /* Iteration sees every entry once. */
+    size_t it = 0, n = 0;
+    qstring k;
+    while (qmap_next(&m, &it, &k, &value)) {
+        ok = ok && value != NULL &&
+            qrange_equals(qrange_new(k), qrange_new(*(qstring*)value));
+        n++;
+    }
+    ASSERT(ok);
+    ASSERT_UINTEQ(m.len, n);
+
+    /* Repeatedly inserting and removing keeps working when deleted slots,
+       rather than keys, fill the table. */
+    qmap_cleanup(&m);
+    for (size_t i = 0; i < nkeys; i++) {
+        ok = ok && qmap_set(&m, keys[i], NULL) && qmap_remove(&m, keys[i]);
+    }
+    ASSERT(ok);
+    ASSERT_UINTEQ(0, m.len);
+    ASSERT(!qmap_get(&m, keys[0], NULL));
+    qmap_cleanup(&m);
+    free(keys);
+    qarena_cleanup(&arena);
+}
+
+static void* intern_numbers(void* arg) {
+    qintern* pool = arg;
+    char buffer[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(buffer, sizeof buffer, "host-%d", i);
+        qintern_add(pool, qliteral(buffer));
+    }
+    return NULL;
+}
+
+void test_qintern() {
+    qintern* pool = qintern_new();
+    ASSERT(pool != NULL);
+    ASSERT_UINTEQ(0, qintern_size(pool));
+    ASSERT(qintern_find(pool, qliteral("GET")).data == NULL);
+
+    /* Equal strings from anywhere have the same canonical copy. */
+    qstring heap = qstring_new("GET");
+    qstring a = qintern_add(pool, heap);
+    ASSERT(a.data != heap.data);
+    ASSERT_STREQ("GET", a.data);
+    ASSERT_UINTEQ(3, a.len);
+    qstring b = qintern_add(pool, qliteral("GET"));
+    ASSERT(a.data == b.data);
+    qstring_cleanup(heap);
+    ASSERT(qintern_find(pool, qliteral("GET")).data == a.data);
+    ASSERT_UINTEQ(1, qintern_size(pool));
+
+    /* Literals can be their own canonical copies. */
+    const char* post = "POST";
+    qstring c = qintern_add_literal(pool, qliteral(post));
+    ASSERT(c.data == post);
+    heap = qstring_new("POST");
+    ASSERT(qintern_add(pool, heap).data == post);
+    qstring_cleanup(heap);
+    ASSERT(qintern_add_literal(pool, qliteral("GET")).data == a.data);
+
+    /* Prefixes, empty strings and embedded null bytes are distinct. */
+    qstring ge = qintern_add(pool, qliteral("GE"));
+    ASSERT(ge.data != a.data);
+    qstring empty = qintern_add(pool, qliteral(""));
+    ASSERT(empty.data != NULL);
+    ASSERT_UINTEQ(0, empty.len);
+    heap = qstring_new_buffer("GE\0", 3);
+    qstring nul = qintern_add(pool, heap);
+    ASSERT(nul.data != ge.data);
+    ASSERT_UINTEQ(3, nul.len);
+    ASSERT_UINTEQ(5, qintern_size(pool));
+    qstring_cleanup(heap);
+    qintern_cleanup(pool);
+
+    /* Enough strings to make every shard grow, added from several threads. */
+    pool = qintern_new();
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, intern_numbers, pool);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    ASSERT_UINTEQ(5000, qintern_size(pool));
+    bool all_found = true;
+    char buffer[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(buffer, sizeof buffer, "host-%d", i);
+        qstring found = qintern_find(pool, qliteral(buffer));
+        if (found.data == NULL || strcmp(found.data, buffer) != 0 ||
+                qintern_add(pool, qliteral(buffer)).data != found.data) {
+            all_found = false;
+        }
+    }
+    ASSERT(all_found);
+    ASSERT(qintern_find(pool, qliteral("host-5000")).data == NULL);
+    qintern_cleanup(pool);
+}
+
+void test_qsmall() {
+    qsmall s = qsmall_new("404");
+    ASSERT(qsmall_is_inline(&s));
+    ASSERT_UINTEQ(3, qsmall_len(&s));
+    ASSERT_STREQ("404", qsmall_data(&s));
+    ASSERT_UINTEQ(1, qstring_find(qsmall_view(&s), qliteral("0")));
+    qsmall_cleanup(&s);
+
+    /* The longest inline string, and the shortest heap string. */
+    qstring max_inline = qstring_repeat('a', QSMALL_INLINE_MAX);
+    s = qsmall_from_qstring(max_inline);
+    ASSERT(qsmall_is_inline(&s));
+    ASSERT_UINTEQ(QSMALL_INLINE_MAX, qsmall_len(&s));
+    ASSERT_STREQ(max_inline.data, qsmall_data(&s));
+
+    qstring min_heap = qstring_repeat('b', QSMALL_INLINE_MAX + 1);
+    qsmall t = qsmall_from_qstring(min_heap);
+    ASSERT(!qsmall_is_inline(&t));
+    ASSERT_UINTEQ(QSMALL_INLINE_MAX + 1, qsmall_len(&t));
+    ASSERT_STREQ(min_heap.data, qsmall_data(&t));
+    ASSERT(!qsmall_equals(&s, &t));
+
+    /* A copy of an inline qsmall has its own data. */
+    qsmall copy = s;
+    ASSERT(qsmall_data(&copy) != qsmall_data(&s));
+    ASSERT(qsmall_equals(&copy, &s));
+
+    qsmall_cleanup(&s);
+    qsmall_cleanup(&t);
+    qstring_cleanup(max_inline);
+    qstring_cleanup(min_heap);
+
+    /* Empty strings and embedded null bytes. */
+    s = qsmall_new("");
+    ASSERT(qsmall_is_inline(&s));
+    ASSERT_UINTEQ(0, qsmall_len(&s));
+    ASSERT_STREQ("", qsmall_data(&s));
+    t = qsmall_new_buffer("a\0b", 3);
+    ASSERT_UINTEQ(3, qsmall_len(&t));
+    ASSERT(memcmp("a\0b", qsmall_data(&t), 4) == 0);
+    qsmall_cleanup(&s);
+    qsmall_cleanup(&t);
+
+    ASSERT(sizeof(qsmall) == 3 * sizeof(char*));
+}
+
+void test_qarena() {
+    qarena arena = qarena_new(256);
+
+    /* Allocations are aligned and don't overlap. */
+    char* p1 = qarena_alloc(&arena, 3);
+    char* p2 = qarena_alloc(&arena, 10);
+    ASSERT(p1 != NULL && p2 != NULL);
+    ASSERT(p2 >= p1 + 3);
+    ASSERT_UINTEQ(0, (size_t)p2 % sizeof(void*));
+    memcpy(p1, "ab", 3);
+    memcpy(p2, "0123456789", 10);
+    ASSERT_STREQ("ab", p1);
+
+    /* The most recent allocation is extended in place. */
+    char* p3 = qarena_realloc(&arena, p2, 10, 40);
+    ASSERT(p3 == p2);
+    /* Any other allocation is copied. */
+    char* p4 = qarena_realloc(&arena, p1, 3, 5);
+    ASSERT(p4 != p1);
+    ASSERT_STREQ("ab", p4);
+
+    /* Large allocations get their own block. */
+    char* big = qarena_alloc(&arena, 10000);
+    ASSERT(big != NULL);
+    memset(big, 'x', 10000);
+    /* Filling many blocks. */
+    bool ok = true;
+    for (size_t i = 0; i < 100; i++) {
+        char* p = qarena_alloc(&arena, 50);
+        ok = ok && p != NULL;
+        if (p != NULL) {
+            memset(p, 'y', 50);
+        }
+    }
+    ASSERT(ok);
+
+    qarena_reset(&arena);
+    ASSERT(qarena_alloc(&arena, 10) != NULL);
+
+    /* Test the qstring functions that allocate from an arena. */
+    qstring qs = qstring_new_a(&arena, helloworld);
+
+    ASSERT_STREQ(helloworld, qs.data);
+    ASSERT(qs.data != helloworld);
+
+    qstring sub = qstring_substr_a(&arena, qs, 7, 5);
+    ASSERT_STREQ("world", sub.data);
+    ASSERT_UINTEQ(5, sub.len);
+
+    qstring cat = qstring_concat_a(&arena, sub, qliteral("wide"));
+    ASSERT_STREQ("worldwide", cat.data);
+
+    qstring fmt = qstring_format_a(&arena, qliteral("%s-%d"), "x", 42);
+    ASSERT_STREQ("x-42", fmt.data);
+    ASSERT_UINTEQ(4, fmt.len);
+
+    qstring rem = qstring_remove_a(&arena, qs, 5, 7);
+    ASSERT_STREQ("Hello!", rem.data);
+
+    qstring rep = qstring_replace_all_a(&arena, qs, qliteral("o"),
+        qliteral("0"));
+    ASSERT_STREQ("Hell0, w0rld!", rep.data);
+    rep = qstring_replace_first_a(&arena, qs, qliteral("o"), qliteral("0"));
+    ASSERT_STREQ("Hell0, world!", rep.data);
+    rep = qstring_replace_last_a(&arena, qs, qliteral("o"), qliteral("0"));
+    ASSERT_STREQ("Hello, w0rld!", rep.data);
+    qstring befores[] = {qliteral("Hello"), qliteral("world")};
+    qstring afters[] = {qliteral("Goodbye"), qliteral("moon")};
+    rep = qstring_replace_many_a(&arena, qs, befores, afters, 2);
+    ASSERT_STREQ("Goodbye, moon!", rep.data);
+
+    qstring file = qio_readpath_qs_a(&arena, "assets/smallfile.txt");
+    ASSERT_STREQ("A small file.\n", file.data);
+
+    qarena_cleanup(&arena);
 }
 
 void test_qio_readpath() {
@@ -322,10 +1635,762 @@ void test_qio_readpath() {
     data = qio_readpath("assets/kern_utf8.txt", &n);
     ASSERT_UINTEQ(1144, n);
     free(data);
+
+    /* Files that can't be read. */
+    ASSERT(qio_readpath("assets/no_such_file.txt", &n) == NULL);
+    ASSERT(qio_readpath("assets", &n) == NULL);
+
+    /* A device with no contents. */
+    data = qio_readpath("/dev/null", &n);
+    ASSERT(data != NULL);
+    ASSERT_UINTEQ(0, n);
+    free(data);
+
+    /* A /proc file reports a size of zero but has contents. */
+    data = qio_readpath("/proc/self/status", &n);
+    ASSERT(data != NULL);
+    ASSERT(n > 0);
+    ASSERT_UINTEQ(n, strlen(data));
+    free(data);
+
+    /* A file read into an arena. */
+    qarena arena = qarena_new(64);
+    qstring qs = qio_readpath_qs_a(&arena, "assets/ozymandias.txt");
+    ASSERT_UINTEQ(627, qs.len);
+    ASSERT(qstring_startswith(qs, qliteral("I met a traveller")));
+    qs = qio_readpath_qs_a(&arena, "/proc/self/status");
+    ASSERT(qs.len > 0);
+    qarena_cleanup(&arena);
+}
+
+void test_qio_mappath() {
+    qio_mapping m = qio_mappath("assets/smallfile.txt");
+
+    ASSERT(m.data.data != NULL);
+    ASSERT(qrange_equals(m.data, qrange_new(qliteral("A small file.\n"))));
+
+    qio_unmap(&m);
+    ASSERT(m.data.data == NULL);
+
+    m = qio_mappath("assets/kern_utf8.txt");
+    ASSERT_UINTEQ(1144, m.data.len);
+    qio_unmap(&m);
+
+    /* Files that can't be mapped are read instead. */
+    m = qio_mappath("/proc/self/status");
+    ASSERT(m.data.data != NULL);
+    ASSERT(qrange_startswith(m.data, qliteral("Name:")));
+    qio_unmap(&m);
+
+    m = qio_mappath("/dev/null");
+    ASSERT(m.data.data != NULL);
+    ASSERT_UINTEQ(0, m.data.len);
+    qio_unmap(&m);
+
+    m = qio_mappath("assets/does_not_exist.txt");
+    ASSERT(m.data.data == NULL);
+    qio_unmap(&m);
 }
 
 void test_qio_readline() {
-    // TODO
+    FILE* fp = fopen("assets/ozymandias.txt", "r");
+    qstring qs = qio_readline_qs(fp);
+
+    ASSERT_STREQ("I met a traveller from an antique land,", qs.data);
+    ASSERT_UINTEQ(39, qs.len);
+
+    qstring_cleanup(qs);
+
+    /* Read lines into an arena. */
+    qarena arena = qarena_new(64);
+    qs = qio_readline_qs_a(&arena, fp);
+
+    ASSERT_STREQ("Who said: Two vast and trunkless legs of stone", qs.data);
+
+    qs = qio_readline_qs_a(&arena, fp);
+
+    ASSERT_STREQ("Stand in the desert... near them, on the sand", qs.data);
+
+    qarena_cleanup(&arena);
+    fclose(fp);
+}
+
+void test_qio_getline() {
+    FILE* fp = fopen("assets/ozymandias.txt", "r");
+    char* buffer = NULL;
+    size_t cap = 0;
+    size_t n;
+
+    ASSERT(qio_getline(fp, &buffer, &cap, &n));
+    ASSERT_STREQ("I met a traveller from an antique land,", buffer);
+    ASSERT_UINTEQ(39, n);
+    ASSERT(cap > n);
+
+    /* The buffer is reused once it is large enough. */
+    char* first = buffer;
+    ASSERT(qio_getline(fp, &buffer, &cap, &n));
+    ASSERT_STREQ("Who said: Two vast and trunkless legs of stone", buffer);
+    ASSERT(buffer == first);
+
+    size_t nlines = 2;
+    while (qio_getline(fp, &buffer, &cap, &n)) {
+        nlines++;
+    }
+    ASSERT_UINTEQ(15, nlines);
+    ASSERT_STREQ("The lone and level sands stretch far away.", buffer);
+    free(buffer);
+    fclose(fp);
+
+    /* Empty lines, a long line and a final line without a newline. */
+    fp = tmpfile();
+    qstring long_line = qstring_repeat('x', 1000);
+    fprintf(fp, "\n%s\nlast", long_line.data);
+    rewind(fp);
+    buffer = NULL;
+    cap = 0;
+
+    ASSERT(qio_getline(fp, &buffer, &cap, &n));
+    ASSERT_UINTEQ(0, n);
+    ASSERT_STREQ("", buffer);
+    ASSERT(qio_getline(fp, &buffer, &cap, &n));
+    ASSERT_UINTEQ(1000, n);
+    ASSERT_STREQ(long_line.data, buffer);
+    ASSERT(qio_getline(fp, &buffer, &cap, &n));
+    ASSERT_STREQ("last", buffer);
+    ASSERT(!qio_getline(fp, &buffer, &cap, &n));
+    /* The end of the file can be told apart from a failed allocation. */
+    ASSERT(feof(fp));
+
+    free(buffer);
+
+    /* The same file with the qstring variant. */
+    rewind(fp);
+    qbuilder b = qbuilder_new();
+    qstring line;
+
+    ASSERT(qio_getline_qs(fp, &b, &line));
+    ASSERT_UINTEQ(0, line.len);
+    ASSERT_STREQ("", line.data);
+    ASSERT(qio_getline_qs(fp, &b, &line));
+    ASSERT_UINTEQ(1000, line.len);
+    ASSERT_STREQ(long_line.data, line.data);
+    ASSERT(qio_getline_qs(fp, &b, &line));
+    ASSERT_UINTEQ(4, line.len);
+    ASSERT_STREQ("last", line.data);
+    ASSERT(!qio_getline_qs(fp, &b, &line));
+
+    qbuilder_cleanup(&b);
+    qstring_cleanup(long_line);
+    fclose(fp);
+}
+
+void test_qio_reader() {
+    FILE* fp = fopen("assets/ozymandias.txt", "r");
+    qio_reader r = qio_reader_new(fp, 0);
+    qrange line;
+
+    ASSERT(qio_reader_readline(&r, &line));
+    ASSERT(qrange_equals(line,
+        qrange_new(qliteral("I met a traveller from an antique land,"))));
+    ASSERT(qio_reader_readline(&r, &line));
+    ASSERT(qrange_equals(line, qrange_new(
+        qliteral("Who said: Two vast and trunkless legs of stone"))));
+
+    size_t nlines = 2;
+    while (qio_reader_readline(&r, &line)) {
+        nlines++;
+    }
+    /* A trailing newline does not produce an extra empty line. */
+    ASSERT_UINTEQ(15, nlines);
+    ASSERT(qrange_equals(line,
+        qrange_new(qliteral("The lone and level sands stretch far away."))));
+    ASSERT(r.eof);
+    ASSERT(!r.error);
+    ASSERT(!qio_reader_readline(&r, &line));
+
+    qio_reader_cleanup(&r);
+    fclose(fp);
+
+    /* A tiny buffer forces lines to straddle refills and the buffer to grow. */
+    fp = tmpfile();
+    fputs("a\n\nlonger than the buffer\nlast", fp);
+    rewind(fp);
+    r = qio_reader_new(fp, 4);
+
+    ASSERT(qio_reader_readline(&r, &line));
+    ASSERT(qrange_equals(line, qrange_new(qliteral("a"))));
+    ASSERT(qio_reader_readline(&r, &line));
+    ASSERT_UINTEQ(0, line.len);
+    ASSERT(qio_reader_readline(&r, &line));
+    ASSERT(qrange_equals(line,
+        qrange_new(qliteral("longer than the buffer"))));
+    /* The last line has no newline. */
+    ASSERT(qio_reader_readline(&r, &line));
+    ASSERT(qrange_equals(line, qrange_new(qliteral("last"))));
+    ASSERT(!qio_reader_readline(&r, &line));
+
+    qio_reader_cleanup(&r);
+    fclose(fp);
+
+    /* An empty file has no lines. */
+    fp = tmpfile();
+    r = qio_reader_new(fp, 0);
+    ASSERT(!qio_reader_readline(&r, &line));
+    ASSERT(r.eof);
+    qio_reader_cleanup(&r);
+    fclose(fp);
+}
+
+void test_qio_writer() {
+    FILE* fp = tmpfile();
+    qio_writer w = qio_writer_new(fileno(fp), 16);
+
+    ASSERT(qio_writer_write(&w, qliteral("abc")));
+    ASSERT(qio_writer_write_range(&w, qrange_new(qliteral(","))));
+    ASSERT(qio_writer_write_buffer(&w, "def\n", 4));
+    /* Nothing has reached the file yet. */
+    ASSERT_UINTEQ(0, lseek(fileno(fp), 0, SEEK_END));
+
+    /* Pieces too large for the buffer are written straight through. */
+    qrange pieces[] = {
+        qrange_new(qliteral("a longer field")),
+        qrange_new(qliteral("\t")),
+        qrange_new(qliteral("")),
+        qrange_new(qliteral("another longer field\n")),
+    };
+    ASSERT(qio_writer_writev(&w, pieces, 4));
+    ASSERT(qio_writer_write(&w, qliteral("end")));
+    ASSERT(qio_writer_close(&w));
+
+    rewind(fp);
+    char contents[128];
+    size_t n = fread(contents, 1, sizeof contents - 1, fp);
+    contents[n] = '\0';
+    ASSERT_STREQ("abc,def\na longer field\tanother longer field\nend",
+        contents);
+    fclose(fp);
+
+    /* Small pieces that overflow the buffer are still gathered in it, and
+     * whatever is gathered last stays buffered.
+     */
+    fp = tmpfile();
+    w = qio_writer_new(fileno(fp), 16);
+    qrange small[] = {
+        qrange_new(qliteral("0123456789")),
+        qrange_new(qliteral("abcdefghij")),
+        qrange_new(qliteral("ABCDEFGHIJ")),
+    };
+    ASSERT(qio_writer_write(&w, qliteral("head")));
+    ASSERT(qio_writer_writev(&w, small, 3));
+    ASSERT_UINTEQ(24, lseek(fileno(fp), 0, SEEK_END));
+    ASSERT(qio_writer_close(&w));
+    rewind(fp);
+    n = fread(contents, 1, sizeof contents - 1, fp);
+    contents[n] = '\0';
+    ASSERT_STREQ("head0123456789abcdefghijABCDEFGHIJ", contents);
+    fclose(fp);
+
+    /* More pieces than a single writev call takes. */
+    fp = tmpfile();
+    w = qio_writer_new(fileno(fp), 16);
+    qrange many[3000];
+    for (size_t i = 0; i < 3000; i++) {
+        many[i] = qrange_new(qliteral("xyz"));
+    }
+    ASSERT(qio_writer_writev(&w, many, 3000));
+    ASSERT(qio_writer_writev(&w, many, 3000));
+    ASSERT(qio_writer_writev(&w, many, 1000));
+    ASSERT(qio_writer_close(&w));
+    ASSERT_UINTEQ(3 * 7000, lseek(fileno(fp), 0, SEEK_END));
+    fclose(fp);
+
+    /* Writing to a file descriptor that isn't open fails, and keeps failing. */
+    w = qio_writer_new(-1, 4);
+    ASSERT(qio_writer_write(&w, qliteral("ab")));
+    ASSERT(!qio_writer_write(&w, qliteral("too long")));
+    ASSERT(w.error);
+    ASSERT(!qio_writer_write(&w, qliteral("a")));
+    ASSERT(!qio_writer_close(&w));
+}
+
+void test_qio_stream() {
+    int fd = open("assets/ozymandias.txt", O_RDONLY);
+    qio_stream* s = qio_stream_new(fd, 0);
+    qrange line;
+
+    ASSERT(qio_stream_readline(s, &line));
+    ASSERT(qrange_equals(line,
+        qrange_new(qliteral("I met a traveller from an antique land,"))));
+    size_t nlines = 1;
+    while (qio_stream_readline(s, &line)) {
+        nlines++;
+    }
+    ASSERT_UINTEQ(15, nlines);
+    ASSERT(qrange_equals(line,
+        qrange_new(qliteral("The lone and level sands stretch far away."))));
+    ASSERT(!qio_stream_error(s));
+    ASSERT(!qio_stream_readline(s, &line));
+
+    qio_stream_close(s);
+    close(fd);
+
+    /* Tiny blocks make most lines span several blocks. */
+    qstring expected = qio_readpath_qs("assets/ozymandias.txt");
+    fd = open("assets/ozymandias.txt", O_RDONLY);
+    s = qio_stream_new(fd, 7);
+    qbuilder b = qbuilder_new();
+    while (qio_stream_readline(s, &line)) {
+        qbuilder_append_buffer(&b, line.data, line.len);
+        qbuilder_append_char(&b, '\n');
+    }
+    qstring actual = qbuilder_finish(&b);
+    ASSERT_STREQ(expected.data, actual.data);
+    qstring_cleanup(actual);
+    qio_stream_close(s);
+    close(fd);
+
+    /* The block interface returns the whole file in order. */
+    fd = open("assets/ozymandias.txt", O_RDONLY);
+    s = qio_stream_new(fd, 100);
+    qrange block;
+    while (qio_stream_next_block(s, &block)) {
+        ASSERT(block.len <= 100);
+        qbuilder_append_buffer(&b, block.data, block.len);
+    }
+    actual = qbuilder_finish(&b);
+    ASSERT_STREQ(expected.data, actual.data);
+    qstring_cleanup(actual);
+    qio_stream_close(s);
+    close(fd);
+
+    /* A final line without a newline, and a stream closed early. */
+    FILE* fp = tmpfile();
+    fputs("first\nsecond", fp);
+    fflush(fp);
+    rewind(fp);
+    s = qio_stream_new(fileno(fp), 4);
+    ASSERT(qio_stream_readline(s, &line));
+    ASSERT(qrange_equals(line, qrange_new(qliteral("first"))));
+    ASSERT(qio_stream_readline(s, &line));
+    ASSERT(qrange_equals(line, qrange_new(qliteral("second"))));
+    ASSERT(!qio_stream_readline(s, &line));
+    qio_stream_close(s);
+
+    rewind(fp);
+    s = qio_stream_new(fileno(fp), 4);
+    ASSERT(qio_stream_next_block(s, &block));
+    qio_stream_close(s);
+    fclose(fp);
+
+    /* Closing a stream doesn't wait for input that may never come. */
+    int fds[2];
+    ASSERT(pipe(fds) == 0);
+    s = qio_stream_new(fds[0], 0);
+    qio_stream_close(s);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Reading a directory is an error. */
+    fd = open("assets", O_RDONLY);
+    s = qio_stream_new(fd, 0);
+    ASSERT(!qio_stream_next_block(s, &block));
+    ASSERT(qio_stream_error(s));
+    qio_stream_close(s);
+    close(fd);
+
+    qstring_cleanup(expected);
+}
+
+void test_qstring_utf8() {
+    /* One, two, three and four-byte sequences. */
+    qstring_utf8 u = qstring_utf8_new("a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+    ASSERT_UINTEQ(4, u.len);
+    ASSERT_UINTEQ(0x61, u.data[0]);
+    ASSERT_UINTEQ(0xE9, u.data[1]);
+    ASSERT_UINTEQ(0x20AC, u.data[2]);
+    ASSERT_UINTEQ(0x1F600, u.data[3]);
+    ASSERT_UINTEQ(0, u.data[4]);
+
+    qstring qs = qstring_utf8_encode(u);
+    ASSERT_STREQ("a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80", qs.data);
+    ASSERT_UINTEQ(10, qs.len);
+    qstring_cleanup(qs);
+    qstring_utf8_cleanup(u);
+
+    /* Long ASCII runs take the fast path, and must stop at the first
+     * non-ASCII byte even in the middle of a block.
+     */
+    u = qstring_utf8_new("abcdefghijklmnopqrstuvwxyz0123456789\xd0\xaf!");
+    ASSERT_UINTEQ(38, u.len);
+    ASSERT_UINTEQ('z', u.data[25]);
+    ASSERT_UINTEQ(0x42F, u.data[36]);
+    ASSERT_UINTEQ('!', u.data[37]);
+    qs = qstring_utf8_encode(u);
+    ASSERT_STREQ("abcdefghijklmnopqrstuvwxyz0123456789\xd0\xaf!", qs.data);
+    qstring_cleanup(qs);
+    qstring_utf8_cleanup(u);
+
+    /* The empty string. */
+    u = qstring_utf8_new("");
+    ASSERT(u.data != NULL);
+    ASSERT_UINTEQ(0, u.len);
+    qstring_utf8_cleanup(u);
+
+    /* Invalid sequences: a lone continuation byte, an overlong encoding, a
+     * surrogate, a code point beyond U+10FFFF, a truncated sequence and a
+     * byte that can never appear.
+     */
+    const char* invalid[] = {
+        "\x80", "abc\xc0\xaf", "\xe0\x80\xaf", "\xed\xa0\x80",
+        "\xf4\x90\x80\x80", "\xe2\x82", "\xf0\x9f\x98", "x\xff",
+    };
+    for (size_t i = 0; i < sizeof invalid / sizeof invalid[0]; i++) {
+        u = qstring_utf8_new(invalid[i]);
+        ASSERT(u.data == NULL);
+    }
+
+    /* Code points that can't be encoded. */
+    utf8_char surrogate[] = {0x41, 0xD800};
+    qstring_utf8 bad = {.len = 2, .data = surrogate};
+    ASSERT(qstring_utf8_encode(bad).data == NULL);
+    utf8_char too_big[] = {0x110000};
+    bad = (qstring_utf8){.len = 1, .data = too_big};
+    ASSERT(qstring_utf8_encode(bad).data == NULL);
+
+    /* Round-trip a whole file. */
+    qstring file = qio_readpath_qs("assets/kern_utf8.txt");
+    u = qstring_utf8_decode(file);
+    ASSERT_UINTEQ(640, u.len);
+    ASSERT_UINTEQ(0x42F, u.data[0]);
+    qs = qstring_utf8_encode(u);
+    ASSERT_UINTEQ(file.len, qs.len);
+    ASSERT(memcmp(file.data, qs.data, qs.len) == 0);
+    qstring_cleanup(qs);
+    qstring_utf8_cleanup(u);
+    qstring_cleanup(file);
+}
+
+/* Check qstring_utf8_validate and qstring_utf8_count against the decoder. */
+static bool utf8_agrees(const char* data, size_t n) {
+    qstring qs = {.len = n, .data = (char*)data};
+    qstring_utf8 u = qstring_utf8_decode(qs);
+    bool valid = u.data != NULL;
+    bool agrees = qstring_utf8_validate(qs) == valid &&
+        (!valid || qstring_utf8_count(qs) == u.len);
+    qstring_utf8_cleanup(u);
+    return agrees;
+}
+
+void test_qstring_utf8_validate() {
+    ASSERT(qstring_utf8_validate(qliteral("")));
+    ASSERT(qstring_utf8_validate(qliteral("plain ASCII")));
+    ASSERT(qstring_utf8_validate(qliteral("\xd0\xaf \xe2\x82\xac")));
+    ASSERT(!qstring_utf8_validate(qliteral("\xed\xa0\x80")));
+    ASSERT_UINTEQ(0, qstring_utf8_count(qliteral("")));
+    ASSERT_UINTEQ(3, qstring_utf8_count(qliteral("\xd0\xaf \xe2\x82\xac")));
+
+    qstring file = qio_readpath_qs("assets/kern_utf8.txt");
+    ASSERT(qstring_utf8_validate(file));
+    ASSERT_UINTEQ(640, qstring_utf8_count(file));
+    /* Truncating the file in the middle of a character makes it invalid. */
+    qstring cut = {.len = 1, .data = file.data};
+    ASSERT(!qstring_utf8_validate(cut));
+    qstring_cleanup(file);
+
+    /* Every pair of bytes, at every position in and around a 32-byte block,
+     * so that sequences straddle block boundaries.
+     */
+    char buffer[80];
+    bool agrees = true;
+    for (size_t pos = 28; pos < 36 && agrees; pos++) {
+        for (int a = 0x80; a < 0x100 && agrees; a++) {
+            for (int b = 0; b < 0x100 && agrees; b++) {
+                memset(buffer, 'x', sizeof buffer);
+                buffer[pos] = a;
+                buffer[pos + 1] = b;
+                agrees = utf8_agrees(buffer, sizeof buffer) &&
+                    utf8_agrees(buffer, pos + 2);
+            }
+        }
+    }
+    ASSERT(agrees);
+
+    /* Random mixtures of valid sequences and stray bytes. */
+    const char* pieces[] = {
+        "a", "\xd0\xaf", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+        "\xf4\x8f\xbf\xbf", "\xef\xbf\xbf", "\xc2\x80", "\x80", "\xe2\x82",
+        "\xf5", "\xc0\x80", "\xed\xbf\xbf", "\xf0\x8f\xbf\xbf",
+    };
+    size_t npieces = sizeof pieces / sizeof pieces[0];
+    unsigned long state = 1;
+    for (size_t trial = 0; trial < 20000 && agrees; trial++) {
+        qbuilder b = qbuilder_new();
+        size_t count = trial % 50;
+        for (size_t i = 0; i < count; i++) {
+            state = state * 1103515245 + 12345;
+            /* Mostly valid pieces, so that many strings are valid. */
+            size_t which = (state >> 16) % (npieces * 4);
+            qbuilder_append(&b, qliteral(pieces[which < npieces * 3 ?
+                which % 6 : which % npieces]));
+        }
+        qstring qs = qbuilder_finish(&b);
+        agrees = utf8_agrees(qs.data, qs.len);
+        qstring_cleanup(qs);
+    }
+    ASSERT(agrees);
+}
+
+void test_qutf8() {
+    qstring file = qio_readpath_qs("assets/kern_utf8.txt");
+    qstring_utf8 wide = qstring_utf8_decode(file);
+    qutf8 u = qutf8_new(qrange_new(file));
+    ASSERT(u.bytes.data != NULL);
+    ASSERT_UINTEQ(640, u.len);
+    /* Nothing is indexed until it is needed. */
+    ASSERT(u.index == NULL);
+    ASSERT_UINTEQ(0x42F, qutf8_at(&u, 0));
+
+    /* Every code point agrees with the decoded string, in any order. */
+    bool agrees = true;
+    for (size_t i = 0; i < wide.len; i++) {
+        size_t j = (i * 7919) % wide.len;
+        agrees = agrees && qutf8_at(&u, j) == wide.data[j];
+    }
+    ASSERT(agrees);
+    ASSERT(u.index != NULL);
+    ASSERT_UINTEQ(0, qutf8_at(&u, 640));
+    ASSERT_UINTEQ(file.len, qutf8_offset(&u, 640));
+
+    /* "Я помню" is 7 code points and 13 bytes. */
+    qrange sub = qutf8_substr(&u, 0, 7);
+    ASSERT(qrange_equals(sub, qrange_new(qliteral(
+        "\xd0\xaf \xd0\xbf\xd0\xbe\xd0\xbc\xd0\xbd\xd1\x8e"))));
+    sub = qutf8_substr(&u, 638, 100);
+    ASSERT(qrange_equals(sub, qrange_new(qliteral(".\n"))));
+    sub = qutf8_substr(&u, 640, 1);
+    ASSERT_UINTEQ(0, sub.len);
+
+    /* Searching returns code point indices, before and after the first
+     * indexed code point.
+     */
+    ASSERT_UINTEQ(2, qutf8_find(&u, qliteral("\xd0\xbf\xd0\xbe\xd0\xbc")));
+    qstring last_line = qliteral("\xd0\x98 \xd0\xb1\xd0\xbe\xd0\xb6");
+    size_t at = qutf8_find(&u, last_line);
+    ASSERT(at > QUTF8_STRIDE);
+    ASSERT_UINTEQ(0x418, wide.data[at]);
+    ASSERT_UINTEQ(640, qutf8_find(&u, qliteral("missing")));
+
+    qutf8_cleanup(&u);
+    qstring_utf8_cleanup(wide);
+
+    /* Short and invalid text. */
+    u = qutf8_new(qrange_new(qliteral("a\xe2\x82\xac" "b")));
+    ASSERT_UINTEQ(3, u.len);
+    ASSERT_UINTEQ(0x20AC, qutf8_at(&u, 1));
+    ASSERT_UINTEQ(2, qutf8_find(&u, qliteral("b")));
+    qutf8_cleanup(&u);
+    u = qutf8_new(qrange_new(qliteral("a\xe2\x82")));
+    ASSERT(u.bytes.data == NULL);
+    qutf8_cleanup(&u);
+
+    qstring_cleanup(file);
+}
+
+void test_qstring_utf8_case_insensitive() {
+    /* Expected foldings, from CaseFolding.txt. */
+    utf8_char folds[][2] = {
+        {0x41, 0x61}, {0x5B, 0x5B}, {0xB5, 0x3BC}, {0xC0, 0xE0}, {0xD7, 0xD7},
+        {0x100, 0x101}, {0x101, 0x101}, {0x130, 0x130}, {0x178, 0xFF},
+        {0x17F, 0x73}, {0x3A3, 0x3C3}, {0x3C2, 0x3C3}, {0x400, 0x450},
+        {0x42F, 0x44F}, {0x1E9E, 0xDF}, {0x212A, 0x6B}, {0x2126, 0x3C9},
+        {0xAB70, 0x13A0}, {0xFF21, 0xFF41}, {0x10400, 0x10428},
+        {0x1E900, 0x1E922}, {0x10FFFF, 0x10FFFF},
+    };
+    bool agrees = true;
+    for (size_t i = 0; i < sizeof folds / sizeof folds[0]; i++) {
+        agrees = agrees && qstring_utf8_fold(folds[i][0]) == folds[i][1];
+    }
+    ASSERT(agrees);
+
+    /* UTF-8 qstrings. */
+    qstring upper = qliteral(
+        "\xd0\xaf \xd0\x9f\xd0\x9e\xd0\x9c\xd0\x9d\xd0\xae");
+    qstring lower = qliteral(
+        "\xd1\x8f \xd0\xbf\xd0\xbe\xd0\xbc\xd0\xbd\xd1\x8e");
+    ASSERT(qstring_equals_ci_utf8(upper, lower));
+    ASSERT(!qstring_equals_ci(upper, lower));
+    ASSERT(qstring_startswith_ci_utf8(lower, qliteral("\xd0\xaf")));
+    ASSERT(!qstring_equals_ci_utf8(upper, qliteral("\xd1\x8f")));
+    /* The Kelvin sign is three bytes and folds to a one-byte k. */
+    ASSERT(qstring_equals_ci_utf8(qliteral("\xe2\x84\xaa" "elvin"),
+        qliteral("KELVIN")));
+
+    qstring file = qio_readpath_qs("assets/kern_utf8.txt");
+    /* "ЧЕРТЫ", which appears twice in lowercase. */
+    qstring word = qliteral("\xd0\xa7\xd0\x95\xd0\xa0\xd0\xa2\xd0\xab");
+    size_t at = qstring_find_ci_utf8(file, word);
+    ASSERT(at < file.len);
+    ASSERT(memcmp(file.data + at, "\xd1\x87\xd0\xb5\xd1\x80\xd1\x82\xd1\x8b",
+        10) == 0);
+    ASSERT_UINTEQ(qstring_count(file,
+        qliteral("\xd1\x87\xd0\xb5\xd1\x80\xd1\x82\xd1\x8b")),
+        qstring_count_ci_utf8(file, word));
+    ASSERT_UINTEQ(file.len, qstring_find_ci_utf8(file, qliteral("missing")));
+    ASSERT_UINTEQ(0, qstring_find_ci_utf8(file, qliteral("")));
+    /* Invalid bytes only match themselves. */
+    ASSERT_UINTEQ(1, qstring_find_ci_utf8(qliteral("a\xff\xdf"),
+        qliteral("\xff")));
+    ASSERT(!qstring_equals_ci_utf8(qliteral("\xc0"), qliteral("\xe0")));
+
+    /* qstring_utf8s. */
+    qstring_utf8 wide = qstring_utf8_decode(file);
+    qstring_utf8 wide_word = qstring_utf8_decode(word);
+    size_t index = qstring_utf8_find_ci(wide, wide_word);
+    ASSERT(index < wide.len);
+    ASSERT_UINTEQ(0x447, wide.data[index]);
+    ASSERT_UINTEQ(qstring_count_ci_utf8(file, word),
+        qstring_utf8_count_ci(wide, wide_word));
+    qstring_utf8 line = qstring_utf8_new("\xd1\x8f \xd0\x9f\xd0\xbe\xd0\xbc");
+    ASSERT(qstring_utf8_startswith_ci(wide, line));
+    ASSERT(!qstring_utf8_equals_ci(wide, line));
+    qstring_utf8 upper_wide = qstring_utf8_decode(upper);
+    qstring_utf8 lower_wide = qstring_utf8_decode(lower);
+    ASSERT(qstring_utf8_equals_ci(upper_wide, lower_wide));
+
+    qstring_utf8_cleanup(upper_wide);
+    qstring_utf8_cleanup(lower_wide);
+    qstring_utf8_cleanup(line);
+    qstring_utf8_cleanup(wide_word);
+    qstring_utf8_cleanup(wide);
+    qstring_cleanup(file);
+}
+
+void test_qio_utf8() {
+    FILE* fp = fopen("assets/kern_utf8.txt", "r");
+    qstring_utf8 line = qio_utf8_readline(fp);
+    ASSERT_UINTEQ(25, line.len);
+    ASSERT_UINTEQ(0x42F, line.data[0]);
+    ASSERT_UINTEQ(':', line.data[24]);
+
+    /* The rest of the file. */
+    qstring_utf8 rest = qio_utf8_read(fp);
+    ASSERT_UINTEQ(640 - 26, rest.len);
+    fclose(fp);
+
+    /* Write it back out and compare with the original. */
+    fp = tmpfile();
+    ASSERT_UINTEQ(46, qio_utf8_write(fp, line));
+    fputc('\n', fp);
+    ASSERT_UINTEQ(1144 - 47, qio_utf8_write(fp, rest));
+    rewind(fp);
+    qstring_utf8 all = qio_utf8_read(fp);
+    ASSERT_UINTEQ(640, all.len);
+    fclose(fp);
+
+    qstring file = qio_readpath_qs("assets/kern_utf8.txt");
+    qstring_utf8 expected = qstring_utf8_decode(file);
+    qstring_cleanup(file);
+    ASSERT(memcmp(expected.data, all.data, 640 * sizeof(utf8_char)) == 0);
+
+    qstring_utf8_cleanup(line);
+    qstring_utf8_cleanup(rest);
+    qstring_utf8_cleanup(all);
+    qstring_utf8_cleanup(expected);
+
+    /* Invalid UTF-8 in a file. */
+    fp = tmpfile();
+    fputs("ok\n\xc0\x80\n", fp);
+    rewind(fp);
+    line = qio_utf8_readline(fp);
+    ASSERT_UINTEQ(2, line.len);
+    qstring_utf8_cleanup(line);
+    line = qio_utf8_readline(fp);
+    ASSERT(line.data == NULL);
+    fclose(fp);
+}
+
+typedef struct {
+    size_t nlines;
+    size_t nbytes;
+    size_t nmatches;
+    /* The number of chunks that did not end with a newline or at the end of
+       the data. */
+    size_t nsplit;
+} parallel_counts;
+
+static void count_chunk(qrange chunk, void* result, void* ctx) {
+    parallel_counts* counts = result;
+    const qrange* whole = ctx;
+    counts->nbytes += chunk.len;
+    counts->nmatches += qrange_count(chunk, qliteral("needle"));
+    bool at_end = chunk.data + chunk.len == whole->data + whole->len;
+    if (chunk.len > 0 && !at_end && chunk.data[chunk.len - 1] != '\n') {
+        counts->nsplit++;
+    }
+}
+
+static void count_line(qrange line, void* result, void* ctx) {
+    parallel_counts* counts = result;
+    counts->nlines++;
+    counts->nbytes += line.len;
+}
+
+static void merge_counts(void* into, const void* from, void* ctx) {
+    parallel_counts* a = into;
+    const parallel_counts* b = from;
+    a->nlines += b->nlines;
+    a->nbytes += b->nbytes;
+    a->nmatches += b->nmatches;
+    a->nsplit += b->nsplit;
+}
+
+void test_qio_parallel() {
+    /* 5000 lines of varying length, every third one with a match. */
+    qbuilder b = qbuilder_new();
+    for (size_t i = 0; i < 5000; i++) {
+        qbuilder_append_format(&b, qliteral("line %zu %s\n"), i,
+            (i % 3 == 0) ? "needle" : "haystack");
+    }
+    qstring text = qbuilder_finish(&b);
+    qrange whole = qrange_new(text);
+
+    qio_parallel job = {.nthreads = 4, .chunk = count_chunk, .line = NULL,
+        .result_size = sizeof(parallel_counts), .merge = merge_counts,
+        .ctx = &whole};
+    parallel_counts counts = {0, 0, 0, 0};
+    ASSERT(qio_parallel_range(whole, &job, &counts));
+    ASSERT_UINTEQ(text.len, counts.nbytes);
+    ASSERT_UINTEQ(1667, counts.nmatches);
+    ASSERT_UINTEQ(0, counts.nsplit);
+
+    /* The same job on one thread, and on more threads than there are lines. */
+    job.nthreads = 1;
+    counts = (parallel_counts){0, 0, 0, 0};
+    ASSERT(qio_parallel_range(whole, &job, &counts));
+    ASSERT_UINTEQ(1667, counts.nmatches);
+    job.nthreads = 10000;
+    counts = (parallel_counts){0, 0, 0, 0};
+    ASSERT(qio_parallel_range(whole, &job, &counts));
+    ASSERT_UINTEQ(1667, counts.nmatches);
+    ASSERT_UINTEQ(0, counts.nsplit);
+
+    /* Per-line callbacks see every line exactly once, without newlines. */
+    job.nthreads = 4;
+    job.chunk = NULL;
+    job.line = count_line;
+    counts = (parallel_counts){0, 0, 0, 0};
+    ASSERT(qio_parallel_range(whole, &job, &counts));
+    ASSERT_UINTEQ(5000, counts.nlines);
+    ASSERT_UINTEQ(text.len - 5000, counts.nbytes);
+
+    /* A file, using every CPU. */
+    job.nthreads = 0;
+    counts = (parallel_counts){0, 0, 0, 0};
+    ASSERT(qio_parallel_path("assets/ozymandias.txt", &job, &counts));
+    ASSERT_UINTEQ(15, counts.nlines);
+    ASSERT(!qio_parallel_path("assets/no_such_file.txt", &job, &counts));
+
+    qstring_cleanup(text);
 }
 
 int main() {
@@ -342,12 +2407,52 @@ int main() {
     test_qstring_replace();
     test_qstring_find();
     test_qstring_count();
+    test_qpattern();
+    test_qmatcher();
     test_qstring_startswith_endswith();
+    test_qstring_case_insensitive();
     test_qstring_strip();
+    test_qrange();
+    test_qsplit();
+
+    /* Test the qbuilder library. */
+    test_qbuilder();
+
+    /* Test the qarena library. */
+    test_qarena();
+
+    /* Test the qhash library. */
+    test_qhash();
+    test_qmap();
+
+    /* Test the qintern library. */
+    test_qintern();
+
+    /* Test the qrope library. */
+    test_qrope();
+
+    /* Test the qshared library. */
+    test_qshared();
+
+    /* Test the qsmall library. */
+    test_qsmall();
 
     /* Test the qio library. */
     test_qio_readpath();
+    test_qio_mappath();
     test_qio_readline();
+    test_qio_getline();
+    test_qio_reader();
+    test_qio_writer();
+    test_qio_stream();
+    test_qio_parallel();
+
+    /* Test the qstring_utf8 and qio_utf8 libraries. */
+    test_qstring_utf8();
+    test_qstring_utf8_validate();
+    test_qutf8();
+    test_qstring_utf8_case_insensitive();
+    test_qio_utf8();
 
     unsigned int tests_run = tests_failed + tests_passed;
     const char* plural = (tests_run == 1) ? "" : "s";